@@ -0,0 +1,158 @@
+// 多核运行时吞吐测试: 对本地 echo 服务，分别用 1, 2, 4 ... N 个 I/O 线程，
+// 每个连接保持 window 条消息在途，收到回显就再发一条，统计每秒回显的消息数。
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include "libwsclient.h"
+
+typedef struct
+{
+	unsigned long long echoed;	// 只由连接所属的 I/O 线程写
+	bool open;
+} conn_stat;
+
+static int window = 16;
+static size_t msg_size = 64;
+static unsigned char *payload;
+static volatile bool running = true;
+
+static int onopen(wsclient *c)
+{
+	conn_stat *st = c->userdata;
+	__atomic_store_n(&st->open, true, __ATOMIC_RELAXED);
+	for (int i = 0; i < window; i++)
+		libwsclient_send_data(c, OP_CODE_TYPE_BINARY, payload, msg_size);
+	return 0;
+}
+
+static int onmessage(wsclient *c, bool isText, unsigned long long len, unsigned char *data)
+{
+	(void)isText;
+	(void)len;
+	(void)data;
+	conn_stat *st = c->userdata;
+	__atomic_store_n(&st->echoed, st->echoed + 1, __ATOMIC_RELAXED);
+	if (running)
+		libwsclient_send_data(c, OP_CODE_TYPE_BINARY, payload, msg_size);
+	return 0;
+}
+
+static int onerror(wsclient *c, int code, char *msg)
+{
+	(void)c;
+	if (code)
+		fprintf(stderr, "onerror: (%d): %s\n", code, msg);
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long long total_echoed(conn_stat *stats, int n)
+{
+	unsigned long long sum = 0;
+	for (int i = 0; i < n; i++)
+		sum += __atomic_load_n(&stats[i].echoed, __ATOMIC_RELAXED);
+	return sum;
+}
+
+static double run(const char *uri, int workers, int conns, double seconds)
+{
+	wsclient_runtime *rt = libwsclient_runtime_new(workers);
+	if (!rt)
+	{
+		fprintf(stderr, "libwsclient_runtime_new failed\n");
+		return 0;
+	}
+	wsclient_options opts;
+	libwsclient_options_init(&opts);
+	opts.runtime = rt;
+	wsclient **clients = calloc(conns, sizeof(wsclient *));
+	conn_stat *stats = calloc(conns, sizeof(conn_stat));
+	running = true;
+	for (int i = 0; i < conns; i++)
+	{
+		clients[i] = libwsclient_new_with_options(uri, &opts);
+		clients[i]->userdata = &stats[i];
+		clients[i]->onopen = onopen;
+		clients[i]->onmessage = onmessage;
+		clients[i]->onerror = onerror;
+		libwsclient_start_run(clients[i]);
+	}
+	// 等所有连接握手完成，再预热一会。
+	for (int i = 0; i < conns; i++)
+	{
+		for (int k = 0; k < 1000 && !__atomic_load_n(&stats[i].open, __ATOMIC_RELAXED); k++)
+			usleep(10000);
+	}
+	usleep(500000);
+	unsigned long long n0 = total_echoed(stats, conns);
+	double t0 = now();
+	usleep((useconds_t)(seconds * 1e6));
+	unsigned long long n1 = total_echoed(stats, conns);
+	double t1 = now();
+	running = false;
+	for (int i = 0; i < conns; i++)
+		libwsclient_close(clients[i]);
+	libwsclient_runtime_free(rt);
+	free(clients);
+	free(stats);
+	return (n1 - n0) / (t1 - t0);
+}
+
+int main(int argc, char **argv)
+{
+	int conns = 64, max_workers = 0, opt;
+	double seconds = 3;
+	while ((opt = getopt(argc, argv, "c:s:w:t:n:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'c':
+			conns = atoi(optarg);
+			break;
+		case 's':
+			msg_size = strtoul(optarg, NULL, 10);
+			break;
+		case 'w':
+			window = atoi(optarg);
+			break;
+		case 't':
+			seconds = atof(optarg);
+			break;
+		case 'n':
+			max_workers = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-c connections] [-s message size] [-w window] [-t seconds] [-n max workers] ws://host:port/path\n", argv[0]);
+			return 1;
+		}
+	}
+	const char *uri = optind < argc ? argv[optind] : "ws://127.0.0.1:9100/";
+	if (max_workers <= 0)
+	{
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		max_workers = ncpu > 0 ? (int)ncpu : 1;
+	}
+	payload = malloc(msg_size ? msg_size : 1);
+	memset(payload, 'x', msg_size);
+	fprintf(stderr, "%s: %d connections, %zu byte messages, window %d, %.1f s per run\n", uri, conns, msg_size, window, seconds);
+	double base = 0;
+	for (int w = 1; w <= max_workers; w = w * 2 > max_workers && w != max_workers ? max_workers : w * 2)
+	{
+		double rate = run(uri, w, conns, seconds);
+		if (w == 1)
+			base = rate;
+		printf("workers %2d: %10.0f msg/s  x%.2f\n", w, rate, base > 0 ? rate / base : 0);
+		fflush(stdout);
+	}
+	free(payload);
+	return 0;
+}
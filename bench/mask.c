@@ -0,0 +1,104 @@
+// payload mask 吞吐测试: 原来 libwsclient_send_data 中逐字节 header[2 + i % 4] 的循环，
+// 与 mask.c 的 64 位标量、SSE2、AVX2 和按 CPU 选择的 libwsclient_mask 比较，单位 GB/s。
+// 直接包含 mask.c 以便测试其中的 static 函数。
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <getopt.h>
+#include "../mask.c"
+
+typedef size_t (*mask_fn)(unsigned char *dst, const unsigned char *src, size_t len, const unsigned char key[4], size_t offset);
+
+static const unsigned char key[4] = {0x3c, 0xa5, 0x0f, 0x96};
+static volatile unsigned char sink;
+
+// 原来的实现: 边 mask 边拷入发送缓冲区。
+static size_t byte_loop(unsigned char *dst, const unsigned char *src, size_t len, const unsigned char header[4], size_t offset)
+{
+	for (size_t i = 0; i < len; i++)
+		dst[i] = src[i] ^ header[i % 4];
+	return offset + len;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 反复 mask size 字节 (dst 故意不对齐)，共约 total 字节，返回 GB/s。
+static double measure(mask_fn fn, unsigned char *dst, const unsigned char *src, size_t size, size_t total)
+{
+	size_t rounds = total / size + 1, offset = 0;
+	double t0 = now();
+	for (size_t r = 0; r < rounds; r++)
+		offset = fn(dst + 1, src, size, key, offset);
+	double t = now() - t0;
+	sink = dst[1 + offset % size]; // 使用结果，不让编译器把循环优化掉
+	return rounds * size / t / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	size_t total = 1ULL << 30;
+	int opt;
+	while ((opt = getopt(argc, argv, "g:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'g':
+			total = (size_t)(atof(optarg) * (1ULL << 30));
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-g GiB per measurement]\n", argv[0]);
+			return 1;
+		}
+	}
+	struct
+	{
+		const char *name;
+		mask_fn fn;
+	} impls[5];
+	int nimpls = 0;
+	impls[nimpls].name = "byte loop";
+	impls[nimpls++].fn = byte_loop;
+	impls[nimpls].name = "scalar";
+	impls[nimpls++].fn = _mask_scalar;
+#ifdef LIBWSCLIENT_MASK_X86
+	if (__builtin_cpu_supports("sse2"))
+	{
+		impls[nimpls].name = "sse2";
+		impls[nimpls++].fn = _mask_sse2;
+	}
+	if (__builtin_cpu_supports("avx2"))
+	{
+		impls[nimpls].name = "avx2";
+		impls[nimpls++].fn = _mask_avx2;
+	}
+#endif
+	impls[nimpls].name = "libwsclient_mask";
+	impls[nimpls++].fn = libwsclient_mask;
+
+	static const size_t sizes[] = {16, 125, 1024, 16 << 10, 1 << 20, 16 << 20};
+	size_t max = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+	unsigned char *src = malloc(max), *dst = malloc(max + 1);
+	for (size_t i = 0; i < max; i++)
+		src[i] = (unsigned char)i;
+
+	printf("%10s", "size");
+	for (int k = 0; k < nimpls; k++)
+		printf("  %16s", impls[k].name);
+	printf("\n");
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+	{
+		printf("%10zu", sizes[s]);
+		for (int k = 0; k < nimpls; k++)
+			printf("  %11.2f GB/s", measure(impls[k].fn, dst, src, sizes[s], total));
+		printf("\n");
+		fflush(stdout);
+	}
+	free(src);
+	free(dst);
+	return 0;
+}
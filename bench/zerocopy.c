@@ -0,0 +1,297 @@
+// 零拷贝发送的 CPU 开销测试: fork 一个本地丢弃服务端 (收到的数据直接丢掉)，分别用 libwsclient_send_data (拷贝)
+// 和 libwsclient_send_zerocopy 发送同样多的数据，统计客户端进程每 GB 消耗的 CPU 时间 (用户态 + 内核态)。
+// 回环设备上内核最终还是要拷贝一次，零拷贝的收益要在真实网卡上才看得出来。
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <getopt.h>
+#include <semaphore.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+#include "libwsclient.h"
+
+static size_t msg_size = 1 << 20;
+static int nbufs = 8;
+static unsigned char **bufs;
+static bool *busy;				// 缓冲区还在等 onzerocopy
+static sem_t free_bufs;
+static volatile bool opened;
+static volatile bool closing;	// libwsclient_close 中服务端先关闭连接会报接收错误，不算失败
+
+// 逐帧跳过收到的数据，收到 close 帧时回一个 close 帧，读到连接关闭后返回。
+static void discard_frames(int fd, unsigned char *buf, size_t size)
+{
+	size_t len = 0;				 // buf 中还没解析的字节
+	unsigned long long skip = 0; // 当前帧还没收到的 payload
+	ssize_t n;
+	while ((n = recv(fd, buf + len, size - len, 0)) > 0)
+	{
+		len += n;
+		size_t pos = 0;
+		for (;;)
+		{
+			size_t k = skip < len - pos ? skip : len - pos;
+			pos += k;
+			skip -= k;
+			if (skip || len - pos < 2)
+				break;
+			unsigned char *p = buf + pos;
+			size_t hlen = 2 + 4; // 客户端的帧都带 mask
+			unsigned long long plen = p[1] & 0x7f;
+			if (plen == 126)
+				hlen += 2;
+			else if (plen == 127)
+				hlen += 8;
+			if (len - pos < hlen)
+				break;
+			if (plen == 126)
+				plen = p[2] << 8 | p[3];
+			else if (plen == 127)
+			{
+				plen = 0;
+				for (int i = 0; i < 8; i++)
+					plen = plen << 8 | p[2 + i];
+			}
+			if ((p[0] & 0x0f) == OP_CODE_CONTROL_CLOSE)
+			{
+				// 回 close 帧后读到客户端关闭为止，提前 close 未读完的数据会让客户端收到 RST。
+				send(fd, "\x88\x00", 2, 0);
+				shutdown(fd, SHUT_WR);
+			}
+			pos += hlen;
+			skip = plen;
+		}
+		memmove(buf, buf + pos, len - pos);
+		len -= pos;
+	}
+}
+
+// 丢弃服务端: 完成握手后把收到的数据都丢掉，连接关闭后接受下一个连接。
+static void discard_server(int lfd)
+{
+	static char buf[1 << 20];
+	for (;;)
+	{
+		int fd = accept(lfd, NULL, NULL);
+		if (fd < 0)
+			continue;
+		size_t len = 0;
+		ssize_t n;
+		char *end = NULL;
+		while (!end && len < sizeof(buf) - 1 && (n = recv(fd, buf + len, sizeof(buf) - 1 - len, 0)) > 0)
+		{
+			len += n;
+			buf[len] = '\0';
+			end = strstr(buf, "\r\n\r\n");
+		}
+		char *key = end ? strcasestr(buf, "Sec-WebSocket-Key:") : NULL;
+		if (key)
+		{
+			key += strlen("Sec-WebSocket-Key:");
+			key += strspn(key, " ");
+			char src[128];
+			unsigned char sha[SHA_DIGEST_LENGTH], accept_key[64];
+			snprintf(src, sizeof(src), "%.*s258EAFA5-E914-47DA-95CA-C5AB0DC85B11", (int)strcspn(key, "\r\n "), key);
+			SHA1((unsigned char *)src, strlen(src), sha);
+			EVP_EncodeBlock(accept_key, sha, SHA_DIGEST_LENGTH);
+			char resp[256];
+			int rlen = snprintf(resp, sizeof(resp), "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+													"Sec-WebSocket-Accept: %s\r\n\r\n",
+								accept_key);
+			if (send(fd, resp, rlen, 0) == rlen)
+				discard_frames(fd, (unsigned char *)buf, sizeof(buf));
+		}
+		close(fd);
+	}
+}
+
+static int onopen(wsclient *c)
+{
+	(void)c;
+	opened = true;
+	return 0;
+}
+
+static int onerror(wsclient *c, int code, char *msg)
+{
+	(void)c;
+	if (code && !closing)
+		fprintf(stderr, "onerror: (%d): %s\n", code, msg);
+	return 0;
+}
+
+static int onzerocopy(wsclient *c, unsigned char *payload, void *cookie)
+{
+	(void)c;
+	(void)payload;
+	__atomic_store_n(&busy[(intptr_t)cookie], false, __ATOMIC_SEQ_CST);
+	sem_post(&free_bufs);
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpu_time(void)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+// 发送 total 字节，返回每 GB 的 CPU 秒数，*gbps 返回吞吐。
+static double run(const char *uri, bool zerocopy, unsigned long long fragment_size, unsigned long long total, double *gbps)
+{
+	wsclient_options opts;
+	libwsclient_options_init(&opts);
+	opts.fragment_size = fragment_size;
+	opts.zerocopy_threshold = zerocopy ? 1 : 0;
+	wsclient *c = libwsclient_new_with_options(uri, &opts);
+	if (!c)
+		return 0;
+	c->onopen = onopen;
+	c->onerror = onerror;
+	c->onzerocopy = onzerocopy;
+	opened = false;
+	closing = false;
+	libwsclient_start_run(c);
+	for (int k = 0; k < 1000 && !opened; k++)
+		usleep(10000);
+	if (!opened)
+	{
+		fprintf(stderr, "connect to %s failed\n", uri);
+		closing = true;
+		libwsclient_close(c);
+		return 0;
+	}
+	if (zerocopy && !(c->flags & FLAG_CLIENT_ZEROCOPY))
+		fprintf(stderr, "SO_ZEROCOPY not supported, zerocopy run will copy\n");
+	sem_init(&free_bufs, 0, nbufs);
+	unsigned long long sent = 0;
+	int ret = 0;
+	double cpu0 = cpu_time(), t0 = now();
+	for (int i = 0; sent < total && ret == 0; i = (i + 1) % nbufs)
+	{
+		if (zerocopy)
+		{
+			// 零拷贝时缓冲区要等 onzerocopy 回调后才能再用。
+			while (sem_wait(&free_bufs) < 0)
+				;
+			while (__atomic_load_n(&busy[i], __ATOMIC_SEQ_CST))
+				i = (i + 1) % nbufs;
+			__atomic_store_n(&busy[i], true, __ATOMIC_SEQ_CST);
+			ret = libwsclient_send_zerocopy(c, OP_CODE_TYPE_BINARY, bufs[i], msg_size, (void *)(intptr_t)i);
+		}
+		else
+			ret = libwsclient_send_data(c, OP_CODE_TYPE_BINARY, bufs[i], msg_size);
+		sent += msg_size;
+	}
+	if (zerocopy && ret == 0)
+	{
+		// 等最后几条消息的完成通知，这部分开销也算在内。
+		for (int i = 0; i < nbufs; i++)
+		{
+			while (sem_wait(&free_bufs) < 0)
+				;
+		}
+	}
+	double cpu = cpu_time() - cpu0, t = now() - t0;
+	closing = true;
+	libwsclient_close(c);
+	sem_destroy(&free_bufs);
+	if (ret != 0)
+	{
+		fprintf(stderr, "send failed: %d\n", ret);
+		return 0;
+	}
+	*gbps = sent / t / 1e9;
+	return cpu / (sent / 1e9);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long long total = 4ULL << 30, fragment_size = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "s:g:f:b:")) != -1)
+	{
+		switch (opt)
+		{
+		case 's':
+			msg_size = strtoul(optarg, NULL, 10);
+			break;
+		case 'g':
+			total = (unsigned long long)(atof(optarg) * (1ULL << 30));
+			break;
+		case 'f':
+			fragment_size = strtoull(optarg, NULL, 10);
+			break;
+		case 'b':
+			nbufs = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-s message size] [-g GiB to send] [-f fragment size] [-b buffers]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (msg_size == 0 || nbufs <= 0)
+	{
+		fprintf(stderr, "message size and buffers must be positive\n");
+		return 1;
+	}
+
+	int lfd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+	socklen_t alen = sizeof(addr);
+	if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(lfd, 4) < 0 ||
+		getsockname(lfd, (struct sockaddr *)&addr, &alen) < 0)
+	{
+		perror("listen");
+		return 1;
+	}
+	pid_t pid = fork();
+	if (pid < 0)
+	{
+		perror("fork");
+		return 1;
+	}
+	if (pid == 0)
+		discard_server(lfd);
+	close(lfd);
+
+	char uri[64];
+	snprintf(uri, sizeof(uri), "ws://127.0.0.1:%d/", ntohs(addr.sin_port));
+	bufs = calloc(nbufs, sizeof(unsigned char *));
+	busy = calloc(nbufs, sizeof(bool));
+	for (int i = 0; i < nbufs; i++)
+	{
+		bufs[i] = malloc(msg_size);
+		memset(bufs[i], 'x', msg_size);
+	}
+	fprintf(stderr, "%s: %.1f GiB in %zu byte messages, fragment size %llu, %d buffers\n", uri, total / (double)(1ULL << 30), msg_size, fragment_size, nbufs);
+	double gbps = 0, copy = run(uri, false, fragment_size, total, &gbps);
+	printf("copy:     %.3f CPU s/GB  %.2f GB/s\n", copy, gbps);
+	fflush(stdout);
+	double zc = run(uri, true, fragment_size, total, &gbps);
+	printf("zerocopy: %.3f CPU s/GB  %.2f GB/s\n", zc, gbps);
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	for (int i = 0; i < nbufs; i++)
+		free(bufs[i]);
+	free(bufs);
+	free(busy);
+	return copy > 0 && zc > 0 ? 0 : 1;
+}
@@ -0,0 +1,321 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "./include/libwsclient.h"
+#include "wsclient.h"
+
+#include "utils.h"
+
+/*
+ * permessage-deflate (rfc7692)
+ *
+ * 压缩的消息在第一帧设置 RSV1，payload 是 raw deflate 数据: 每条消息以 Z_SYNC_FLUSH 结束，再去掉结尾的 00 00 ff ff。
+ * 接收方解压前把这 4 个字节补回去。没有 no_context_takeover 时压缩流跨消息复用，后面的消息可以引用前面消息的内容，
+ * 大量重复的 JSON 主要靠这一点省流量，所以发送方的压缩顺序必须与帧的写出顺序一致。
+ */
+
+#define ZLIB_CHUNK (1U << 30)	// z_stream 的 avail_in / avail_out 是 unsigned int，超长数据分段处理
+
+static const unsigned char deflate_trailer[4] = {0x00, 0x00, 0xff, 0xff};
+
+// 保证 *buf 至少有 need 字节，按倍数增长，跨消息复用。
+static int libwsclient_reserve_zbuf(unsigned char **buf, size_t *size, size_t need)
+{
+	if (need <= *size)
+		return 0;
+	size_t n = *size ? *size : DEFLATE_BUF_INIT_SIZE;
+	while (n < need)
+		n = n > SIZE_MAX / 2 ? need : n * 2;
+	unsigned char *p = realloc(*buf, n);
+	if (!p)
+		return -1;
+	*buf = p;
+	*size = n;
+	return 0;
+}
+
+// 生成握手请求中的扩展请求头，没有开启时为空串。
+// client_max_window_bits 总是带上，不限制时不带值，表示服务端可以要求客户端使用更小的窗口。
+void libwsclient_deflate_offer(wsclient *c, char *buf, size_t size)
+{
+	char bits[8] = {0};
+	buf[0] = '\0';
+	if (!c->permessage_deflate)
+		return;
+	if (c->client_max_window_bits)
+		snprintf(bits, sizeof(bits), "=%d", c->client_max_window_bits);
+	snprintf(buf, size, "Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits%s%s%s\r\n", bits,
+			 c->client_no_context_takeover ? "; client_no_context_takeover" : "",
+			 c->server_no_context_takeover ? "; server_no_context_takeover" : "");
+}
+
+static char *libwsclient_trim(char *s)
+{
+	while (*s == ' ' || *s == '\t')
+		s++;
+	char *e = s + strlen(s);
+	while (e > s && (e[-1] == ' ' || e[-1] == '\t'))
+		*--e = '\0';
+	return s;
+}
+
+// 窗口参数的值: 8 ~ 15，可以带引号。无效返回 -1。
+static int libwsclient_window_bits(const char *v)
+{
+	char *end = NULL;
+	if (!v)
+		return -1;
+	if (*v == '"')
+		v++;
+	long bits = strtol(v, &end, 10);
+	if (end == v || (*end != '\0' && strcmp(end, "\"") != 0) || bits < 8 || bits > 15)
+		return -1;
+	return bits;
+}
+
+// 解析服务端响应的 Sec-WebSocket-Extensions，按协商结果更新参数。
+// 服务端返回了没有请求的扩展或无效的参数时返回 -1，握手应失败 (rfc6455 9.1)。
+int libwsclient_deflate_accept(wsclient *c, const char *value)
+{
+	char buf[256];
+	char *save = NULL, *tok;
+	bool named = false;
+	if (!c->permessage_deflate || c->deflate || strlen(value) >= sizeof(buf) || strchr(value, ','))
+		return -1;
+	strcpy(buf, value);
+	// 不同线程 (握手线程、各个事件循环) 可能同时在握手，用可重入的 strtok_r。
+	for (tok = strtok_r(buf, ";", &save); tok != NULL; tok = strtok_r(NULL, ";", &save))
+	{
+		tok = libwsclient_trim(tok);
+		if (!named)
+		{
+			if (strcmp(tok, "permessage-deflate") != 0)
+				return -1;
+			named = true;
+			continue;
+		}
+		char *v = strchr(tok, '=');
+		if (v)
+		{
+			*v = '\0';
+			v = libwsclient_trim(v + 1);
+			tok = libwsclient_trim(tok);
+		}
+		if (strcmp(tok, "server_no_context_takeover") == 0 && !v)
+			c->server_no_context_takeover = true;
+		else if (strcmp(tok, "client_no_context_takeover") == 0 && !v)
+			c->client_no_context_takeover = true;
+		else if (strcmp(tok, "server_max_window_bits") == 0)
+		{
+			// 解压总是用 15 位窗口，能解开任何更小窗口压缩的数据。
+			if (libwsclient_window_bits(v) < 0)
+				return -1;
+		}
+		else if (strcmp(tok, "client_max_window_bits") == 0)
+		{
+			int bits = libwsclient_window_bits(v);
+			if (bits < 0)
+				return -1;
+			if (!c->client_max_window_bits || bits < c->client_max_window_bits)
+				c->client_max_window_bits = bits;
+		}
+		else
+			return -1;
+	}
+	if (!named)
+		return -1;
+	c->deflate = true;
+	return 0;
+}
+
+// 协商成功后初始化压缩 / 解压流。
+int libwsclient_deflate_init(wsclient *c)
+{
+	int bits = c->client_max_window_bits ? c->client_max_window_bits : 15;
+	if (bits == 8)
+	{
+		// zlib 的 raw deflate 不支持 256 字节的窗口，只能发送不压缩的消息 (rfc7692 允许逐条决定是否压缩)。
+		LIBWSCLIENT_ON_INFO(c, "permessage-deflate: client_max_window_bits=8 is not supported by zlib, outgoing messages are not compressed.\n");
+		c->deflate_threshold = SIZE_MAX;
+	}
+	else if (deflateInit2(&c->deflate_tx, c->deflate_level, Z_DEFLATED, -bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+		LIBWSCLIENT_ON_ERROR(c, "Unable to init deflate stream.\n");
+		return -1;
+	}
+	if (inflateInit2(&c->inflate_rx, -15) != Z_OK)
+	{
+		LIBWSCLIENT_ON_ERROR(c, "Unable to init inflate stream.\n");
+		return -1;
+	}
+	return 0;
+}
+
+void libwsclient_deflate_free(wsclient *c)
+{
+	// 没有初始化过的流 (全 0) 调用 End 也是安全的。
+	deflateEnd(&c->deflate_tx);
+	inflateEnd(&c->inflate_rx);
+	free(c->deflate_buf);
+	free(c->inflate_buf);
+	c->deflate_buf = c->inflate_buf = NULL;
+	c->deflate_buf_size = c->inflate_buf_size = 0;
+}
+
+// 把一条消息的全部 payload 压缩到 deflate_buf，返回压缩后的长度 (已去掉结尾的 00 00 ff ff)，出错返回 -1。
+// 调用方持有 deflate_lock，并且在压缩结果写出或入队之前不能释放，否则别的线程的消息可能先于它发出。
+ssize_t libwsclient_deflate_message(wsclient *c, const struct iovec *iov, int iovcnt)
+{
+	z_stream *zs = &c->deflate_tx;
+	size_t out = 0, off = 0;
+	int i = 0, flush = Z_NO_FLUSH;
+	zs->avail_in = 0;
+	for (;;)
+	{
+		if (zs->avail_in == 0 && flush == Z_NO_FLUSH)
+		{
+			while (i < iovcnt && off == iov[i].iov_len)
+			{
+				i++;
+				off = 0;
+			}
+			if (i == iovcnt)
+				flush = Z_SYNC_FLUSH;
+			else
+			{
+				size_t n = iov[i].iov_len - off;
+				if (n > ZLIB_CHUNK)
+					n = ZLIB_CHUNK;
+				zs->next_in = (Bytef *)iov[i].iov_base + off;
+				zs->avail_in = n;
+				off += n;
+			}
+		}
+		if (libwsclient_reserve_zbuf(&c->deflate_buf, &c->deflate_buf_size, out + 64) < 0)
+			return -1;
+		size_t room = c->deflate_buf_size - out;
+		zs->next_out = c->deflate_buf + out;
+		zs->avail_out = room > ZLIB_CHUNK ? ZLIB_CHUNK : room;
+		int r = deflate(zs, flush);
+		out = zs->next_out - c->deflate_buf;
+		if (r != Z_OK && r != Z_BUF_ERROR)
+			return -1;
+		// Z_SYNC_FLUSH 之后还有剩余的输出空间，说明已全部输出。
+		if (flush == Z_SYNC_FLUSH && zs->avail_out > 0)
+			break;
+	}
+	if (out >= 4 && memcmp(c->deflate_buf + out - 4, deflate_trailer, 4) == 0)
+		out -= 4;
+	if (c->client_no_context_takeover)
+		deflateReset(zs);
+	return out;
+}
+
+// 从 *in 解压最多 size 字节到 out，*in 用完后 (*tail 为 true 时) 再补上结尾的 00 00 ff ff。
+// *produced 为写出的字节数。返回 1 表示输入已全部解压，0 表示 out 已满，-1 表示数据有误。
+static int libwsclient_inflate_some(wsclient *c, const unsigned char **in, size_t *len, bool *tail, unsigned char *out, size_t size, size_t *produced)
+{
+	z_stream *zs = &c->inflate_rx;
+	*produced = 0;
+	for (;;)
+	{
+		if (zs->avail_in == 0)
+		{
+			if (*len > 0)
+			{
+				size_t n = *len > ZLIB_CHUNK ? ZLIB_CHUNK : *len;
+				zs->next_in = (Bytef *)*in;
+				zs->avail_in = n;
+				*in += n;
+				*len -= n;
+			}
+			else if (*tail)
+			{
+				zs->next_in = (Bytef *)deflate_trailer;
+				zs->avail_in = 4;
+				*tail = false;
+			}
+		}
+		size_t room = size - *produced;
+		if (room == 0)
+			return 0;
+		zs->next_out = out + *produced;
+		zs->avail_out = room > ZLIB_CHUNK ? ZLIB_CHUNK : room;
+		int r = inflate(zs, Z_SYNC_FLUSH);
+		*produced = zs->next_out - out;
+		if (r == Z_STREAM_END)
+		{
+			// 服务端用了 BFINAL 块，之后的数据没有意义，下一条消息从新的流开始。
+			inflateReset(zs);
+			zs->avail_in = 0;
+			*len = 0;
+			*tail = false;
+			return 1;
+		}
+		if (r != Z_OK && r != Z_BUF_ERROR)
+			return -1;
+		if (zs->avail_in == 0 && *len == 0 && !*tail && zs->avail_out > 0)
+			return 1;
+	}
+}
+
+// 解压收全的一条消息到 inflate_buf，结果以 '\0' 结尾，与 msg_buf 中的消息一样可当字符串用。
+// 返回解压后的长度，数据有误或内存不足返回 -1，超出 max_message_size 返回 -2。
+ssize_t libwsclient_inflate_message(wsclient *c, const unsigned char *in, size_t len)
+{
+	size_t out = 0;
+	bool tail = true;
+	for (;;)
+	{
+		if (libwsclient_reserve_zbuf(&c->inflate_buf, &c->inflate_buf_size, out + 2) < 0)
+			return -1;
+		size_t size = c->inflate_buf_size - 1 - out;
+		if (c->max_message_size && size > c->max_message_size + 1 - out)
+			size = c->max_message_size + 1 - out;
+		size_t n = 0;
+		int r = libwsclient_inflate_some(c, &in, &len, &tail, c->inflate_buf + out, size, &n);
+		out += n;
+		if (r < 0)
+			return -1;
+		if (c->max_message_size && out > c->max_message_size)
+			return -2;
+		if (r == 1)
+			break;
+	}
+	if (c->server_no_context_takeover)
+		inflateReset(&c->inflate_rx);
+	c->inflate_buf[out] = '\0';
+	return out;
+}
+
+// 流式接收压缩的消息: 解压一段 payload，inflate_buf 每填满一次就交给 onfragment 一次，内存不随消息增长。
+// 返回 0 成功，-1 数据有误或内存不足。
+int libwsclient_inflate_fragment(wsclient *c, const unsigned char *in, size_t len, bool is_final)
+{
+	bool tail = is_final;
+	if (libwsclient_reserve_zbuf(&c->inflate_buf, &c->inflate_buf_size, DEFLATE_BUF_INIT_SIZE) < 0)
+		return -1;
+	for (;;)
+	{
+		size_t n = 0;
+		int r = libwsclient_inflate_some(c, &in, &len, &tail, c->inflate_buf, c->inflate_buf_size, &n);
+		if (r < 0)
+			return -1;
+		bool last = r == 1 && is_final;
+		if ((n > 0 || last) && c->onfragment)
+		{
+			c->onfragment(c, c->msg_opcode, !c->msg_streamed, last, c->inflate_buf, n);
+			c->msg_streamed = true;
+		}
+		if (r == 1)
+			break;
+	}
+	if (is_final && c->server_no_context_takeover)
+		inflateReset(&c->inflate_rx);
+	return 0;
+}
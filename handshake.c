@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+
+#include "./include/libwsclient.h"
+#include "wsclient.h"
+
+#include "utils.h"
+
+/*
+ * 握手状态机
+ *
+ * DNS 解析 -> TCP 连接 -> TLS 握手 -> 发出升级请求、收全响应，每一步都不阻塞:
+ * 等待的 fd (解析请求的 eventfd 或 socket) 就绪时调用 libwsclient_handshake_step 推进，
+ * 到 hs->deadline 时调用 libwsclient_handshake_expire。事件循环、应用的事件循环和握手线程都用它驱动。
+ *
+ * 每个阶段有自己的超时 (dns_timeout 等)，整个握手不超过 handshake_timeout。
+ * 连接超时时换下一个地址，其他阶段超时即失败。
+ */
+
+unsigned long long libwsclient_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// 进入下一个阶段，重新计算超时时刻。
+static void libwsclient_handshake_phase(wsclient_handshake *hs, int state, unsigned int timeout)
+{
+	hs->state = state;
+	hs->deadline = timeout ? libwsclient_now_ms() + timeout : 0;
+	if (hs->expires && (!hs->deadline || hs->deadline > hs->expires))
+		hs->deadline = hs->expires;
+}
+
+// 解析 c->URI，分配握手状态。出错时回调 onerror 并返回 NULL。
+wsclient_handshake *libwsclient_handshake_new(wsclient *c)
+{
+	wsclient_handshake *hs = calloc(1, sizeof(wsclient_handshake));
+	if (!hs)
+	{
+		LIBWSCLIENT_ON_ERROR(c, "Unable to allocate memory in libwsclient_start_run.\n");
+		return NULL;
+	}
+	if (libwsclient_parse_uri(c, hs) < 0)
+	{
+		free(hs);
+		return NULL;
+	}
+	return hs;
+}
+
+void libwsclient_handshake_free(wsclient *c, wsclient_handshake *hs)
+{
+	if (hs->resolve)
+	{
+		libwsclient_loop_rewatch(c, libwsclient_resolve_fd(hs->resolve), -1);
+		libwsclient_resolve_cancel(hs->resolve);
+	}
+	if (hs->addrs)
+		freeaddrinfo(hs->addrs);
+	free(hs);
+}
+
+// 当前等待的 fd。
+int libwsclient_handshake_fd(wsclient *c, wsclient_handshake *hs)
+{
+	if (hs->resolve)
+		return libwsclient_resolve_fd(hs->resolve);
+	return c->sockfd > 0 ? c->sockfd : -1;
+}
+
+// 需要等待可写: 连接建立中，或有没写完的 TLS 握手数据、升级请求。
+bool libwsclient_handshake_wants_write(wsclient *c, wsclient_handshake *hs)
+{
+	return hs->state == HANDSHAKE_CONNECT || __atomic_load_n(&c->out_len, __ATOMIC_SEQ_CST) > 0;
+}
+
+static void libwsclient_handshake_close_socket(wsclient *c)
+{
+	if (c->sockfd <= 0)
+		return;
+	libwsclient_loop_rewatch(c, c->sockfd, -1);
+	close(c->sockfd);
+	pthread_mutex_lock(&c->lock);
+	c->sockfd = 0;
+	pthread_mutex_unlock(&c->lock);
+}
+
+// 依次尝试从 hs->addr 开始的地址，直到 connect 成功或进行中。都失败时返回 -1。
+static int libwsclient_handshake_connect(wsclient *c, wsclient_handshake *hs)
+{
+	for (; hs->addr; hs->addr = hs->addr->ai_next)
+	{
+		struct addrinfo *p = hs->addr;
+		int sockfd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, p->ai_protocol);
+		if (sockfd < 0)
+			continue;
+		if (connect(sockfd, p->ai_addr, p->ai_addrlen) < 0 && errno != EINPROGRESS)
+		{
+			close(sockfd);
+			continue;
+		}
+		// 每条消息已合并为一次写调用，关闭 Nagle，避免小消息等待 delayed ACK。
+		int nodelay = 1;
+		setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+		if (libwsclient_loop_rewatch(c, -1, sockfd) < 0)
+		{
+			close(sockfd);
+			continue;
+		}
+		pthread_mutex_lock(&c->lock);
+		c->sockfd = sockfd;
+		pthread_mutex_unlock(&c->lock);
+		update_wsclient_status(c, FLAG_CLIENT_NONBLOCK, 0);
+		libwsclient_handshake_phase(hs, HANDSHAKE_CONNECT, c->connect_timeout);
+		return 0;
+	}
+	return -1;
+}
+
+// 当前地址连不上，换下一个。
+static int libwsclient_handshake_next_addr(wsclient *c, wsclient_handshake *hs)
+{
+	libwsclient_handshake_close_socket(c);
+	hs->addr = hs->addr->ai_next;
+	return libwsclient_handshake_connect(c, hs);
+}
+
+// 连接建立: TLS 握手，ws:// 直接发出升级请求。
+static int libwsclient_handshake_connected(wsclient *c, wsclient_handshake *hs, const char **err)
+{
+	libwsclient_loop_watch(c, false);
+	libwsclient_handshake_phase(hs, HANDSHAKE_TLS, c->tls_timeout);
+	if (TEST_FLAG(c, FLAG_CLIENT_IS_SSL) && libwsclient_tls_setup(c, hs->host, hs->port) < 0)
+	{
+		*err = "TLS handshake failed.\n";
+		return -1;
+	}
+	return 0;
+}
+
+// 开始握手: 设置总超时，IP 地址直接连接，主机名交给解析线程。返回 0，出错返回 -1 (*err 为原因)。
+int libwsclient_handshake_start(wsclient *c, wsclient_handshake *hs, const char **err)
+{
+	hs->expires = c->handshake_timeout ? libwsclient_now_ms() + c->handshake_timeout : 0;
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICHOST;
+	if (getaddrinfo(hs->host, hs->port, &hints, &hs->addrs) != 0)
+	{
+		hs->addrs = NULL;
+		hs->resolve = libwsclient_resolve_start(hs->host, hs->port);
+		if (!hs->resolve || libwsclient_loop_rewatch(c, -1, libwsclient_resolve_fd(hs->resolve)) < 0)
+		{
+			*err = "Unable to start DNS resolution.\n";
+			return -1;
+		}
+		libwsclient_handshake_phase(hs, HANDSHAKE_RESOLVE, c->dns_timeout);
+		return 0;
+	}
+	hs->addr = hs->addrs;
+	if (libwsclient_handshake_connect(c, hs) < 0)
+	{
+		*err = "Error while getting address info";
+		return -1;
+	}
+	return 0;
+}
+
+// 等待的 fd 就绪 (events 为 EPOLLIN 等) 时推进握手。返回 1 表示已收全并校验了响应，0 表示继续等待，
+// -1 表示失败: *err 为原因，为 NULL 时已回调过 onerror。
+int libwsclient_handshake_step(wsclient *c, wsclient_handshake *hs, uint32_t events, const char **err)
+{
+	*err = NULL;
+	if (hs->state == HANDSHAKE_RESOLVE)
+	{
+		int status;
+		struct addrinfo *addrs;
+		int fd = libwsclient_resolve_fd(hs->resolve);
+		if (!libwsclient_resolve_result(hs->resolve, &addrs, &status))
+			return 0;
+		// 请求已释放，eventfd 已关闭。
+		libwsclient_loop_rewatch(c, fd, -1);
+		hs->resolve = NULL;
+		if (status != 0)
+		{
+			*err = "Error while getting address info";
+			return -1;
+		}
+		hs->addrs = hs->addr = addrs;
+		if (libwsclient_handshake_connect(c, hs) < 0)
+		{
+			*err = "Error while getting address info";
+			return -1;
+		}
+		return 0;
+	}
+	if (hs->state == HANDSHAKE_CONNECT)
+	{
+		int soerr = 0;
+		socklen_t len = sizeof(soerr);
+		if (getsockopt(c->sockfd, SOL_SOCKET, SO_ERROR, &soerr, &len) < 0)
+			soerr = errno;
+		if (!soerr)
+		{
+			struct sockaddr_storage peer;
+			socklen_t plen = sizeof(peer);
+			if (getpeername(c->sockfd, (struct sockaddr *)&peer, &plen) < 0)
+			{
+				// 还在连接中。
+				if (errno == ENOTCONN && !(events & (EPOLLERR | EPOLLHUP)))
+					return 0;
+				soerr = errno;
+			}
+		}
+		if (soerr)
+		{
+			if (libwsclient_handshake_next_addr(c, hs) < 0)
+			{
+				*err = "Error while getting address info";
+				return -1;
+			}
+			return 0;
+		}
+		if (libwsclient_handshake_connected(c, hs, err) < 0)
+			return -1;
+	}
+	if ((events & EPOLLOUT) && __atomic_load_n(&c->out_len, __ATOMIC_SEQ_CST) > 0)
+		libwsclient_on_socket_writable(c);
+	if (hs->state == HANDSHAKE_TLS)
+	{
+		int r = TEST_FLAG(c, FLAG_CLIENT_IS_SSL) ? libwsclient_tls_connect(c) : 1;
+		if (r < 0)
+			*err = "TLS handshake failed.\n";
+		if (r <= 0)
+			return r;
+		// 响应直接读进接收缓冲区，紧跟在响应之后的帧留在那里交给帧解析。
+		if (libwsclient_alloc_recv_buf(c) < 0)
+			return -1;
+		char request_headers[2048] = {0};
+		int n = libwsclient_handshake_request(c, hs, request_headers, sizeof(request_headers));
+		libwsclient_handshake_phase(hs, HANDSHAKE_RESPONSE, c->http_timeout);
+		if (_libwsclient_write(c, request_headers, n) < 0)
+		{
+			*err = "Error sending data";
+			return -1;
+		}
+		return 0;
+	}
+	for (;;)
+	{
+		ssize_t n = _libwsclient_read(c, c->recv_buf, c->recv_buf_size);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (n <= 0)
+		{
+			*err = "WS_HANDSHAKE_REMOTE_CLOSED_or_other_receive_ERR";
+			return -1;
+		}
+		size_t used;
+		int r = libwsclient_handshake_response(c, hs, (char *)c->recv_buf, n, &used);
+		if (r != 0)
+		{
+			// 响应之后的字节是第一批帧。
+			c->recv_start = used;
+			c->recv_end = n;
+			return r;
+		}
+	}
+}
+
+// 到了 hs->deadline: 当前阶段超时。连接超时且还有其他地址时换下一个地址并返回 0，否则返回 -1 (*err 为原因)。
+int libwsclient_handshake_expire(wsclient *c, wsclient_handshake *hs, const char **err)
+{
+	unsigned long long now = libwsclient_now_ms();
+	if (!hs->deadline || now < hs->deadline)
+		return 0;
+	if (hs->expires && now >= hs->expires)
+	{
+		*err = "Handshake timed out.\n";
+		return -1;
+	}
+	switch (hs->state)
+	{
+	case HANDSHAKE_RESOLVE:
+		*err = "DNS resolution timed out.\n";
+		return -1;
+	case HANDSHAKE_CONNECT:
+		if (hs->addr->ai_next && libwsclient_handshake_next_addr(c, hs) == 0)
+			return 0;
+		*err = "Connect timed out.\n";
+		return -1;
+	case HANDSHAKE_TLS:
+		*err = "TLS handshake timed out.\n";
+		return -1;
+	default:
+		*err = "Handshake response timed out.\n";
+		return -1;
+	}
+}
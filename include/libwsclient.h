@@ -3,17 +3,43 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/uio.h>
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <openssl/crypto.h>
+#include <zlib.h>
 #define FRAME_CHUNK_LENGTH 1024
 #define HELPER_RECV_BUF_SIZE 1024
+#define RECV_BUF_SIZE (64 * 1024)	// 默认接收缓冲区大小，能放下的帧整帧解析，放不下的直接读入 payload。
+#define RECV_BUF_MIN_SIZE 256	// 至少放得下一个完整的控制帧 (帧头 + 125 字节) 和最长的帧头 (14 字节)
+#define MSG_BUF_INIT_SIZE (4 * 1024)	// 消息重组缓冲区的初始大小，不够时按倍数增长。
+#define MAX_FRAME_SIZE (16 * 1024 * 1024)	// 默认单帧 payload 上限
+#define MAX_MESSAGE_SIZE (64 * 1024 * 1024)	// 默认重组后消息上限
+#define SEND_BUF_SIZE (64 * 1024)	// 默认发送缓冲区大小，payload 边 mask 边拷入，满了就写出
+#define SEND_BUF_MIN_SIZE 256
+#define SEND_QUEUE_HIGH_WATER (4 * 1024 * 1024)	// 默认异步发送队列上限 (字节)
+#define WRITE_HIGH_WATER (1024 * 1024)	// 非阻塞模式默认的未写出字节数高水位
+#define WRITE_LOW_WATER (256 * 1024)	// 非阻塞模式默认的未写出字节数低水位
+#define DEFLATE_THRESHOLD 128	// 默认压缩阈值，更短的消息压缩省不了多少，直接发送
+#define DEFLATE_BUF_INIT_SIZE (4 * 1024)	// 压缩 / 解压缓冲区的初始大小，不够时按倍数增长
+#define HANDSHAKE_TIMEOUT (10 * 1000)	// 默认的握手超时 (毫秒)，从开始握手到 onopen
+#define DNS_TIMEOUT (5 * 1000)		// 默认的 DNS 解析超时 (毫秒)
+#define CONNECT_TIMEOUT (5 * 1000)	// 默认的 TCP 连接超时 (毫秒)，每个地址分别计时，超时后换下一个地址
+#define TLS_TIMEOUT (5 * 1000)		// 默认的 TLS 握手超时 (毫秒)
+#define HTTP_TIMEOUT (5 * 1000)		// 默认的升级请求超时 (毫秒)，从发出请求到收全响应
+#define CLOSE_TIMEOUT 1000	// 事件循环模式下 libwsclient_close 发出 close 帧后等待服务端关闭连接的时间 (毫秒)
 
 #define FLAG_CLIENT_IS_SSL (1 << 0)
 #define FLAG_CLIENT_CONNECTING (1 << 1)
 #define FLAG_CLIENT_CLOSEING (1 << 2)	//最后一帧（close）以发送，以后不许再发任何数据。
 #define FLAG_CLIENT_QUIT (1 << 3)		//主动退出
+#define FLAG_CLIENT_NONBLOCK (1 << 4)	//socket 已切换为非阻塞
+#define FLAG_CLIENT_ZEROCOPY (1 << 5)	//socket 已开启 SO_ZEROCOPY
+#define FLAG_CLIENT_CLOSE_SENT (1 << 6)	//close 帧已由某个线程发出(或正在发)，只发一次
 
 #define FLAG_REQUEST_HAS_CONNECTION (1 << 0)
 #define FLAG_REQUEST_HAS_UPGRADE (1 << 1)
@@ -37,17 +63,95 @@ typedef struct _wsclient_frame_in
 	unsigned int opcode;
 	unsigned long long payload_len;
 	unsigned char *payload;
-	struct _wsclient_frame_in *next_frame;
-	struct _wsclient_frame_in *prev_frame;
 } wsclient_frame_in;
 
+// 事件循环: 一个线程用 epoll 驱动多个 client 的连接、握手、收发和超时，见 libwsclient_loop_new。
+typedef struct _wsclient_loop wsclient_loop;
+// 多核运行时: 多个 I/O 线程各运行一个事件循环，见 libwsclient_runtime_new。
+typedef struct _wsclient_runtime wsclient_runtime;
+
+// 创建参数，先用 libwsclient_options_init 填默认值再按需修改。
+typedef struct _wsclient_options
+{
+	unsigned long long fragment_size;	// 发送时每个分片的最大 payload，0 表示从不分片。默认 1024
+	size_t recv_buf_size;				// 默认 RECV_BUF_SIZE
+	size_t send_buf_size;				// 默认 SEND_BUF_SIZE
+	unsigned long long max_frame_size;	// 默认 MAX_FRAME_SIZE，0 表示不限
+	unsigned long long max_message_size;	// 默认 MAX_MESSAGE_SIZE，0 表示不限
+	bool zero_copy_recv;				// 默认 false
+	bool async_send;					// 异步发送，默认 false
+	size_t send_queue_high_water;		// 异步发送队列上限，默认 SEND_QUEUE_HIGH_WATER，0 表示不限
+	bool nonblocking;					// 非阻塞 socket，默认 false
+	size_t write_high_water;			// 非阻塞模式，默认 WRITE_HIGH_WATER
+	size_t write_low_water;				// 非阻塞模式，默认 WRITE_LOW_WATER
+	size_t zerocopy_threshold;			// libwsclient_send_zerocopy 使用 MSG_ZEROCOPY 的最小消息长度，0 表示不使用。仅 ws://，默认 0
+	// permessage-deflate (rfc7692)，服务端同意后生效
+	bool permessage_deflate;			// 握手时请求压缩扩展，默认 false
+	int deflate_level;					// zlib 压缩级别，默认 Z_DEFAULT_COMPRESSION
+	int client_max_window_bits;			// 发送方向的压缩窗口 (8 ~ 15)，0 表示不限制，默认 0
+	bool client_no_context_takeover;	// 每条发出的消息单独压缩，省内存但压缩率低，默认 false
+	bool server_no_context_takeover;	// 请求服务端每条消息单独压缩，默认 false
+	size_t deflate_threshold;			// 短于此长度的消息不压缩，默认 DEFLATE_THRESHOLD
+	// 由事件循环驱动，不创建握手线程和 run 线程，默认 NULL。总是非阻塞，不支持 async_send，回调都在 loop 线程中调用。
+	wsclient_loop *loop;
+	// 由多核运行时驱动，libwsclient_start_run 时分给连接数最少的 I/O 线程，默认 NULL。其余同 loop。
+	wsclient_runtime *runtime;
+	// 由应用自己的事件循环驱动，库不为连接创建线程，见 libwsclient_get_fd。默认 false，设置了 loop 或 runtime 时忽略。
+	bool external_loop;
+	// 握手超时 (毫秒)，0 表示不限。各阶段分别计时，整个握手不超过 handshake_timeout。
+	unsigned int handshake_timeout;		// 默认 HANDSHAKE_TIMEOUT
+	unsigned int dns_timeout;			// 默认 DNS_TIMEOUT
+	unsigned int connect_timeout;		// 默认 CONNECT_TIMEOUT
+	unsigned int tls_timeout;			// 默认 TLS_TIMEOUT
+	unsigned int http_timeout;			// 默认 HTTP_TIMEOUT
+} wsclient_options;
+
+// 发送队列节点: 一条消息编码 (分片、mask) 后的全部帧，整条写出，不会与其他消息交错。
+typedef struct _wsclient_send_node
+{
+	struct _wsclient_send_node *next;
+	size_t len;
+	unsigned int frames;
+	unsigned char *data;	// 紧跟在节点之后分配
+} wsclient_send_node;
+
+// MSG_ZEROCOPY 发送中的消息。各分片的 sendmsg 都收到内核完成通知后回调 onzerocopy。
+typedef struct _wsclient_zc_msg
+{
+	struct _wsclient_zc_msg *next;
+	unsigned char *payload;
+	void *cookie;
+	unsigned int first;		// 第一个 sendmsg 的通知序号
+	unsigned int last;		// 最后一个 sendmsg 的通知序号
+	unsigned int remaining;	// 尚未完成的 sendmsg 数
+	unsigned char hdr[];	// 各分片的帧头，同样在完成前不能释放
+} wsclient_zc_msg;
+
+// 无锁多生产者单消费者队列
+typedef struct _wsclient_send_queue
+{
+	wsclient_send_node *head;	// 只由消费者访问
+	wsclient_send_node *tail;	// 生产者原子交换
+	wsclient_send_node stub;
+} wsclient_send_queue;
+
+// 收发统计。reads / frames_in 即平均每帧的读调用次数，writes / frames_out 为每帧的写调用次数。
+typedef struct _wsclient_stats
+{
+	unsigned long long reads;		// recv / SSL_read 调用次数
+	unsigned long long bytes_in;	// 读到的字节数
+	unsigned long long frames_in;	// 解析出的帧数
+	unsigned long long writes;		// send / SSL_write 调用次数
+	unsigned long long bytes_out;	// 写出的字节数
+	unsigned long long frames_out;	// 发出的帧数
+} wsclient_stats;
+
 
 typedef struct _wsclient
 {
 	pthread_t handshake_thread;
 	pthread_t run_thread;
 	pthread_mutex_t lock;
-	pthread_mutex_t send_lock;
 	char *URI;
 	int sockfd;
 	int flags;
@@ -55,9 +159,134 @@ typedef struct _wsclient
 	int (*onclose)(struct _wsclient *);
 	int (*onerror)(struct _wsclient *, int code, char *msg);
 	int (*onmessage)(struct _wsclient *, bool isText, unsigned long long lenth, unsigned char *data);
-	wsclient_frame_in *current_frame;
-	SSL_CTX *ssl_ctx;
+	// 可选，流式接收超大消息。设置后数据消息不再整条缓存、不再调用 onmessage，
+	// 而是每个分片(或大帧的每一段)读到后立即回调。opcode 为消息类型 (OP_CODE_TYPE_TEXT / OP_CODE_TYPE_BINARY)，
+	// is_first / is_final 标记消息的第一段和最后一段，data 仅在回调期间有效。
+	int (*onfragment)(struct _wsclient *, int opcode, bool is_first, bool is_final, unsigned char *data, unsigned long long len);
+	// 可选，异步发送队列满过(有消息被拒绝)之后又清空时，在发送线程中回调。
+	int (*ondrain)(struct _wsclient *);
+	// 可选，非阻塞模式的写出背压。这些回调可能在任意发送线程或 run 线程中调用，回调中可以继续发送(消息会排队)。
+	// onhighwater: 未写出的字节数 (libwsclient_get_buffered_amount) 超过 write_high_water，应用应暂停发送;
+	// onlowwater: 之后又降到 write_low_water 以下;
+	// onwritable: socket 写满 (EAGAIN) 后缓冲的数据已全部写出。
+	int (*onhighwater)(struct _wsclient *, size_t buffered);
+	int (*onlowwater)(struct _wsclient *, size_t buffered);
+	int (*onwritable)(struct _wsclient *);
+	// 可选，libwsclient_send_zerocopy 的缓冲区可以重用 (或释放) 时回调，在 run 线程或发送线程中调用。
+	int (*onzerocopy)(struct _wsclient *, unsigned char *payload, void *cookie);
+	// 接收缓冲区: 每次尽量多读，缓冲区中有几帧就解析几帧，再回到内核读。
+	unsigned char *recv_buf;
+	size_t recv_buf_size;	// 可在 libwsclient_start_run 之前修改，默认 RECV_BUF_SIZE，不小于 RECV_BUF_MIN_SIZE
+	size_t recv_start;		// 尚未解析数据的起始位置
+	size_t recv_end;		// 已读数据的结束位置
+	bool zero_copy_recv;	// 为 true 时，整帧在缓冲区中的单帧消息直接以缓冲区指针交给 onmessage，仅在回调期间有效
+	wsclient_frame_in recv_frame;	// 已解析头部、payload 尚未收全的帧，payload 指向 msg_buf 中的位置
+	bool recv_frame_pending;
+	unsigned long long recv_frame_got;
+	// 消息重组缓冲区: 各分片的 payload 直接读到已收部分之后，收全即是完整消息，跨消息复用。
+	unsigned char *msg_buf;
+	size_t msg_buf_size;
+	size_t msg_len;
+	// 接收大小限制，0 表示不限。超出时发送 1009 close 帧、回调 onerror 并断开。只限制需要缓存的消息，onfragment 流式接收的不受限制。
+	unsigned long long max_frame_size;		// 默认 MAX_FRAME_SIZE
+	unsigned long long max_message_size;	// 默认 MAX_MESSAGE_SIZE
+	int msg_opcode;		// 正在接收的消息的 opcode，0 表示没有未完成的消息
+	bool msg_stream;	// 正在接收的消息交给 onfragment 流式处理
+	bool msg_streamed;	// 该消息已回调过 onfragment
+	wsclient_stats stats;
+	unsigned long long fragment_size;	// 发送分片大小，0 表示不分片
+	// 发送缓冲区，只由持有 send_busy 的线程(或发送线程)使用。握手完成时 (onopen 之前) 分配，之后复用，大小固定。
+	unsigned char *send_buf;
+	size_t send_buf_size;	// 由 wsclient_options.send_buf_size 设置，默认 SEND_BUF_SIZE
+	size_t send_len;
+	// 流式发送 (libwsclient_send_begin) 中的消息 opcode，没有时为 0。
+	int send_stream;
+	bool send_stream_started;		// 第一片已发出
+	unsigned int send_messages;		// 正在写出或入队的数据消息数，libwsclient_send_begin 等它归零
+	// 发送队列: 没抢到 send_busy 的线程把编码好的整条消息入队后立即返回，由正在写的线程写出。
+	wsclient_send_queue send_queue;
+	bool send_busy;						// 有线程正在写 socket
+	unsigned long long send_pushed;		// 已完成入队的消息数
+	unsigned long long send_popped;		// 已出队的消息数
+	// 优先队列: ping / pong 在这里排队，写大消息的线程在分片之间插入写出，不必等整条消息写完。
+	wsclient_send_queue send_ctrl_queue;
+	unsigned long long send_ctrl_pushed;
+	unsigned long long send_ctrl_popped;
+	// 异步发送: 发送函数总是入队，由 send_thread 合并写出，不阻塞调用线程。
+	bool async_send;
+	pthread_t send_thread;
+	sem_t send_sem;
+	size_t send_queued;				// 队列中的字节数
+	size_t send_queue_high_water;	// 超过后拒绝新的数据消息，0 表示不限
+	bool send_queue_full;			// 有消息因队列满被拒绝，队列清空后回调 ondrain
+	bool drain_wait;				// libwsclient_send_file 在等队列清空
+	sem_t drain_sem;
+	// 非阻塞模式: socket 写不下的数据按顺序追加到 out_buf，之后的写入排在它后面，socket 可写时由 run 线程接着写。
+	// out_buf 只由持有 send_busy 的线程使用，out_len 可由其他线程原子读取。
+	bool nonblocking;
+	unsigned char *out_buf;
+	size_t out_buf_size;
+	size_t out_start;
+	size_t out_len;
+	size_t write_high_water;
+	size_t write_low_water;
+	bool write_high;				// 已回调 onhighwater，尚未回调 onlowwater
+	int wake_fd[2];					// 唤醒 run 线程的 poll，out_buf 由空变为非空时写入
+	bool write_deferred;			// socket 可写时其他线程正在写: 暂停等待可写，由它在 libwsclient_unlock_send 时恢复
+	// MSG_ZEROCOPY 发送，zc_pending / zc_seq 只由持有 send_busy 的线程使用。
+	size_t zerocopy_threshold;
+	wsclient_zc_msg *zc_pending;	// 等待内核完成通知的消息，按发送顺序
+	unsigned int zc_seq;			// 下一个 MSG_ZEROCOPY sendmsg 的通知序号
+	// permessage-deflate: 握手前为 wsclient_options 中的请求参数，握手后为协商结果。
+	// 压缩流跨消息复用 (context takeover)，deflate_tx / deflate_buf 由 deflate_lock 保护，
+	// inflate_rx / inflate_buf 只由 run 线程使用。
+	bool permessage_deflate;
+	bool deflate;					// 握手已协商压缩
+	int deflate_level;
+	int client_max_window_bits;
+	bool client_no_context_takeover;
+	bool server_no_context_takeover;
+	size_t deflate_threshold;
+	pthread_mutex_t deflate_lock;
+	z_stream deflate_tx;
+	unsigned char *deflate_buf;
+	size_t deflate_buf_size;
+	z_stream inflate_rx;
+	unsigned char *inflate_buf;
+	size_t inflate_buf_size;
+	bool msg_compressed;			// 正在接收的消息带 RSV1，需要解压
+	SSL_CTX *ssl_ctx;	// 所有连接共享，引用计数
 	SSL *ssl;
+	BIO *tls_bio;		// SSL 读写内存 BIO pair，库在这一端与 socket 之间搬运密文
+	char *ssl_peer;		// host:port，TLS session 缓存的 key
+	// 保护 ssl 和 tls_bio 的缓冲区，见 tls.c
+	pthread_mutex_t ssl_lock;
+	// 事件循环模式。loop_cmd / loop_cmd_next 由 loop->lock 保护，其余只由 loop 线程访问。
+	wsclient_loop *loop;			// libwsclient_start_run 之后为所属的事件循环
+	wsclient_runtime *runtime;
+	struct _wsclient_handshake *hs;	// 握手中的状态，握手完成后释放 (默认模式下只由握手线程访问)
+	unsigned int handshake_timeout;
+	unsigned int dns_timeout;
+	unsigned int connect_timeout;
+	unsigned int tls_timeout;
+	unsigned int http_timeout;
+	bool external_loop;				// 由应用的事件循环驱动，没有 loop
+	bool polling;					// 正在 libwsclient_on_* 中 (由应用驱动)
+	int loop_cmd;					// 等待 loop 线程处理的命令
+	struct _wsclient *loop_cmd_next;
+	struct _wsclient *loop_ready_next;
+	bool loop_ready;				// 在 ready 链表中: 读满一轮预算，可能还有数据
+	bool loop_added;				// 已交给 loop
+	bool loop_closing;				// 已调用 libwsclient_close，摘下后不再由 loop 引用
+	bool loop_closed;				// 正在或已经从 loop 摘下
+	bool loop_free;					// 在 loop 线程 (或 libwsclient_on_* 的回调) 中调用了 libwsclient_close，摘下后由 loop 释放
+	bool opened;					// 已回调 onopen
+	unsigned long long deadline;	// 握手或关闭的超时时刻 (CLOCK_MONOTONIC 毫秒)，0 表示没有
+	size_t timer_index;				// 在 loop 定时器堆中的位置 (从 1 开始)，0 表示不在堆中
+	// 以下由 lock 保护，变化时 loop_cond 广播。
+	bool loop_ended;				// 已摘下，socket 已关闭，onclose 已返回
+	bool loop_released;				// loop 已处理关闭请求，不再引用 client
+	pthread_cond_t loop_cond;
 	void *userdata;
 } wsclient;
 
@@ -65,6 +294,9 @@ typedef struct _wsclient
 
 // 创建
 wsclient *libwsclient_new(const char *URI);
+// 按参数创建，opts 为 NULL 时与 libwsclient_new 相同
+void libwsclient_options_init(wsclient_options *opts);
+wsclient *libwsclient_new_with_options(const char *URI, const wsclient_options *opts);
 // 设置参数
 /*
 void libwsclient_set_onopen(wsclient *client, int (*cb)(wsclient *c));
@@ -81,11 +313,68 @@ void libwsclient_wait_for_end(wsclient *client);
 // 结束并清理
 void libwsclient_close(wsclient *c);
 
-// 发送消息
-void libwsclient_send_data(wsclient *client, int opcode, unsigned char *payload, unsigned long long payload_len);
-void libwsclient_send_string(wsclient *client, char *payload);
+// 发送消息。返回 0 表示已发送(异步模式为已入队)，-1 表示出错，1 表示异步发送队列已满、消息未入队，等 ondrain 后再发。
+int libwsclient_send_data(wsclient *client, int opcode, const unsigned char *payload, unsigned long long payload_len);
+int libwsclient_send_string(wsclient *client, const char *payload);
+int libwsclient_send_iov(wsclient *client, int opcode, const struct iovec *iov, int iovcnt);
+int libwsclient_send_begin(wsclient *client, int opcode);
+int libwsclient_send_append(wsclient *client, const unsigned char *data, unsigned long long len);
+int libwsclient_send_end(wsclient *client);
+// 零拷贝发送大消息 (ws:// 且 payload_len >= zerocopy_threshold 时)。payload 原地 mask 后由内核直接从中发送，
+// 调用后 payload 的内容不再有效，返回 0 后要等 onzerocopy(client, payload, cookie) 回调才能重用或释放。
+// 不满足条件 (TLS、消息较短、异步发送模式或有其他线程正在写) 时按 libwsclient_send_data 拷贝发送，payload 不会被修改，返回前回调 onzerocopy。
+// 返回值同 libwsclient_send_data。返回 -1 时如果已经有分片零拷贝发出，内核仍可能在读 payload，
+// 这时同样要等 onzerocopy 回调 (内核用完后，最迟在 libwsclient_close 中) 才能重用或释放；一个分片都没发出时不会回调。
+int libwsclient_send_zerocopy(wsclient *client, int opcode, unsigned char *payload, unsigned long long payload_len, void *cookie);
+// 把文件 fd 中从 offset 开始的 len 字节 (0 表示到文件末尾) 作为一条二进制消息发送，按 send_buf 大小一块一块分片发出，
+// 文件内容不整块读入内存，不压缩。发送期间同流式发送，其他数据消息会被拒绝。
+int libwsclient_send_file(wsclient *client, int fd, off_t offset, unsigned long long len);
 
 // 可选，定时发送ping
 void libwsclient_send_ping(wsclient *client, char *payload);
 
+// 事件循环。先创建 loop 并在某个线程中运行 libwsclient_loop_run，再以 wsclient_options.loop 创建 client、libwsclient_start_run。
+// libwsclient_start_run 只解析地址，连接和握手在 loop 线程中进行。libwsclient_close 可以在任意线程 (包括回调中) 调用。
+wsclient_loop *libwsclient_loop_new(void);
+// 在当前线程中运行，直到 libwsclient_loop_stop。返回 0，出错返回 -1。
+int libwsclient_loop_run(wsclient_loop *loop);
+// 可以在任意线程中调用，libwsclient_loop_run 处理完当前事件后返回。
+void libwsclient_loop_stop(wsclient_loop *loop);
+// 所有 client 都已 libwsclient_close，且 libwsclient_loop_run 已返回之后调用。
+void libwsclient_loop_free(wsclient_loop *loop);
+
+// 多核运行时。启动 nworkers 个 I/O 线程 (0 表示进程可用的 CPU 数)，依次绑定到可用的 CPU，各运行一个事件循环。
+// 以 wsclient_options.runtime 创建的 client 在 libwsclient_start_run 时分给连接数最少的线程，之后读写和回调都在这个线程中。
+wsclient_runtime *libwsclient_runtime_new(int nworkers);
+int libwsclient_runtime_workers(wsclient_runtime *rt);
+// 停止所有 I/O 线程并释放，所有 client 都已 libwsclient_close 之后调用。
+void libwsclient_runtime_free(wsclient_runtime *rt);
+
+// 由应用自己的事件循环驱动 (wsclient_options.external_loop)，连接、握手、收发和回调都在应用调用下面函数的线程中进行。
+// libwsclient_start_run 开始握手，之后应用监听 libwsclient_get_fd (主机名解析期间为共享解析线程的完成通知):
+// 可读或出错时调用 libwsclient_on_readable，libwsclient_wants_write 为 true 且可写时调用 libwsclient_on_writable，
+// libwsclient_next_timeout 毫秒后调用 libwsclient_on_timeout。
+// 每次调用这些函数以及发送之后重新取 fd 和 wants_write: 连接失败换下一个地址时 fd 会变 (旧 fd 已关闭)。
+// libwsclient_close 尽量写出 close 帧后直接关闭连接，不等服务端回应。
+// socket 的 fd，没有连接或连接已结束时返回 -1。
+int libwsclient_get_fd(wsclient *client);
+// 有数据等待写出 (或正在连接)，需要等待可写。其他线程正在写时为 false，由该线程发送之后重新取。
+bool libwsclient_wants_write(wsclient *client);
+// 返回 0，连接已结束 (fd 已关闭) 返回 -1；回调中调用过 libwsclient_close 时 client 已释放，不能再使用。
+int libwsclient_on_readable(wsclient *client);
+int libwsclient_on_writable(wsclient *client);
+int libwsclient_on_timeout(wsclient *client);
+// 距下一次需要调用 libwsclient_on_timeout 的毫秒数 (握手超时，或还有已收到未处理的数据时为 0)，没有时返回 -1。
+// 可以直接作为 poll / epoll_wait 的 timeout。
+int libwsclient_next_timeout(wsclient *client);
+
+// 可选，读取收发统计
+void libwsclient_get_stats(wsclient *client, wsclient_stats *stats);
+
+// 可选，进程退出前清空 TLS session 缓存并释放共享的 SSL_CTX (没有 wss 连接在用时)。
+void libwsclient_ssl_cleanup(void);
+
+// 可选，已发送(入队)但还没写入 socket 的字节数: 非阻塞模式下缓冲的数据 + 异步发送队列中的数据。
+size_t libwsclient_get_buffered_amount(wsclient *client);
+
 #endif /* LIB_WSCLIENT_H_ */
@@ -2,12 +2,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
 #include <stdbool.h>
 
 #include <sys/types.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
 
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdint.h>
 
 #include "./include/libwsclient.h"
 #include "wsclient.h"
@@ -15,9 +23,41 @@
 #include "sha1.h"
 #include "utils.h"
 
+// 默认参数
+void libwsclient_options_init(wsclient_options *opts)
+{
+	memset(opts, 0, sizeof(*opts));
+	opts->fragment_size = MAX_PAYLOAD_SIZE;
+	opts->recv_buf_size = RECV_BUF_SIZE;
+	opts->send_buf_size = SEND_BUF_SIZE;
+	opts->max_frame_size = MAX_FRAME_SIZE;
+	opts->max_message_size = MAX_MESSAGE_SIZE;
+	opts->send_queue_high_water = SEND_QUEUE_HIGH_WATER;
+	opts->write_high_water = WRITE_HIGH_WATER;
+	opts->write_low_water = WRITE_LOW_WATER;
+	opts->deflate_level = Z_DEFAULT_COMPRESSION;
+	opts->deflate_threshold = DEFLATE_THRESHOLD;
+	opts->handshake_timeout = HANDSHAKE_TIMEOUT;
+	opts->dns_timeout = DNS_TIMEOUT;
+	opts->connect_timeout = CONNECT_TIMEOUT;
+	opts->tls_timeout = TLS_TIMEOUT;
+	opts->http_timeout = HTTP_TIMEOUT;
+}
+
 wsclient *libwsclient_new(const char *URI)
+{
+	return libwsclient_new_with_options(URI, NULL);
+}
+
+wsclient *libwsclient_new_with_options(const char *URI, const wsclient_options *opts)
 {
 	wsclient *client = NULL;
+	wsclient_options defaults;
+	if (!opts)
+	{
+		libwsclient_options_init(&defaults);
+		opts = &defaults;
+	}
 
 	client = (wsclient *)calloc(sizeof(wsclient), 1);
 	if (!client)
@@ -25,9 +65,9 @@ wsclient *libwsclient_new(const char *URI)
 		// LIBWSCLIENT_ON_ERROR(client, "Unable to allocate memory in libwsclient_new.\n");
 		return NULL;
 	}
-	if ((pthread_mutex_init(&client->lock, NULL) != 0) || (pthread_mutex_init(&client->send_lock, NULL) != 0))
+	if ((pthread_mutex_init(&client->lock, NULL) != 0) || (pthread_mutex_init(&client->deflate_lock, NULL) != 0) || (pthread_mutex_init(&client->ssl_lock, NULL) != 0) || (sem_init(&client->send_sem, 0, 0) != 0) || (sem_init(&client->drain_sem, 0, 0) != 0) || (pthread_cond_init(&client->loop_cond, NULL) != 0))
 	{
-		LIBWSCLIENT_ON_ERROR(client, "Unable to init mutex or send lock in libwsclient_new.\n");
+		LIBWSCLIENT_ON_ERROR(client, "Unable to init mutex or send semaphore in libwsclient_new.\n");
 		free(client);
 		return NULL;
 	}
@@ -40,7 +80,44 @@ wsclient *libwsclient_new(const char *URI)
 		return NULL;
 	}
 	strncpy(client->URI, URI, strlen(URI));
+	client->fragment_size = opts->fragment_size;
+	client->recv_buf_size = opts->recv_buf_size;
+	client->send_buf_size = opts->send_buf_size;
+	client->max_frame_size = opts->max_frame_size;
+	client->max_message_size = opts->max_message_size;
+	client->zero_copy_recv = opts->zero_copy_recv;
+	client->async_send = opts->async_send;
+	client->send_queue_high_water = opts->send_queue_high_water;
+	client->nonblocking = opts->nonblocking;
+	client->write_high_water = opts->write_high_water;
+	client->write_low_water = opts->write_low_water;
+	client->zerocopy_threshold = opts->zerocopy_threshold;
+	client->permessage_deflate = opts->permessage_deflate;
+	client->deflate_level = opts->deflate_level;
+	// zlib 不支持 8 位窗口，请求 9 位。
+	client->client_max_window_bits = opts->client_max_window_bits == 8 ? 9 : opts->client_max_window_bits;
+	client->client_no_context_takeover = opts->client_no_context_takeover;
+	client->server_no_context_takeover = opts->server_no_context_takeover;
+	client->deflate_threshold = opts->deflate_threshold;
+	client->handshake_timeout = opts->handshake_timeout;
+	client->dns_timeout = opts->dns_timeout;
+	client->connect_timeout = opts->connect_timeout;
+	client->tls_timeout = opts->tls_timeout;
+	client->http_timeout = opts->http_timeout;
+	client->wake_fd[0] = client->wake_fd[1] = -1;
+	libwsclient_queue_init(&client->send_queue);
+	libwsclient_queue_init(&client->send_ctrl_queue);
 
+	if (opts->loop || opts->runtime || opts->external_loop)
+	{
+		// 连接和握手在 libwsclient_start_run 之后由 loop 线程 (或应用的事件循环) 进行。
+		client->loop = opts->loop;
+		client->runtime = opts->runtime;
+		client->external_loop = !opts->loop && !opts->runtime;
+		client->nonblocking = true;
+		client->async_send = false;
+		return client;
+	}
 	if (pthread_create(&client->handshake_thread, NULL, libwsclient_handshake_thread, (void *)client))
 	{
 		LIBWSCLIENT_ON_ERROR(client, "Unable to create handshake thread.\n");
@@ -52,9 +129,18 @@ wsclient *libwsclient_new(const char *URI)
 
 void libwsclient_start_run(wsclient *c)
 {
-	if (TEST_FLAG(c, FLAG_CLIENT_CONNECTING))
+	if (c->runtime && !c->loop)
+		c->loop = libwsclient_runtime_pick(c->runtime);
+	if (c->loop || c->external_loop)
+	{
+		libwsclient_loop_add(c->loop, c);
+		return;
+	}
+	// 握手可能已经完成 (FLAG_CLIENT_CONNECTING 已清除)，线程仍要回收。
+	if (c->handshake_thread)
 	{
 		pthread_join(c->handshake_thread, NULL);
+		c->handshake_thread = 0;
 
 		update_wsclient_status(c, 0, FLAG_CLIENT_CONNECTING);
 
@@ -63,6 +149,22 @@ void libwsclient_start_run(wsclient *c)
 	}
 	if (c->sockfd)
 	{
+		if (libwsclient_alloc_send_buf(c) < 0)
+			return;
+		if (c->zerocopy_threshold && !TEST_FLAG(c, FLAG_CLIENT_IS_SSL) && libwsclient_enable_zerocopy(c) < 0)
+		{
+			LIBWSCLIENT_ON_INFO(c, "SO_ZEROCOPY not supported, libwsclient_send_zerocopy will copy.\n");
+		}
+		if (c->nonblocking && libwsclient_set_nonblocking(c) < 0)
+		{
+			LIBWSCLIENT_ON_ERROR(c, "Unable to switch socket to non-blocking mode, falling back to blocking.\n");
+			c->nonblocking = false;
+		}
+		if (c->async_send && pthread_create(&c->send_thread, NULL, libwsclient_send_thread, (void *)c))
+		{
+			LIBWSCLIENT_ON_ERROR(c, "Unable to create send thread, falling back to synchronous send.\n");
+			c->async_send = false;
+		}
 		pthread_create(&c->run_thread, NULL, libwsclient_run_thread, (void *)c);
 	}
 	else
@@ -73,29 +175,105 @@ void libwsclient_start_run(wsclient *c)
 
 void libwsclient_wait_for_end(wsclient *client)
 {
-	if (client->run_thread)
+	if (client->loop)
+		libwsclient_loop_wait(client);
+	else if (client->run_thread)
 	{
 		pthread_join(client->run_thread, NULL);
 	}
 }
 
+// 发送 close 帧，之后设置 FLAG_CLIENT_CLOSEING。主动关闭和回复服务端的 close 可能在不同线程同时发生，只有先到的发送。
+// 返回值同 libwsclient_send_data，close 帧已由其他调用发出时返回 0。
+int libwsclient_send_close(wsclient *client, const unsigned char *payload, unsigned long long payload_len)
+{
+	pthread_mutex_lock(&client->lock);
+	bool sent = client->flags & (FLAG_CLIENT_CLOSE_SENT | FLAG_CLIENT_CLOSEING);
+	client->flags |= FLAG_CLIENT_CLOSE_SENT;
+	pthread_mutex_unlock(&client->lock);
+	if (sent)
+		return 0;
+	int ret = libwsclient_send_data(client, OP_CODE_CONTROL_CLOSE, payload, payload_len);
+	update_wsclient_status(client, FLAG_CLIENT_CLOSEING, 0);
+	return ret;
+}
+
 void libwsclient_close(wsclient *client)
 {
-	if (!TEST_FLAG(client, FLAG_CLIENT_CLOSEING))
-	{
-		char *reason = "0 byebye";
-		libwsclient_send_data(client, OP_CODE_CONTROL_CLOSE, (unsigned char*)reason, strlen(reason));
-		update_wsclient_status(client, FLAG_CLIENT_CLOSEING, 0);
-	};
+	char *reason = "0 byebye";
+	libwsclient_send_close(client, (unsigned char*)reason, strlen(reason));
 	// 提示退出
 	update_wsclient_status(client, FLAG_CLIENT_QUIT, 0);
+	if (client->loop)
+	{
+		// 由 loop 线程等服务端关闭连接后摘下。在回调中调用时，回调返回后由 loop 释放。
+		if (!libwsclient_loop_close(client))
+			return;
+	}
+	else if (client->external_loop)
+	{
+		if (!libwsclient_poll_close(client))
+			return;
+	}
+	else if (client->send_thread)
+	{
+		// 发送线程写完队列中剩余的数据(包括上面的 close 帧)后退出。
+		sem_post(&client->send_sem);
+		pthread_join(client->send_thread, NULL);
+	}
+	else
+	{
+		// 等其他线程写完，再把还在队列里的消息写出。
+		while (__atomic_load_n(&client->send_busy, __ATOMIC_SEQ_CST))
+			sched_yield();
+		libwsclient_flush_send_queue(client);
+	}
 	libwsclient_wait_for_end(client);
+	libwsclient_free(client);
+}
+
+// 释放 client，socket 已关闭，没有线程再使用它。
+void libwsclient_free(wsclient *client)
+{
+	// socket 已关闭，还没收到完成通知的零拷贝缓冲区交还调用方。
+	libwsclient_complete_zerocopy(client, client->zc_pending);
+	client->zc_pending = NULL;
+	wsclient_send_node *node;
+	while ((node = libwsclient_queue_pop(&client->send_queue)) != NULL)
+		free(node);
+	while ((node = libwsclient_queue_pop(&client->send_ctrl_queue)) != NULL)
+		free(node);
 	pthread_mutex_destroy(&client->lock);
-	pthread_mutex_destroy(&client->send_lock);
+	pthread_mutex_destroy(&client->deflate_lock);
+	pthread_mutex_destroy(&client->ssl_lock);
+	sem_destroy(&client->send_sem);
+	sem_destroy(&client->drain_sem);
+	pthread_cond_destroy(&client->loop_cond);
+	libwsclient_deflate_free(client);
+	if (client->ssl)
+	{
+		// socket 已关闭，不再发送 close_notify。标记为已关闭，否则 SSL_free 会把缓存的 session 标记为不可恢复。
+		SSL_set_quiet_shutdown(client->ssl, 1);
+		SSL_shutdown(client->ssl);
+		SSL_free(client->ssl);
+	}
+	BIO_free(client->tls_bio);
+	libwsclient_ssl_ctx_release(client->ssl_ctx);
+	free(client->ssl_peer);
+	free(client->URI);
+	free(client->recv_buf);
+	free(client->msg_buf);
+	free(client->send_buf);
+	free(client->out_buf);
+	if (client->wake_fd[0] >= 0)
+	{
+		close(client->wake_fd[0]);
+		close(client->wake_fd[1]);
+	}
 	free(client);
 }
 
-void libwsclient_send_string(wsclient *client, char *payload)
+int libwsclient_send_string(wsclient *client, const char *payload)
 {
 #ifdef DEBUG
 	char buff[1024] = {0};
@@ -106,205 +284,702 @@ void libwsclient_send_string(wsclient *client, char *payload)
 	}
 #endif
 
-	int nlen = strlen(payload);
+	size_t nlen = strlen(payload);
 	if (nlen <= 0)
-		return;
-	void *pdata = calloc(1, nlen);
-	memcpy(pdata, payload, nlen);
-	libwsclient_send_data(client, OP_CODE_TYPE_TEXT, pdata, nlen);
-	free(pdata);
+		return 0;
+	return libwsclient_send_data(client, OP_CODE_TYPE_TEXT, (const unsigned char *)payload, nlen);
+}
+
+// 生成帧头，返回帧头长度 (含 4 字节 mask key，6 ~ 14 字节)。
+size_t libwsclient_encode_header(unsigned char *header, bool fin, int opcode, unsigned long long len, const unsigned char *mask)
+{
+	size_t z = 2;
+	header[0] = (fin ? 0x80 : 0) | (opcode & (FRAME_RSV1 | 0x0f)); // fin flag, rsv1 (permessage-deflate) and op code
+	if (len <= 125)
+	{
+		header[1] = len;
+	}
+	else if (len <= 0xffff)
+	{
+		header[1] = 126;
+		header[2] = (len >> 8) & 0xff;
+		header[3] = len & 0xff;
+		z += 2;
+	}
+	else
+	{
+		header[1] = 127;
+		for (int i = 0; i < 8; i++)
+			header[2 + i] = (len >> (56 - 8 * i)) & 0xff;
+		z += 8;
+	}
+	header[1] |= 0x80; // add mask
+	memcpy(header + z, mask, 4);
+	return z + 4;
+}
+
+// 从 src 当前位置取 len 字节 mask 到 dst，可以跨多个 iovec，src 随之前移。返回下一段的 offset。
+size_t libwsclient_mask_payload(unsigned char *dst, wsclient_payload *src, size_t len, const unsigned char *mask, size_t offset)
+{
+	while (len > 0)
+	{
+		size_t n = src->iov->iov_len - src->off;
+		if (n == 0)
+		{
+			src->iov++;
+			src->iovcnt--;
+			src->off = 0;
+			continue;
+		}
+		if (n > len)
+			n = len;
+		offset = libwsclient_mask(dst, (const unsigned char *)src->iov->iov_base + src->off, n, mask, offset);
+		src->off += n;
+		dst += n;
+		len -= n;
+	}
+	return offset;
+}
+
+// 编码一帧 (帧头 + mask 后的 payload) 到 dst，dst 至少要有 len + 14 字节。返回写入的字节数。
+size_t libwsclient_encode_frame(unsigned char *dst, bool fin, int opcode, wsclient_payload *payload, unsigned long long len)
+{
+	int mask_int = rand();
+	unsigned char mask[4];
+	memcpy(mask, &mask_int, 4);
+	size_t z = libwsclient_encode_header(dst, fin, opcode, len, mask);
+	libwsclient_mask_payload(dst + z, payload, len, mask, 0); // mask payload
+	return z + len;
+}
+
+// 每个分片的最大 payload。fragment_size 为 0 时不分片，控制帧不能分片。
+static unsigned long long libwsclient_fragment_size(wsclient *client, int opcode, unsigned long long payload_len)
+{
+	if (client->fragment_size == 0 || (opcode & OP_CODE_CONTROL_CLOSE) == OP_CODE_CONTROL_CLOSE || payload_len == 0)
+		return payload_len ? payload_len : 1;
+	return client->fragment_size;
+}
+
+// 把整条消息按分片编码 (帧头 + mask 后的 payload) 到一个队列节点中。fin 为 false 时最后一帧也不带 fin (流式发送)。
+static wsclient_send_node *libwsclient_encode_message(wsclient *client, bool fin, int opcode, wsclient_payload *payload, unsigned long long payload_len)
+{
+	unsigned long long fragment_size = libwsclient_fragment_size(client, opcode, payload_len);
+	unsigned long long nfrag = payload_len ? (payload_len + fragment_size - 1) / fragment_size : 1;
+	if (payload_len >= SIZE_MAX / 2 || nfrag > (SIZE_MAX / 2 - payload_len - sizeof(wsclient_send_node)) / 14)
+	{
+		LIBWSCLIENT_ON_ERROR(client, "Attempted to send too much data");
+		return NULL;
+	}
+	wsclient_send_node *node = malloc(sizeof(wsclient_send_node) + payload_len + nfrag * 14);
+	if (!node)
+	{
+		LIBWSCLIENT_ON_ERROR(client, "Unable to allocate memory in libwsclient_send_data.");
+		return NULL;
+	}
+	node->next = NULL;
+	node->len = 0;
+	node->frames = nfrag;
+	node->data = (unsigned char *)(node + 1);
+	unsigned long long offset = 0;
+	do
+	{
+		unsigned long long nfragsize = payload_len - offset;
+		if (nfragsize > fragment_size)
+			nfragsize = fragment_size;
+		node->len += libwsclient_encode_frame(node->data + node->len, fin && offset + nfragsize == payload_len, offset == 0 ? opcode : OP_CODE_CONTINUE, payload, nfragsize);
+		offset += nfragsize;
+	} while (offset < payload_len);
+	return node;
+}
+
+// 把 send_buf 中已编码的数据写出。调用方持有 send_busy。
+int libwsclient_flush_send_buf(wsclient *client)
+{
+	size_t len = client->send_len;
+	client->send_len = 0;
+	if (len == 0)
+		return 0;
+	return _libwsclient_write(client, client->send_buf, len) == (ssize_t)len ? 0 : -1;
+}
+
+// 编码一帧到 send_buf: 帧头之后，payload 从调用方的缓冲区直接 mask 到 send_buf，满了就写出，一帧可以分几次写。
+// 调用方持有 send_busy。
+int libwsclient_send_frame(wsclient *client, bool fin, int opcode, wsclient_payload *payload, unsigned long long len)
+{
+	int mask_int = rand();
+	unsigned char mask[4];
+	memcpy(mask, &mask_int, 4);
+	if (client->send_buf_size - client->send_len < 14 && libwsclient_flush_send_buf(client) < 0)
+		return -1;
+	client->send_len += libwsclient_encode_header(client->send_buf + client->send_len, fin, opcode, len, mask);
+
+	size_t offset = 0;
+	while (len > 0)
+	{
+		if (client->send_len == client->send_buf_size && libwsclient_flush_send_buf(client) < 0)
+			return -1;
+		size_t n = client->send_buf_size - client->send_len;
+		if (n > len)
+			n = len;
+		offset = libwsclient_mask_payload(client->send_buf + client->send_len, payload, n, mask, offset); // mask payload
+		client->send_len += n;
+		len -= n;
+	}
+	client->stats.frames_out++;
+	return 0;
+}
+
+// 异步发送队列是否已超过 send_queue_high_water，放不下 len 字节的新消息。
+static bool libwsclient_send_queue_full(wsclient *client, size_t len)
+{
+	size_t queued = __atomic_load_n(&client->send_queued, __ATOMIC_SEQ_CST);
+	return client->send_queue_high_water && queued > 0 && queued + len > client->send_queue_high_water;
+}
+
+static int libwsclient_check_send(wsclient *client)
+{
+	if (TEST_FLAG(client, (FLAG_CLIENT_CLOSEING | FLAG_CLIENT_QUIT)))
+	{
+		LIBWSCLIENT_ON_ERROR(client, "Attempted to send after close frame was sent");
+		return -1;
+	}
+	if (TEST_FLAG(client, FLAG_CLIENT_CONNECTING) || !client->send_buf)
+	{
+		LIBWSCLIENT_ON_ERROR(client, "Attempted to send during connect");
+		return -1;
+	}
+	return 0;
+}
+
+// 发送队列中有已完成入队、但排在某个还没完成入队的生产者之后暂时取不出的消息 (可能有本线程之前入队的)。
+// 这时新消息不能越过它们直接写出，也要入队。
+static bool libwsclient_send_backlog(wsclient *client)
+{
+	return __atomic_load_n(&client->send_pushed, __ATOMIC_SEQ_CST) != __atomic_load_n(&client->send_popped, __ATOMIC_SEQ_CST);
+}
+
+// 按分片编码并发送 payload，见 libwsclient_send_iov。
+static int libwsclient_send_payload(wsclient *client, bool fin, int opcode, wsclient_payload *payload, unsigned long long payload_len)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	srand(tv.tv_usec * tv.tv_sec);
+
+	int ret = 0;
+	bool locked = !client->async_send && libwsclient_try_lock_send(client);
+	if (locked)
+	{
+		// 先写出其他线程留在队列里的消息(包括本线程之前入队的)，保证同一线程的消息顺序。
+		ret = libwsclient_write_send_queue(client);
+		if (ret == 0 && libwsclient_send_backlog(client))
+		{
+			libwsclient_unlock_send(client);
+			locked = false;
+		}
+	}
+	if (locked)
+	{
+		// 是否需要分片。第一帧带 opcode，后续为 continue；最后一帧 fin = true (流式发送时由调用方决定)。
+		unsigned long long fragment_size = libwsclient_fragment_size(client, opcode, payload_len);
+		unsigned long long offset = 0;
+		while (ret == 0)
+		{
+			unsigned long long nfragsize = payload_len - offset;
+			if (nfragsize > fragment_size)
+				nfragsize = fragment_size;
+			ret = libwsclient_send_frame(client, fin && offset + nfragsize == payload_len, offset == 0 ? opcode : OP_CODE_CONTINUE, payload, nfragsize);
+			offset += nfragsize;
+			if (offset >= payload_len)
+				break;
+			// 分片之间插入其他线程排队的 ping / pong (比如 run 线程的 pong 回复)。
+			if (ret == 0 && libwsclient_ctrl_pending(client))
+				ret = libwsclient_write_ctrl_queue(client);
+		}
+		if (ret == 0)
+			ret = libwsclient_flush_send_buf(client);
+		client->send_len = 0;
+		libwsclient_unlock_send(client);
+		if (ret < 0)
+		{
+			LIBWSCLIENT_ON_ERROR(client, "Error sending data");
+		}
+		// 解锁期间可能有别的线程入队后没抢到写权限。
+		libwsclient_flush_send_queue(client);
+		return ret;
+	}
+
+	wsclient_send_node *node = libwsclient_encode_message(client, fin, opcode, payload, payload_len);
+	if (!node)
+		return -1;
+	if (opcode == OP_CODE_CONTROL_PING || opcode == OP_CODE_CONTROL_PONG)
+	{
+		// ping / pong 走优先队列，可以插在其他消息的分片之间。close 帧仍按顺序排在数据之后。
+		libwsclient_queue_push(&client->send_ctrl_queue, node);
+		__atomic_fetch_add(&client->send_ctrl_pushed, 1, __ATOMIC_SEQ_CST);
+		if (client->async_send)
+			sem_post(&client->send_sem);
+		else if (libwsclient_flush_send_queue(client) < 0)
+			ret = -1;
+		return ret;
+	}
+	if (client->async_send)
+	{
+		// 数据消息在队列超过 send_queue_high_water 时被拒绝，队列清空后回调 ondrain；close 帧总是入队。
+		// 压缩的消息已经进了压缩流，不能再丢弃，由 libwsclient_send_deflate 在压缩之前检查。
+		bool is_control = (opcode & OP_CODE_CONTROL_CLOSE) == OP_CODE_CONTROL_CLOSE;
+		if (!is_control && !(opcode & FRAME_RSV1) && libwsclient_send_queue_full(client, node->len))
+		{
+			__atomic_store_n(&client->send_queue_full, true, __ATOMIC_SEQ_CST);
+			free(node);
+			return 1;
+		}
+		__atomic_fetch_add(&client->send_queued, node->len, __ATOMIC_SEQ_CST);
+	}
+	libwsclient_queue_push(&client->send_queue, node);
+	__atomic_fetch_add(&client->send_pushed, 1, __ATOMIC_SEQ_CST);
+	if (client->async_send)
+		sem_post(&client->send_sem);
+	else if (libwsclient_flush_send_queue(client) < 0)
+		ret = -1;
+	return ret;
+}
+
+// 本线程正在压缩发送的 client。写出过程中的回调 (onhighwater 等) 再发送时 deflate_buf 还在用，这样的消息不压缩。
+static __thread wsclient *libwsclient_deflating;
+
+// permessage-deflate: 整条消息压缩后设置 RSV1 发送。
+// 持有 deflate_lock 直到压缩结果写出或入队，保证各线程的消息按压缩的顺序发出，服务端才能按同样的上下文解压。
+static int libwsclient_send_deflate(wsclient *client, int opcode, const struct iovec *iov, int iovcnt, unsigned long long payload_len)
+{
+	pthread_mutex_lock(&client->deflate_lock);
+	if (client->async_send && libwsclient_send_queue_full(client, payload_len))
+	{
+		__atomic_store_n(&client->send_queue_full, true, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&client->deflate_lock);
+		return 1;
+	}
+	int ret = -1;
+	ssize_t n = libwsclient_deflate_message(client, iov, iovcnt);
+	if (n < 0)
+	{
+		LIBWSCLIENT_ON_ERROR(client, "Unable to compress message");
+	}
+	else
+	{
+		struct iovec ziov = {client->deflate_buf, n};
+		wsclient_payload payload = {&ziov, 1, 0};
+		libwsclient_deflating = client;
+		ret = libwsclient_send_payload(client, true, opcode | FRAME_RSV1, &payload, n);
+		libwsclient_deflating = NULL;
+	}
+	pthread_mutex_unlock(&client->deflate_lock);
+	return ret;
 }
 
 // 发送数据
 // client: wsclient 对象;
 // opcode: 类型， OP_CODE_TEXT 或者 OP_CODE_BINARY
-// payload: 待发送数据 (utf8字符串，或者字节数据)
+// payload: 待发送数据 (utf8字符串，或者字节数据)，不会被修改。
 // payload_len: 待发送数据长度。
-void libwsclient_send_data(wsclient *client, int opcode, unsigned char *payload, unsigned long long payload_len)
+// 返回值同 libwsclient_send_iov。
+int libwsclient_send_data(wsclient *client, int opcode, const unsigned char *payload, unsigned long long payload_len)
 {
-	int mask_int = 0;
+	if (payload_len > SIZE_MAX)
+	{
+		LIBWSCLIENT_ON_ERROR(client, "Attempted to send too much data");
+		return -1;
+	}
+	struct iovec iov = {(void *)payload, payload_len};
+	return libwsclient_send_iov(client, opcode, &iov, 1);
+}
 
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-	srand(tv.tv_usec * tv.tv_sec);
-	mask_int = rand();
+// 本线程正在发送数据消息的 client。发送过程中的回调再发送 (或零拷贝退回拷贝发送) 时外层已经计数，不再检查流式消息。
+static __thread wsclient *libwsclient_sending;
 
+// 数据消息开始发送: 先计入 send_messages 再检查 send_stream，与 libwsclient_send_begin 先设置 send_stream 再等计数归零配对，
+// 两边至少有一方看到对方，完整的消息不会落在流式消息的分片之间。返回 false 表示流式消息进行中，不能发送。
+static bool libwsclient_enter_message(wsclient *client)
+{
+	__atomic_fetch_add(&client->send_messages, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&client->send_stream, __ATOMIC_SEQ_CST))
+	{
+		__atomic_fetch_sub(&client->send_messages, 1, __ATOMIC_SEQ_CST);
+		LIBWSCLIENT_ON_ERROR(client, "Attempted to send data while a message stream is active");
+		return false;
+	}
+	libwsclient_sending = client;
+	return true;
+}
 
+// 消息已写出或入队。outer 是 enter 之前的 libwsclient_sending。
+static void libwsclient_leave_message(wsclient *client, wsclient *outer)
+{
+	libwsclient_sending = outer;
+	__atomic_fetch_sub(&client->send_messages, 1, __ATOMIC_SEQ_CST);
+}
 
-	if (TEST_FLAG(client, (FLAG_CLIENT_CLOSEING | FLAG_CLIENT_QUIT)))
+// libwsclient_send_iov 的实现。compress 为 false 时即使协商了 permessage-deflate 也不压缩。
+static int libwsclient_send_message(wsclient *client, int opcode, const struct iovec *iov, int iovcnt, bool compress)
+{
+	if (libwsclient_check_send(client) < 0)
+		return -1;
+	if (iovcnt < 0 || (iovcnt > 0 && !iov))
 	{
-		LIBWSCLIENT_ON_ERROR(client, "Attempted to send after close frame was sent");
-		return;
+		LIBWSCLIENT_ON_ERROR(client, "Invalid iovec in libwsclient_send_iov");
+		return -1;
 	}
-	if (TEST_FLAG(client, FLAG_CLIENT_CONNECTING))
+	unsigned long long payload_len = 0;
+	for (int i = 0; i < iovcnt; i++)
 	{
-		LIBWSCLIENT_ON_ERROR(client, "Attempted to send during connect");
-		return;
+		if (iov[i].iov_len > SIZE_MAX / 2 - payload_len)
+		{
+			LIBWSCLIENT_ON_ERROR(client, "Attempted to send too much data");
+			return -1;
+		}
+		payload_len += iov[i].iov_len;
+	}
+	// 控制帧不受流式消息限制。
+	wsclient *outer = libwsclient_sending;
+	bool counted = (opcode & OP_CODE_CONTROL_CLOSE) != OP_CODE_CONTROL_CLOSE && outer != client;
+	if (counted && !libwsclient_enter_message(client))
+		return -1;
+	int ret;
+	// 协商了 permessage-deflate 时，不短于 deflate_threshold 的数据消息压缩后发送。
+	if (compress && client->deflate && (opcode == OP_CODE_TYPE_TEXT || opcode == OP_CODE_TYPE_BINARY) && payload_len >= client->deflate_threshold && libwsclient_deflating != client)
+		ret = libwsclient_send_deflate(client, opcode, iov, iovcnt, payload_len);
+	else
+	{
+		wsclient_payload payload = {iov, iovcnt, 0};
+		ret = libwsclient_send_payload(client, true, opcode, &payload, payload_len);
 	}
-	
-	// 新分配缓存区方便做mask亦或，以便传入的是const char* 字符串。
-	unsigned char *sendbuf = calloc(payload_len + 1, 1);
-	memcpy(sendbuf, payload, payload_len);
-	payload = sendbuf;
+	if (counted)
+		libwsclient_leave_message(client, outer);
+	return ret;
+}
 
-	if (payload_len <= 125)
+// 发送由多块数据拼成的一条消息 (比如固定的头部结构 + 另外分配的消息体)，不需要调用方先拼接。
+// iov: 各块数据按顺序组成 payload，不会被修改，可以有长度为 0 的块。
+// 各块直接 mask 到 send_buf (或队列节点) 中，帧和分片可以跨块，发送方式与 libwsclient_send_data 相同:
+// 没有其他线程在写时，各帧直接编码到 send_buf 写出，不分配内存；一条消息不超过 send_buf 时只需一次写调用。
+// 有其他线程在写时，把编码好的整条消息放入无锁队列后立即返回，由正在写的线程顺带写出，发送线程之间互不阻塞。
+// async_send 模式下总是入队，由发送线程写出。
+// 返回 0 表示已发送(或已入队)，-1 表示出错，1 表示异步发送队列已满、消息未入队，应等 ondrain 回调后再发。
+int libwsclient_send_iov(wsclient *client, int opcode, const struct iovec *iov, int iovcnt)
+{
+	return libwsclient_send_message(client, opcode, iov, iovcnt, true);
+}
+
+// 流式发送一条消息: libwsclient_send_begin 之后每次 libwsclient_send_append 的数据立即作为不带 fin 的分片发出
+// (第一片带 opcode，之后为 continue)，libwsclient_send_end 发出带 fin 的空分片结束消息。
+// 调用方不需要缓存整条消息，生成数据和发送可以重叠。
+// 同一时刻只能有一个流式消息，由调用 begin 的线程 append / end；期间其他数据消息会被拒绝，控制帧 (ping 等) 照常发送。
+// begin 等其他线程已经开始发送的数据消息写出或入队后才返回，它们不会与流式消息的分片交错。
+// opcode: OP_CODE_TYPE_TEXT 或者 OP_CODE_TYPE_BINARY
+int libwsclient_send_begin(wsclient *client, int opcode)
+{
+	if (libwsclient_check_send(client) < 0)
+		return -1;
+	if (opcode != OP_CODE_TYPE_TEXT && opcode != OP_CODE_TYPE_BINARY)
+	{
+		LIBWSCLIENT_ON_ERROR(client, "Invalid opcode in libwsclient_send_begin");
+		return -1;
+	}
+	if (libwsclient_sending == client)
 	{
-		unsigned char header[6] = {0};
-		header[0] = 0x80 | (opcode & 0x0f); // pframe->fin & 0x80; 	// fin flag and op code
-		header[1] = payload_len | 0x80;		// add mask
-		memcpy(&header[2], &mask_int, 4);
+		// 在本线程发送消息过程中的回调里，流式消息的分片会插在这条消息中间。
+		LIBWSCLIENT_ON_ERROR(client, "Attempted to begin a message stream while sending a message");
+		return -1;
+	}
+	int none = 0;
+	if (!__atomic_compare_exchange_n(&client->send_stream, &none, opcode, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+	{
+		LIBWSCLIENT_ON_ERROR(client, "Attempted to begin a message stream while another one is active");
+		return -1;
+	}
+	// 等其他线程已经开始的数据消息写出或入队，之后开始的会看到 send_stream 而被拒绝。
+	while (__atomic_load_n(&client->send_messages, __ATOMIC_SEQ_CST))
+		sched_yield();
+	client->send_stream_started = false;
+	return 0;
+}
 
-		for (size_t i = 0; i < payload_len; i++)
-			*(payload + i) ^= (header[2 + i % 4] & 0xff); // mask payload
+// 返回值同 libwsclient_send_data。返回 1 (异步发送队列已满) 时数据未发出，可在 ondrain 之后重试。
+// 每次 append 至少是一个分片，数据太碎时应由调用方攒成较大的块再 append。
+int libwsclient_send_append(wsclient *client, const unsigned char *data, unsigned long long len)
+{
+	if (libwsclient_check_send(client) < 0)
+		return -1;
+	if (!client->send_stream)
+	{
+		LIBWSCLIENT_ON_ERROR(client, "Attempted to append without libwsclient_send_begin");
+		return -1;
+	}
+	if (len == 0)
+		return 0;
+	if (len > SIZE_MAX / 2)
+	{
+		LIBWSCLIENT_ON_ERROR(client, "Attempted to send too much data");
+		return -1;
+	}
+	struct iovec iov = {(void *)data, len};
+	wsclient_payload payload = {&iov, 1, 0};
+	int ret = libwsclient_send_payload(client, false, client->send_stream_started ? OP_CODE_CONTINUE : client->send_stream, &payload, len);
+	if (ret == 0)
+		client->send_stream_started = true;
+	return ret;
+}
 
-		_libwsclient_write(client, header, 6);
-		_libwsclient_write(client, payload, payload_len);
+int libwsclient_send_end(wsclient *client)
+{
+	if (!client->send_stream)
+	{
+		LIBWSCLIENT_ON_ERROR(client, "Attempted to end without libwsclient_send_begin");
+		return -1;
+	}
+	int ret = -1;
+	if (libwsclient_check_send(client) == 0)
+	{
+		wsclient_payload payload = {NULL, 0, 0};
+		ret = libwsclient_send_payload(client, true, client->send_stream_started ? OP_CODE_CONTINUE : client->send_stream, &payload, 0);
 	}
-	else if (payload_len > 125 && payload_len <= 0xffff)
+	// 返回 1 (异步发送队列已满) 时流保持不变，可在 ondrain 之后重试；其他情况流都已结束。
+	if (ret != 1)
+		__atomic_store_n(&client->send_stream, 0, __ATOMIC_SEQ_CST);
+	return ret;
+}
+
+int libwsclient_send_zerocopy(wsclient *client, int opcode, unsigned char *payload, unsigned long long payload_len, void *cookie)
+{
+	if (libwsclient_check_send(client) < 0)
+		return -1;
+	if (opcode != OP_CODE_TYPE_TEXT && opcode != OP_CODE_TYPE_BINARY)
 	{
-		// 是否需要分片
-		if (payload_len > MAX_PAYLOAD_SIZE)
+		LIBWSCLIENT_ON_ERROR(client, "Invalid opcode in libwsclient_send_zerocopy");
+		return -1;
+	}
+	wsclient *outer = libwsclient_sending;
+	bool counted = outer != client;
+	if (counted && !libwsclient_enter_message(client))
+		return -1;
+	bool copy = !TEST_FLAG(client, FLAG_CLIENT_ZEROCOPY) || payload_len < client->zerocopy_threshold || payload_len > SIZE_MAX / 2 ||
+				client->async_send || !libwsclient_try_lock_send(client);
+	// 先写出排在前面的消息。
+	int ret = copy ? 0 : libwsclient_write_send_queue(client);
+	if (!copy && ret == 0 && libwsclient_send_backlog(client))
+	{
+		libwsclient_unlock_send(client);
+		copy = true;
+	}
+	if (copy)
+	{
+		// 拷贝发送，返回时缓冲区已经可以重用。
+		ret = libwsclient_send_data(client, opcode, payload, payload_len);
+		if (counted)
+			libwsclient_leave_message(client, outer);
+		if (ret == 0 && client->onzerocopy)
+			client->onzerocopy(client, payload, cookie);
+		return ret;
+	}
+
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	srand(tv.tv_usec * tv.tv_sec);
+
+	unsigned long long fragment_size = libwsclient_fragment_size(client, opcode, payload_len);
+	unsigned long long nfrag = payload_len ? (payload_len + fragment_size - 1) / fragment_size : 1;
+	wsclient_zc_msg *zm = ret == 0 ? malloc(sizeof(wsclient_zc_msg) + nfrag * 14) : NULL;
+	if (zm)
+	{
+		zm->next = NULL;
+		zm->payload = payload;
+		zm->cookie = cookie;
+		zm->first = client->zc_seq;
+		zm->remaining = 0;
+		unsigned long long offset = 0;
+		unsigned char *hdr = zm->hdr;
+		do
 		{
-			int nfragsize = MAX_PAYLOAD_SIZE;
-			int nfrag = payload_len / MAX_PAYLOAD_SIZE;
-			if (payload_len % MAX_PAYLOAD_SIZE)
-				nfrag += 1;
-			int istep = 0;
-			int b1 = opcode & 0x0f; // fin = 0, opcode= code;
-			do
-			{
-				unsigned char header[8] = {0};
-				header[0] = b1 & 0xff;
-				header[1] = 126 | 0x80;
-				nfragsize &= 0xffff;
-				for (int i = 0; i < 2; i++)
-				{
-					header[2 + i] = *((char *)&nfragsize + (2 - i - 1));
-				}
-				memcpy(&header[4], &mask_int, 4);
-
-				for (int i = 0; i < MAX_PAYLOAD_SIZE; i++)
-					*(payload + MAX_PAYLOAD_SIZE * istep + i) ^= (header[4 + i % 4] & 0xff); // mask payload
-				_libwsclient_write(client, header, 8);
-				_libwsclient_write(client, payload + MAX_PAYLOAD_SIZE * istep, nfragsize);
-
-				// next op = continue;
-				b1 = OP_CODE_CONTINUE & 0x0f;
-			} while (istep < (nfrag - 1));
-			// 最后一帧
+			unsigned long long n = payload_len - offset;
+			if (n > fragment_size)
+				n = fragment_size;
+			int mask_int = rand();
+			unsigned char mask[4];
+			memcpy(mask, &mask_int, 4);
+			size_t hlen = libwsclient_encode_header(hdr, offset + n == payload_len, offset == 0 ? opcode : OP_CODE_CONTINUE, n, mask);
+			libwsclient_mask(payload + offset, payload + offset, n, mask, 0); // 原地 mask
+			struct iovec iov[2] = {{hdr, hlen}, {payload + offset, n}};
+			int ids = _libwsclient_write_zerocopy(client, iov, 2);
+			if (ids < 0)
 			{
-				// last fin = true;  op = continue;
-				b1 = 0x80 | (OP_CODE_CONTINUE & 0x0f);
-				nfragsize = payload_len % MAX_PAYLOAD_SIZE;
-				if (nfragsize == 0)
-					nfragsize = MAX_PAYLOAD_SIZE;
-
-				unsigned char header[8] = {0};
-				header[0] = b1 & 0xff;
-				header[1] = 126 | 0x80;
-				nfragsize &= 0xffff;
-				for (int i = 0; i < 2; i++)
-				{
-					header[2 + i] = *((char *)&nfragsize + (2 - i - 1));
-				}
-				memcpy(&header[4], &mask_int, 4);
-				for (int i = 0; i < nfragsize; i++)
-					*(payload + MAX_PAYLOAD_SIZE * istep + i) ^= (header[4 + i % 4] & 0xff); // mask payload
-				_libwsclient_write(client, header, 6);
-				_libwsclient_write(client, payload + MAX_PAYLOAD_SIZE * (nfrag - 1), nfragsize);
+				ret = -1;
+				break;
 			}
-		}
-		else
-		{ // 单帧
-			unsigned char header[8] = {0};
-			header[0] = 0x80 | (opcode & 0x0f);
-			header[1] = 126 | 0x80;
-			int nfragsize = payload_len & 0xffff;
-			for (int i = 0; i < 2; i++)
+			zm->remaining += ids;
+			client->stats.frames_out++;
+			hdr += hlen;
+			offset += n;
+			// 分片之间插入排队的 ping / pong。
+			if (offset < payload_len && libwsclient_ctrl_pending(client) && libwsclient_write_ctrl_queue(client) < 0)
 			{
-				header[2 + i] = *((char *)&nfragsize + (2 - i - 1));
+				ret = -1;
+				break;
 			}
-			memcpy(&header[4], &mask_int, 4);
-			for (int i = 0; i < nfragsize; i++)
-				*(payload + i) ^= (header[4 + i % 4] & 0xff); // mask payload
-			_libwsclient_write(client, header, 8);
-			_libwsclient_write(client, payload, nfragsize);
+		} while (offset < payload_len);
+		zm->last = client->zc_seq - 1;
+		// 出错时已经零拷贝发出的分片也要挂上等完成通知，内核可能还在读 payload，之后照常回调 onzerocopy。
+		if (zm->remaining > 0)
+		{
+			wsclient_zc_msg **pp = &client->zc_pending;
+			while (*pp)
+				pp = &(*pp)->next;
+			*pp = zm;
+			zm = NULL;
 		}
 	}
-	else if (payload_len > 0xffff && payload_len <= 0xffffffffffffffffLL)
+	else if (ret == 0)
+	{
+		LIBWSCLIENT_ON_ERROR(client, "Unable to allocate memory in libwsclient_send_zerocopy.");
+		ret = -1;
+	}
+	wsclient_zc_msg *done = libwsclient_reap_zerocopy(client, NULL);
+	libwsclient_unlock_send(client);
+	if (counted)
+		libwsclient_leave_message(client, outer);
+	if (ret < 0)
+	{
+		LIBWSCLIENT_ON_ERROR(client, "Error sending data");
+	}
+	if (zm)
+	{
+		// 全部走了拷贝 (ENOBUFS 或非阻塞模式下写满)，缓冲区已经可以重用。
+		if (ret == 0 && client->onzerocopy)
+			client->onzerocopy(client, payload, cookie);
+		free(zm);
+	}
+	libwsclient_complete_zerocopy(client, done);
+	libwsclient_flush_send_queue(client);
+	return ret;
+}
+
+// 异步发送队列满时等发送线程把队列写空 (与回调 ondrain 同时)。在发送线程中 (回调里) 不能等，返回 -1。
+static int libwsclient_wait_drain(wsclient *client)
+{
+	if (!client->send_thread || pthread_equal(pthread_self(), client->send_thread))
+	{
+		LIBWSCLIENT_ON_ERROR(client, "Send queue full in libwsclient_send_file");
+		return -1;
+	}
+	__atomic_store_n(&client->drain_wait, true, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&client->send_queued, __ATOMIC_SEQ_CST) > 0)
+	{
+		while (sem_wait(&client->drain_sem) < 0 && errno == EINTR)
+			;
+	}
+	return 0;
+}
+
+// 把文件 fd 中从 offset 开始的 len 字节作为一条二进制消息发送，len 为 0 表示到文件末尾。
+// 按 send_buf 大小一块一块作为分片发送 (libwsclient_send_begin / append / end)，文件不整块读进内存:
+// 普通文件只读 mmap (MADV_SEQUENTIAL)，每块从映射中直接 mask 到 send_buf (其他线程正在写或异步发送模式下，
+// 一块编码进一个队列节点)；不能 mmap 的 fd (管道等) 每次读一块。
+// 异步发送队列满时等发送线程写空队列再继续。发送期间与流式发送一样，其他线程的数据消息会被拒绝。
+// 协商了 permessage-deflate 也不压缩: 压缩要把整条消息放进 deflate_buf。
+// 返回值同 libwsclient_send_data。
+int libwsclient_send_file(wsclient *client, int fd, off_t offset, unsigned long long len)
+{
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+	{
+		LIBWSCLIENT_ON_ERROR(client, "Unable to stat file in libwsclient_send_file");
+		return -1;
+	}
+	unsigned char *map = NULL, *data = NULL;
+	size_t map_len = 0;
+	if (S_ISREG(st.st_mode))
 	{
-		// 是否需要分片
-		if (payload_len > MAX_PAYLOAD_SIZE)
+		if (offset < 0 || offset > st.st_size || len > (unsigned long long)(st.st_size - offset))
 		{
-			unsigned long long nfragsize = MAX_PAYLOAD_SIZE;
-			unsigned long long nfrag = payload_len / MAX_PAYLOAD_SIZE;
-			if (payload_len % MAX_PAYLOAD_SIZE)
-				nfrag += 1;
-			size_t istep = 0;
-			int b1 = opcode & 0x0f; // fin = 0, opcode= code;
-			do
-			{
-				unsigned char header[14] = {0};
-				header[0] = b1 & 0xff;
-				header[1] = 127 | 0x80;
-				for (int i = 0; i < 8; i++)
-				{
-					header[2 + i] = *((char *)&nfragsize + (8 - i - 1));
-				}
-				memcpy(&header[10], &mask_int, 4);
-
-				for (unsigned long long i = 0; i < MAX_PAYLOAD_SIZE; i++)
-					*(payload + MAX_PAYLOAD_SIZE * istep + i) ^= (header[10 + i % 4] & 0xff); // mask payload
-				_libwsclient_write(client, header, 14);
-				_libwsclient_write(client, payload + MAX_PAYLOAD_SIZE * istep, nfragsize);
-
-				// next op = continue;
-				b1 = OP_CODE_CONTINUE & 0x0f;
-			} while (istep < (nfrag - 1));
-			// 最后一帧
-			{
-				// last fin = true;  op = continue;
-				b1 = 0x80 | (OP_CODE_CONTINUE & 0x0f);
-				nfragsize = payload_len % MAX_PAYLOAD_SIZE;
-				if (nfragsize == 0)
-					nfragsize = MAX_PAYLOAD_SIZE;
-
-				unsigned char header[14] = {0};
-				header[0] = b1 & 0xff;
-				header[1] = 127 | 0x80;
-				for (int i = 0; i < 8; i++)
-				{
-					header[2 + i] = *((char *)&nfragsize + (2 - i - 1));
-				}
-				memcpy(&header[10], &mask_int, 4);
-				for (unsigned long long i = 0; i < nfragsize; i++)
-					*(payload + MAX_PAYLOAD_SIZE * istep + i) ^= (header[10 + i % 4] & 0xff); // mask payload
-				_libwsclient_write(client, header, 14);
-				_libwsclient_write(client, payload + MAX_PAYLOAD_SIZE * (nfrag - 1), nfragsize);
-			}
+			LIBWSCLIENT_ON_ERROR(client, "File range out of bounds in libwsclient_send_file");
+			return -1;
 		}
+		if (len == 0)
+			len = st.st_size - offset;
+		if (len == 0)
+			return libwsclient_send_message(client, OP_CODE_TYPE_BINARY, NULL, 0, false);
+		// mmap 的偏移必须按页对齐。
+		off_t base = offset & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+		map_len = len + (offset - base);
+		map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fd, base);
+		if (map == MAP_FAILED)
+			map = NULL;
 		else
-		{ // 单帧
-			unsigned char header[14] = {0};
-			header[0] = 0x80 | (opcode & 0x0f);
-			header[1] = 126 | 0x80;
-			int nfragsize = payload_len;
-			for (int i = 0; i < 8; i++)
-			{
-				header[2 + i] = *((char *)&nfragsize + (2 - i - 1));
-			}
-			memcpy(&header[10], &mask_int, 4);
-			for (int i = 0; i < nfragsize; i++)
-				*(payload + i) ^= (header[10 + i % 4] & 0xff); // mask payload
-			_libwsclient_write(client, header, 14);
-			_libwsclient_write(client, payload, nfragsize);
+		{
+			madvise(map, map_len, MADV_SEQUENTIAL);
+			data = map + (offset - base);
 		}
 	}
-	else
+	else if (offset != 0 && lseek(fd, offset, SEEK_SET) < 0)
 	{
-		LIBWSCLIENT_ON_ERROR(client, "Attempted to send too much data");
+		LIBWSCLIENT_ON_ERROR(client, "Unable to seek in libwsclient_send_file");
+		return -1;
+	}
+
+	unsigned char *chunk = data ? NULL : malloc(client->send_buf_size);
+	if (!data && !chunk)
+	{
+		LIBWSCLIENT_ON_ERROR(client, "Unable to allocate memory in libwsclient_send_file.");
+		return -1;
+	}
+	int ret = libwsclient_send_begin(client, OP_CODE_TYPE_BINARY);
+	// 只清理本次调用开始的流，begin 失败可能是其他线程的流正在发送。
+	bool began = ret == 0;
+	unsigned long long sent = 0;
+	while (ret == 0 && (len == 0 || sent < len))
+	{
+		size_t n = client->send_buf_size;
+		if (len && len - sent < n)
+			n = len - sent;
+		if (data)
+		{
+			while ((ret = libwsclient_send_append(client, data + sent, n)) == 1 && libwsclient_wait_drain(client) == 0)
+				;
+			sent += n;
+			continue;
+		}
+		ssize_t r = S_ISREG(st.st_mode) ? pread(fd, chunk, n, offset + sent) : read(fd, chunk, n);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0 || (r == 0 && len))
+		{
+			LIBWSCLIENT_ON_ERROR(client, "Unable to read file in libwsclient_send_file");
+			ret = -1;
+			break;
+		}
+		if (r == 0)
+			break;
+		while ((ret = libwsclient_send_append(client, chunk, r)) == 1 && libwsclient_wait_drain(client) == 0)
+			;
+		sent += r;
+	}
+	free(chunk);
+	if (map)
+		munmap(map, map_len);
+	if (ret == 0)
+	{
+		while ((ret = libwsclient_send_end(client)) == 1 && libwsclient_wait_drain(client) == 0)
+			;
 	}
-	free(sendbuf);
+	if (ret == 1)
+		ret = -1;
+	if (ret < 0 && began && client->send_stream)
+	{
+		// 消息已经发出一部分，无法撤回，只能关闭连接。
+		bool started = client->send_stream_started;
+		__atomic_store_n(&client->send_stream, 0, __ATOMIC_SEQ_CST);
+		if (started)
+			libwsclient_fail(client, 1011, "Unable to send the rest of the file");
+	}
+	return ret;
 }
 
 void libwsclient_send_ping(wsclient *client, char *payload)
@@ -313,3 +988,13 @@ void libwsclient_send_ping(wsclient *client, char *payload)
 		payload = "ok";
 	libwsclient_send_data(client, OP_CODE_CONTROL_PING, (unsigned char*)payload, strlen(payload));
 }
+
+void libwsclient_get_stats(wsclient *client, wsclient_stats *stats)
+{
+	*stats = client->stats;
+}
+
+size_t libwsclient_get_buffered_amount(wsclient *client)
+{
+	return __atomic_load_n(&client->out_len, __ATOMIC_SEQ_CST) + __atomic_load_n(&client->send_queued, __ATOMIC_SEQ_CST);
+}
@@ -0,0 +1,698 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+
+#include "./include/libwsclient.h"
+#include "wsclient.h"
+
+#include "utils.h"
+
+/*
+ * 事件循环
+ *
+ * 默认每个 client 有一个握手线程和一个阻塞读的 run 线程。事件循环模式下一个线程用 epoll 驱动多个 client:
+ * 非阻塞 connect、TLS 握手、升级请求和响应、收数据、写出 out_buf，以及握手和关闭的超时，都在 loop 线程中进行。
+ * 回调也都在 loop 线程中调用，回调中不能阻塞。
+ *
+ * 其他线程仍然可以随时发送: socket 是非阻塞的，写不下的数据进 out_buf，由 loop 在 socket 可写时写出。
+ * socket 水平触发，只在 out_buf 非空时关注 EPOLLOUT。
+ * 其他线程对 loop 的请求 (加入、关闭、恢复等待可写) 放进 inbox，用 eventfd 唤醒 loop 处理。
+ *
+ * 由应用自己的事件循环驱动 (wsclient_options.external_loop) 时没有 wsclient_loop，下面的函数 loop 参数为 NULL:
+ * 应用监听 libwsclient_get_fd，就绪时调用 libwsclient_on_readable / libwsclient_on_writable，
+ * 到 libwsclient_next_timeout 时调用 libwsclient_on_timeout，握手、收发和超时走同样的流程。
+ */
+
+enum _LOOP_CMD_
+{
+	LOOP_CMD_ADD = 1 << 0,
+	LOOP_CMD_CLOSE = 1 << 1,
+	LOOP_CMD_WRITABLE = 1 << 2,
+};
+
+struct _wsclient_loop
+{
+	int epfd;
+	int wake_fd;				// eventfd，inbox 有新命令或要求停止时写入
+	pthread_mutex_t lock;		// 保护 inbox、running、thread
+	wsclient *inbox;			// 有命令等待处理的 client，按 loop_cmd_next 链接
+	wsclient *ready;			// 读满一轮预算的 client，下一轮接着读，按 loop_ready_next 链接
+	wsclient *ready_batch;		// 本轮正在处理的 ready 链表
+	wsclient *graveyard;		// 已关闭的 client，本轮事件处理完后释放 (或通知 libwsclient_close 的调用方)，按 loop_ready_next 链接
+	wsclient **timers;			// 按 deadline 排列的最小堆，下标从 1 开始
+	size_t ntimers;
+	size_t timers_size;
+	size_t nclients;			// 已加入、还没结束的连接数，多核运行时按它分配新连接
+	pthread_t thread;
+	bool running;
+	bool stop;
+};
+
+static void libwsclient_loop_wake(wsclient_loop *loop)
+{
+	uint64_t one = 1;
+	// 计数溢出 (EAGAIN) 时 loop 必然还没处理，不影响唤醒。
+	ssize_t n = write(loop->wake_fd, &one, sizeof(one));
+	(void)n;
+}
+
+wsclient_loop *libwsclient_loop_new(void)
+{
+	wsclient_loop *loop = calloc(1, sizeof(wsclient_loop));
+	if (!loop)
+		return NULL;
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (loop->epfd < 0 || loop->wake_fd < 0 || pthread_mutex_init(&loop->lock, NULL) != 0)
+	{
+		if (loop->epfd >= 0)
+			close(loop->epfd);
+		if (loop->wake_fd >= 0)
+			close(loop->wake_fd);
+		free(loop);
+		return NULL;
+	}
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = loop;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wake_fd, &ev) < 0)
+	{
+		libwsclient_loop_free(loop);
+		return NULL;
+	}
+	return loop;
+}
+
+void libwsclient_loop_free(wsclient_loop *loop)
+{
+	if (!loop)
+		return;
+	close(loop->epfd);
+	close(loop->wake_fd);
+	pthread_mutex_destroy(&loop->lock);
+	free(loop->timers);
+	free(loop);
+}
+
+void libwsclient_loop_stop(wsclient_loop *loop)
+{
+	__atomic_store_n(&loop->stop, true, __ATOMIC_SEQ_CST);
+	libwsclient_loop_wake(loop);
+}
+
+// 定时器: client 的 deadline 组成最小堆，epoll_wait 的超时取堆顶。
+
+static void libwsclient_timer_place(wsclient_loop *loop, size_t i, wsclient *c)
+{
+	loop->timers[i] = c;
+	c->timer_index = i;
+}
+
+static void libwsclient_timer_sift(wsclient_loop *loop, size_t i)
+{
+	wsclient *c = loop->timers[i];
+	while (i > 1 && loop->timers[i / 2]->deadline > c->deadline)
+	{
+		libwsclient_timer_place(loop, i, loop->timers[i / 2]);
+		i /= 2;
+	}
+	for (;;)
+	{
+		size_t child = i * 2;
+		if (child > loop->ntimers)
+			break;
+		if (child < loop->ntimers && loop->timers[child + 1]->deadline < loop->timers[child]->deadline)
+			child++;
+		if (loop->timers[child]->deadline >= c->deadline)
+			break;
+		libwsclient_timer_place(loop, i, loop->timers[child]);
+		i = child;
+	}
+	libwsclient_timer_place(loop, i, c);
+}
+
+// 设置 client 的超时时刻，0 表示取消。
+static void libwsclient_timer_set(wsclient_loop *loop, wsclient *c, unsigned long long deadline)
+{
+	if (!loop)
+	{
+		// 由应用驱动，libwsclient_next_timeout 直接取 deadline。
+		c->deadline = deadline;
+		return;
+	}
+	if (c->timer_index)
+	{
+		size_t i = c->timer_index;
+		wsclient *last = loop->timers[loop->ntimers--];
+		c->timer_index = 0;
+		if (last != c)
+		{
+			loop->timers[i] = last;
+			libwsclient_timer_sift(loop, i);
+		}
+	}
+	c->deadline = deadline;
+	if (!deadline)
+		return;
+	if (loop->ntimers + 1 >= loop->timers_size)
+	{
+		size_t size = loop->timers_size ? loop->timers_size * 2 : 64;
+		wsclient **timers = realloc(loop->timers, size * sizeof(wsclient *));
+		if (!timers)
+			return;
+		loop->timers = timers;
+		loop->timers_size = size;
+	}
+	loop->timers[++loop->ntimers] = c;
+	libwsclient_timer_sift(loop, loop->ntimers);
+}
+
+// 从 ready 链表 (或本轮正在处理的 ready 链表) 中摘下。
+static void libwsclient_ready_remove(wsclient_loop *loop, wsclient *c)
+{
+	if (!c->loop_ready)
+		return;
+	c->loop_ready = false;
+	if (!loop)
+		return;
+	wsclient **lists[2] = {&loop->ready, &loop->ready_batch};
+	for (int i = 0; i < 2; i++)
+	{
+		for (wsclient **pp = lists[i]; *pp; pp = &(*pp)->loop_ready_next)
+		{
+			if (*pp == c)
+			{
+				*pp = c->loop_ready_next;
+				return;
+			}
+		}
+	}
+}
+
+static void libwsclient_loop_release(wsclient *c)
+{
+	pthread_mutex_lock(&c->lock);
+	c->loop_released = true;
+	pthread_cond_broadcast(&c->loop_cond);
+	pthread_mutex_unlock(&c->lock);
+}
+
+// 连接结束: 从 loop 摘下，没有主动关闭时报告 err，回调 onclose (握手完成过的)，关闭 socket。
+// 已调用过 libwsclient_close 的，通知等待的线程 (或由 loop 释放)。
+static void libwsclient_loop_detach(wsclient_loop *loop, wsclient *c, char *err)
+{
+	if (c->loop_closed)
+		return;
+	c->loop_closed = true;
+	bool closing = c->loop_closing;
+	libwsclient_timer_set(loop, c, 0);
+	libwsclient_ready_remove(loop, c);
+	if (c->hs)
+	{
+		libwsclient_handshake_free(c, c->hs);
+		c->hs = NULL;
+	}
+	if (loop)
+	{
+		if (c->sockfd > 0)
+			epoll_ctl(loop->epfd, EPOLL_CTL_DEL, c->sockfd, NULL);
+		__atomic_sub_fetch(&loop->nclients, 1, __ATOMIC_RELAXED);
+	}
+	if (err && !TEST_FLAG(c, FLAG_CLIENT_QUIT))
+	{	//不是主动退出的。
+		LIBWSCLIENT_ON_ERROR(c, err);
+	}
+	if (c->opened && c->onclose)
+	{
+		c->onclose(c);
+	}
+	if (c->sockfd > 0)
+		close(c->sockfd);
+	pthread_mutex_lock(&c->lock);
+	c->loop_ended = true;
+	pthread_cond_broadcast(&c->loop_cond);
+	pthread_mutex_unlock(&c->lock);
+	// 回调中调用 libwsclient_close 的已在 libwsclient_loop_close 中处理。由应用驱动时在 libwsclient_poll_close 中释放。
+	if (!closing || !loop)
+		return;
+	// 本轮 epoll_wait 取到的事件中可能还有它的，处理完再释放。
+	c->loop_ready_next = loop->graveyard;
+	loop->graveyard = c;
+}
+
+// 已发出 close 帧 (或握手还没完成)，等服务端关闭连接，最多等 CLOSE_TIMEOUT。
+static void libwsclient_loop_closing(wsclient_loop *loop, wsclient *c)
+{
+	c->loop_closing = true;
+	if (c->loop_closed)
+	{
+		c->loop_ready_next = loop->graveyard;
+		loop->graveyard = c;
+		return;
+	}
+	if (c->hs)
+		libwsclient_loop_detach(loop, c, NULL);
+	else
+		libwsclient_timer_set(loop, c, libwsclient_now_ms() + CLOSE_TIMEOUT);
+}
+
+// out_buf 由空变为非空时开始关注可写，写完后停止。
+// 由应用驱动时不用登记，应用按 libwsclient_wants_write 决定是否等待可写。
+int libwsclient_loop_watch(wsclient *c, bool writable)
+{
+	if (!c->loop)
+		return 0;
+	struct epoll_event ev;
+	ev.events = EPOLLIN | (writable ? EPOLLOUT : 0);
+	ev.data.ptr = c;
+	return epoll_ctl(c->loop->epfd, EPOLL_CTL_MOD, c->sockfd, &ev);
+}
+
+// 握手中 fd 有变化 (解析完成、换地址重连)，old_fd 还没关闭。由应用驱动时不用登记，应用每次重新取 libwsclient_get_fd。
+int libwsclient_loop_rewatch(wsclient *c, int old_fd, int new_fd)
+{
+	if (!c->loop)
+		return 0;
+	if (old_fd >= 0)
+		epoll_ctl(c->loop->epfd, EPOLL_CTL_DEL, old_fd, NULL);
+	if (new_fd < 0)
+		return 0;
+	// 连接完成时可写。
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLOUT;
+	ev.data.ptr = c;
+	return epoll_ctl(c->loop->epfd, EPOLL_CTL_ADD, new_fd, &ev);
+}
+
+static void libwsclient_loop_read(wsclient_loop *loop, wsclient *c);
+
+// 推进握手，完成后回调 onopen，开始收数据。
+static void libwsclient_loop_handshake(wsclient_loop *loop, wsclient *c, uint32_t events)
+{
+	const char *err = NULL;
+	int r = libwsclient_handshake_step(c, c->hs, events, &err);
+	if (r < 0)
+	{
+		libwsclient_loop_detach(loop, c, (char *)err);
+		return;
+	}
+	if (r == 0)
+	{
+		if (c->hs->deadline != c->deadline)
+			libwsclient_timer_set(loop, c, c->hs->deadline);
+		return;
+	}
+	libwsclient_timer_set(loop, c, 0);
+	libwsclient_handshake_free(c, c->hs);
+	c->hs = NULL;
+	if (c->zerocopy_threshold && !TEST_FLAG(c, FLAG_CLIENT_IS_SSL) && libwsclient_enable_zerocopy(c) < 0)
+	{
+		LIBWSCLIENT_ON_INFO(c, "SO_ZEROCOPY not supported, libwsclient_send_zerocopy will copy.\n");
+	}
+	if (libwsclient_handshake_done(c) < 0)
+	{
+		libwsclient_loop_detach(loop, c, NULL);
+		return;
+	}
+	c->opened = true;
+	// 服务端紧跟在响应之后发来的帧已在接收缓冲区中。
+	if (c->recv_end > c->recv_start && libwsclient_process_recv(c) < 0)
+	{
+		libwsclient_loop_detach(loop, c, "Error receiving data in client loop");
+		return;
+	}
+	// TLS 可能已经把之后的数据读进了 BIO，不会再有可读事件。
+	libwsclient_loop_read(loop, c);
+}
+
+// 到了 client 的超时时刻: 握手阶段超时 (可能换地址继续)，或关闭时等不到服务端关闭连接。
+static void libwsclient_loop_expire(wsclient_loop *loop, wsclient *c)
+{
+	if (!c->hs)
+	{
+		libwsclient_loop_detach(loop, c, NULL);
+		return;
+	}
+	const char *err = NULL;
+	if (libwsclient_handshake_expire(c, c->hs, &err) < 0)
+		libwsclient_loop_detach(loop, c, (char *)err);
+	else
+		libwsclient_timer_set(loop, c, c->hs->deadline);
+}
+
+// 读到 EAGAIN 为止，最多 LOOP_READ_BUDGET 次，读不完的放进 ready 链表下一轮接着读。
+// 由应用驱动时只标记 loop_ready，libwsclient_next_timeout 返回 0，由 libwsclient_on_timeout 接着读。
+static void libwsclient_loop_read(wsclient_loop *loop, wsclient *c)
+{
+	for (int i = 0; i < LOOP_READ_BUDGET; i++)
+	{
+		if (c->loop_closed)
+			return;
+		ssize_t n = libwsclient_fill_recv(c);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (n <= 0 || libwsclient_process_recv(c) < 0)
+		{
+			// 已发出 close 帧，服务端关闭连接是正常结束。
+			libwsclient_loop_detach(loop, c, n == 0 && TEST_FLAG(c, FLAG_CLIENT_CLOSE_SENT) ? NULL : "Error receiving data in client loop");
+			return;
+		}
+	}
+	if (!c->loop_ready && !c->loop_closed)
+	{
+		c->loop_ready = true;
+		if (loop)
+		{
+			c->loop_ready_next = loop->ready;
+			loop->ready = c;
+		}
+	}
+}
+
+static void libwsclient_loop_event(wsclient_loop *loop, wsclient *c, uint32_t events)
+{
+	if (c->loop_closed)
+		return;
+	if (c->hs)
+	{
+		libwsclient_loop_handshake(loop, c, events);
+		return;
+	}
+	// 错误队列中的零拷贝完成通知也会报告 EPOLLERR；没有通知时是真正的错误，交给 recv 报告。
+	if ((events & EPOLLERR) && TEST_FLAG(c, FLAG_CLIENT_ZEROCOPY) && libwsclient_on_socket_errqueue(c))
+		events &= ~EPOLLERR;
+	if (events & EPOLLOUT)
+		libwsclient_on_socket_writable(c);
+	if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+		libwsclient_loop_read(loop, c);
+}
+
+// 开始握手: 解析地址或直接发起非阻塞连接。
+static void libwsclient_loop_start(wsclient_loop *loop, wsclient *c)
+{
+	const char *err = NULL;
+	if (libwsclient_handshake_start(c, c->hs, &err) < 0)
+		libwsclient_loop_detach(loop, c, (char *)err);
+	else
+		libwsclient_timer_set(loop, c, c->hs->deadline);
+}
+
+// 处理 inbox 中的命令。命令可能在处理时由回调新加入，先摘下整个链表。
+static void libwsclient_loop_drain(wsclient_loop *loop)
+{
+	uint64_t v;
+	ssize_t n = read(loop->wake_fd, &v, sizeof(v));
+	(void)n;
+	pthread_mutex_lock(&loop->lock);
+	wsclient *list = NULL, *c = loop->inbox;
+	loop->inbox = NULL;
+	// 按提交顺序处理。
+	while (c)
+	{
+		wsclient *next = c->loop_cmd_next;
+		c->loop_cmd_next = list;
+		list = c;
+		c = next;
+	}
+	pthread_mutex_unlock(&loop->lock);
+	while ((c = list) != NULL)
+	{
+		pthread_mutex_lock(&loop->lock);
+		list = c->loop_cmd_next;
+		int cmd = c->loop_cmd;
+		c->loop_cmd = 0;
+		pthread_mutex_unlock(&loop->lock);
+		if (cmd & LOOP_CMD_ADD)
+			libwsclient_loop_start(loop, c);
+		if ((cmd & LOOP_CMD_WRITABLE) && !c->loop_closed && !c->hs)
+			libwsclient_on_socket_writable(c);
+		if (cmd & LOOP_CMD_CLOSE)
+			libwsclient_loop_closing(loop, c);
+	}
+}
+
+static void libwsclient_loop_post(wsclient_loop *loop, wsclient *c, int cmd)
+{
+	pthread_mutex_lock(&loop->lock);
+	if (!c->loop_cmd)
+	{
+		c->loop_cmd_next = loop->inbox;
+		loop->inbox = c;
+	}
+	c->loop_cmd |= cmd;
+	pthread_mutex_unlock(&loop->lock);
+	libwsclient_loop_wake(loop);
+}
+
+// libwsclient_start_run: 在调用线程中解析 URI，握手交给 loop。loop 为 NULL (由应用驱动) 时直接开始握手。
+int libwsclient_loop_add(wsclient_loop *loop, wsclient *c)
+{
+	wsclient_handshake *hs = libwsclient_handshake_new(c);
+	if (!hs)
+		return -1;
+	free(c->URI);
+	c->URI = NULL;
+	c->hs = hs;
+	c->loop_added = true;
+	if (!loop)
+	{
+		libwsclient_loop_start(NULL, c);
+		return c->loop_closed ? -1 : 0;
+	}
+	__atomic_add_fetch(&loop->nclients, 1, __ATOMIC_RELAXED);
+	libwsclient_loop_post(loop, c, LOOP_CMD_ADD);
+	return 0;
+}
+
+// libwsclient_unlock_send: loop 发现可写时其他线程正在写，暂停了等待可写；写完的线程通过 inbox 让 loop 接着写 out_buf。
+void libwsclient_loop_resume_write(wsclient *c)
+{
+	libwsclient_loop_post(c->loop, c, LOOP_CMD_WRITABLE);
+}
+
+// libwsclient_close: close 帧已发出，FLAG_CLIENT_QUIT 已设置。返回 true 表示 loop 不再引用 client，调用方可以释放；
+// 在 loop 线程中 (回调里) 调用时返回 false，由 loop 在连接结束、当前回调返回之后释放。
+bool libwsclient_loop_close(wsclient *c)
+{
+	wsclient_loop *loop = c->loop;
+	if (!c->loop_added)
+		return true;
+	pthread_mutex_lock(&loop->lock);
+	if (!loop->running)
+	{
+		// loop 没有运行，直接摘下。
+		for (wsclient **pp = &loop->inbox; *pp; pp = &(*pp)->loop_cmd_next)
+		{
+			if (*pp == c)
+			{
+				*pp = c->loop_cmd_next;
+				break;
+			}
+		}
+		c->loop_cmd = 0;
+		pthread_mutex_unlock(&loop->lock);
+		libwsclient_loop_detach(loop, c, NULL);
+		return true;
+	}
+	bool in_loop = pthread_equal(loop->thread, pthread_self());
+	pthread_mutex_unlock(&loop->lock);
+	if (in_loop)
+	{
+		if (!c->loop_closing)
+		{
+			c->loop_free = true;
+			libwsclient_loop_closing(loop, c);
+		}
+		return false;
+	}
+	libwsclient_loop_post(loop, c, LOOP_CMD_CLOSE);
+	pthread_mutex_lock(&c->lock);
+	while (!c->loop_released)
+		pthread_cond_wait(&c->loop_cond, &c->lock);
+	pthread_mutex_unlock(&c->lock);
+	return true;
+}
+
+size_t libwsclient_loop_clients(wsclient_loop *loop)
+{
+	return __atomic_load_n(&loop->nclients, __ATOMIC_RELAXED);
+}
+
+// libwsclient_wait_for_end: 等待连接结束。
+void libwsclient_loop_wait(wsclient *c)
+{
+	if (!c->loop_added)
+		return;
+	pthread_mutex_lock(&c->lock);
+	while (!c->loop_ended)
+		pthread_cond_wait(&c->loop_cond, &c->lock);
+	pthread_mutex_unlock(&c->lock);
+}
+
+// 由应用的事件循环驱动。
+//
+// 回调都在应用调用 libwsclient_on_* 的线程中进行。回调中调用 libwsclient_close 时 polling 为 true，
+// 连接立即关闭，client 在该 libwsclient_on_* 返回前释放。
+
+// libwsclient_close: 尽量写出 close 帧后直接关闭连接，不等服务端回应 (应用线程中不能阻塞等待)。
+// 返回 true 表示调用方可以释放；在回调中调用时返回 false，由外层的 libwsclient_on_* 释放。
+bool libwsclient_poll_close(wsclient *c)
+{
+	if (c->loop_added && !c->loop_closed)
+	{
+		if (!c->hs && __atomic_load_n(&c->out_len, __ATOMIC_SEQ_CST) > 0)
+			libwsclient_on_socket_writable(c);
+		libwsclient_loop_detach(NULL, c, NULL);
+	}
+	if (!c->polling)
+		return true;
+	c->loop_free = true;
+	return false;
+}
+
+static int libwsclient_poll_leave(wsclient *c)
+{
+	c->polling = false;
+	if (c->loop_free)
+	{
+		libwsclient_free(c);
+		return -1;
+	}
+	return c->loop_closed ? -1 : 0;
+}
+
+int libwsclient_get_fd(wsclient *c)
+{
+	if (!c->loop_added || c->loop_closed)
+		return -1;
+	if (c->hs)
+		return libwsclient_handshake_fd(c, c->hs);
+	return c->sockfd > 0 ? c->sockfd : -1;
+}
+
+bool libwsclient_wants_write(wsclient *c)
+{
+	if (!c->loop_added || c->loop_closed)
+		return false;
+	if (c->hs)
+		return libwsclient_handshake_wants_write(c, c->hs);
+	return libwsclient_out_pending(c);
+}
+
+int libwsclient_on_readable(wsclient *c)
+{
+	if (!c->loop_added || c->loop_closed)
+		return -1;
+	c->polling = true;
+	c->loop_ready = false;
+	// 零拷贝完成通知报告为出错，一并检查错误队列。
+	libwsclient_loop_event(NULL, c, EPOLLIN | EPOLLERR);
+	return libwsclient_poll_leave(c);
+}
+
+int libwsclient_on_writable(wsclient *c)
+{
+	if (!c->loop_added || c->loop_closed)
+		return -1;
+	c->polling = true;
+	libwsclient_loop_event(NULL, c, EPOLLOUT);
+	return libwsclient_poll_leave(c);
+}
+
+int libwsclient_next_timeout(wsclient *c)
+{
+	if (!c->loop_added || c->loop_closed)
+		return -1;
+	if (c->loop_ready)
+		return 0;
+	if (!c->deadline)
+		return -1;
+	unsigned long long now = libwsclient_now_ms();
+	return c->deadline <= now ? 0 : c->deadline - now > INT_MAX ? INT_MAX : (int)(c->deadline - now);
+}
+
+int libwsclient_on_timeout(wsclient *c)
+{
+	if (!c->loop_added || c->loop_closed)
+		return -1;
+	c->polling = true;
+	if (c->loop_ready)
+	{
+		c->loop_ready = false;
+		libwsclient_loop_read(NULL, c);
+	}
+	if (!c->loop_closed && c->deadline && c->deadline <= libwsclient_now_ms())
+		libwsclient_loop_expire(NULL, c);
+	return libwsclient_poll_leave(c);
+}
+
+int libwsclient_loop_run(wsclient_loop *loop)
+{
+	struct epoll_event events[LOOP_MAX_EVENTS];
+	int ret = 0;
+	pthread_mutex_lock(&loop->lock);
+	loop->thread = pthread_self();
+	loop->running = true;
+	pthread_mutex_unlock(&loop->lock);
+	while (!__atomic_load_n(&loop->stop, __ATOMIC_SEQ_CST))
+	{
+		int timeout = -1;
+		if (loop->ready)
+			timeout = 0;
+		else if (loop->ntimers)
+		{
+			unsigned long long now = libwsclient_now_ms(), deadline = loop->timers[1]->deadline;
+			timeout = deadline <= now ? 0 : deadline - now > INT_MAX ? INT_MAX : (int)(deadline - now);
+		}
+		int n = epoll_wait(loop->epfd, events, LOOP_MAX_EVENTS, timeout);
+		if (n < 0 && errno != EINTR)
+		{
+			ret = -1;
+			break;
+		}
+		for (int i = 0; i < n; i++)
+		{
+			if (events[i].data.ptr == loop)
+				libwsclient_loop_drain(loop);
+			else
+				libwsclient_loop_event(loop, events[i].data.ptr, events[i].events);
+		}
+		wsclient *c;
+		loop->ready_batch = loop->ready;
+		loop->ready = NULL;
+		while ((c = loop->ready_batch) != NULL)
+		{
+			loop->ready_batch = c->loop_ready_next;
+			c->loop_ready = false;
+			libwsclient_loop_read(loop, c);
+		}
+		unsigned long long now = libwsclient_now_ms();
+		while (loop->ntimers && loop->timers[1]->deadline <= now)
+		{
+			libwsclient_loop_expire(loop, loop->timers[1]);
+		}
+		while ((c = loop->graveyard) != NULL)
+		{
+			loop->graveyard = c->loop_ready_next;
+			if (c->loop_free)
+				libwsclient_free(c);
+			else
+				libwsclient_loop_release(c);
+		}
+	}
+	pthread_mutex_lock(&loop->lock);
+	loop->running = false;
+	loop->stop = false;
+	pthread_mutex_unlock(&loop->lock);
+	return ret;
+}
@@ -0,0 +1,109 @@
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "utils.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LIBWSCLIENT_MASK_X86
+#endif
+
+/*
+ * websocket payload mask (rfc6455 5.3)
+ *
+ * dst[i] = src[i] ^ key[(offset + i) % 4]
+ *
+ * 一帧分多段处理时，offset 为该段在帧 payload 中的起始位置 (只用到低两位)。
+ * 先逐字节处理到 dst 对齐，然后按 32 (AVX2) / 16 (SSE2) / 8 (64位标量) 字节一组处理，最后逐字节处理尾部。
+ * 每组长度都是 4 的倍数，组内 mask 排列不变，只需按起始偏移把 key 旋转一次。
+ */
+
+static inline uint32_t _mask_rotate_key(const unsigned char key[4], size_t offset)
+{
+	unsigned char k[4];
+	uint32_t k32;
+	for (int i = 0; i < 4; i++)
+		k[i] = key[(offset + i) & 3];
+	memcpy(&k32, k, 4);
+	return k32;
+}
+
+static size_t _mask_head(unsigned char **dst, const unsigned char **src, size_t *len, const unsigned char key[4], size_t offset, size_t align)
+{
+	while (*len > 0 && ((uintptr_t)*dst & (align - 1)))
+	{
+		**dst = **src ^ key[offset & 3];
+		(*dst)++;
+		(*src)++;
+		(*len)--;
+		offset++;
+	}
+	return offset;
+}
+
+static size_t _mask_tail(unsigned char *dst, const unsigned char *src, size_t len, const unsigned char key[4], size_t offset)
+{
+	for (size_t i = 0; i < len; i++)
+		dst[i] = src[i] ^ key[(offset + i) & 3];
+	return offset + len;
+}
+
+static size_t _mask_scalar(unsigned char *dst, const unsigned char *src, size_t len, const unsigned char key[4], size_t offset)
+{
+	offset = _mask_head(&dst, &src, &len, key, offset, 8);
+	uint32_t k32 = _mask_rotate_key(key, offset);
+	uint64_t k64 = ((uint64_t)k32 << 32) | k32;
+	size_t n = len & ~(size_t)7;
+	for (size_t i = 0; i < n; i += 8)
+	{
+		uint64_t v;
+		memcpy(&v, src + i, 8);
+		v ^= k64;
+		memcpy(dst + i, &v, 8);
+	}
+	return _mask_tail(dst + n, src + n, len - n, key, offset + n);
+}
+
+#ifdef LIBWSCLIENT_MASK_X86
+__attribute__((target("sse2"))) static size_t _mask_sse2(unsigned char *dst, const unsigned char *src, size_t len, const unsigned char key[4], size_t offset)
+{
+	offset = _mask_head(&dst, &src, &len, key, offset, 16);
+	__m128i k = _mm_set1_epi32((int)_mask_rotate_key(key, offset));
+	size_t n = len & ~(size_t)15;
+	for (size_t i = 0; i < n; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		_mm_store_si128((__m128i *)(dst + i), _mm_xor_si128(v, k));
+	}
+	return _mask_tail(dst + n, src + n, len - n, key, offset + n);
+}
+
+__attribute__((target("avx2"))) static size_t _mask_avx2(unsigned char *dst, const unsigned char *src, size_t len, const unsigned char key[4], size_t offset)
+{
+	offset = _mask_head(&dst, &src, &len, key, offset, 32);
+	__m256i k = _mm256_set1_epi32((int)_mask_rotate_key(key, offset));
+	size_t n = len & ~(size_t)31;
+	for (size_t i = 0; i < n; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+		_mm256_store_si256((__m256i *)(dst + i), _mm256_xor_si256(v, k));
+	}
+	return _mask_tail(dst + n, src + n, len - n, key, offset + n);
+}
+#endif
+
+// 对 len 字节做 mask，dst 可以等于 src。返回下一段的 offset。
+size_t libwsclient_mask(unsigned char *dst, const unsigned char *src, size_t len, const unsigned char key[4], size_t offset)
+{
+	// 太短的数据，对齐和旋转 key 的开销不划算。
+	if (len < 32)
+		return _mask_tail(dst, src, len, key, offset);
+#ifdef LIBWSCLIENT_MASK_X86
+	if (len >= 64 && __builtin_cpu_supports("avx2"))
+		return _mask_avx2(dst, src, len, key, offset);
+	if (__builtin_cpu_supports("sse2"))
+		return _mask_sse2(dst, src, len, key, offset);
+#endif
+	return _mask_scalar(dst, src, len, key, offset);
+}
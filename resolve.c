@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+
+#include "./include/libwsclient.h"
+#include "wsclient.h"
+
+#include "utils.h"
+
+/*
+ * 异步 DNS 解析
+ *
+ * getaddrinfo 只有阻塞版本。所有连接共享最多 RESOLVER_THREADS 个解析线程，按需创建，空闲时等在条件变量上。
+ * 每个请求带一个 eventfd，解析完成时可读，握手状态机像等 socket 一样等它，不需要为每个握手占一个线程。
+ * 请求完成之前握手可能因超时或 libwsclient_close 放弃，这时由解析线程在完成后释放请求。
+ */
+
+struct _wsclient_resolve
+{
+	struct _wsclient_resolve *next;
+	char host[200];
+	char port[10];
+	int fd;						// eventfd，解析完成时可读
+	int status;					// getaddrinfo 的返回值
+	struct addrinfo *addrs;
+	bool started;				// 已被解析线程取走
+	bool done;
+	bool cancelled;				// 握手已放弃，由解析线程释放
+};
+
+static pthread_mutex_t resolver_lock = PTHREAD_MUTEX_INITIALIZER;	// 保护队列、线程数和各请求的状态
+static pthread_cond_t resolver_cond = PTHREAD_COND_INITIALIZER;
+static wsclient_resolve *resolver_head;
+static wsclient_resolve *resolver_tail;
+static int resolver_threads;
+static int resolver_idle;
+
+static void libwsclient_resolve_free(wsclient_resolve *r)
+{
+	if (r->addrs)
+		freeaddrinfo(r->addrs);
+	close(r->fd);
+	free(r);
+}
+
+static void *libwsclient_resolver_thread(void *ptr)
+{
+	(void)ptr;
+	pthread_mutex_lock(&resolver_lock);
+	for (;;)
+	{
+		while (!resolver_head)
+		{
+			resolver_idle++;
+			pthread_cond_wait(&resolver_cond, &resolver_lock);
+			resolver_idle--;
+		}
+		wsclient_resolve *r = resolver_head;
+		resolver_head = r->next;
+		if (!resolver_head)
+			resolver_tail = NULL;
+		r->started = true;
+		pthread_mutex_unlock(&resolver_lock);
+
+		struct addrinfo hints, *addrs = NULL;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		int status = getaddrinfo(r->host, r->port, &hints, &addrs);
+
+		pthread_mutex_lock(&resolver_lock);
+		r->status = status;
+		r->addrs = status == 0 ? addrs : NULL;
+		r->done = true;
+		if (r->cancelled)
+			libwsclient_resolve_free(r);
+		else
+		{
+			// 在锁内写，请求不会在这之前被释放。
+			uint64_t one = 1;
+			ssize_t n = write(r->fd, &one, sizeof(one));
+			(void)n;
+		}
+	}
+	return NULL;
+}
+
+// 提交解析请求。返回 NULL 表示无法创建 eventfd 或解析线程。
+wsclient_resolve *libwsclient_resolve_start(const char *host, const char *port)
+{
+	wsclient_resolve *r = calloc(1, sizeof(wsclient_resolve));
+	if (!r)
+		return NULL;
+	r->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (r->fd < 0)
+	{
+		free(r);
+		return NULL;
+	}
+	snprintf(r->host, sizeof(r->host), "%s", host);
+	snprintf(r->port, sizeof(r->port), "%s", port);
+	pthread_mutex_lock(&resolver_lock);
+	if (resolver_idle == 0 && resolver_threads < RESOLVER_THREADS)
+	{
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, libwsclient_resolver_thread, NULL) == 0)
+		{
+			pthread_detach(thread);
+			resolver_threads++;
+		}
+		else if (resolver_threads == 0)
+		{
+			pthread_mutex_unlock(&resolver_lock);
+			libwsclient_resolve_free(r);
+			return NULL;
+		}
+	}
+	if (resolver_tail)
+		resolver_tail->next = r;
+	else
+		resolver_head = r;
+	resolver_tail = r;
+	pthread_cond_signal(&resolver_cond);
+	pthread_mutex_unlock(&resolver_lock);
+	return r;
+}
+
+int libwsclient_resolve_fd(wsclient_resolve *r)
+{
+	return r->fd;
+}
+
+// 解析完成时取走结果 (status 为 getaddrinfo 的返回值，成功时 *addrs 由调用方 freeaddrinfo)，释放请求并返回 true。
+bool libwsclient_resolve_result(wsclient_resolve *r, struct addrinfo **addrs, int *status)
+{
+	pthread_mutex_lock(&resolver_lock);
+	bool done = r->done;
+	pthread_mutex_unlock(&resolver_lock);
+	if (!done)
+		return false;
+	*status = r->status;
+	*addrs = r->addrs;
+	r->addrs = NULL;
+	libwsclient_resolve_free(r);
+	return true;
+}
+
+// 放弃请求。还在排队的直接摘下，正在解析的由解析线程在完成后释放。
+void libwsclient_resolve_cancel(wsclient_resolve *r)
+{
+	pthread_mutex_lock(&resolver_lock);
+	if (r->done)
+	{
+		pthread_mutex_unlock(&resolver_lock);
+		libwsclient_resolve_free(r);
+		return;
+	}
+	if (r->started)
+	{
+		r->cancelled = true;
+		pthread_mutex_unlock(&resolver_lock);
+		return;
+	}
+	wsclient_resolve *prev = NULL;
+	for (wsclient_resolve *p = resolver_head; p; prev = p, p = p->next)
+	{
+		if (p == r)
+		{
+			if (prev)
+				prev->next = r->next;
+			else
+				resolver_head = r->next;
+			if (resolver_tail == r)
+				resolver_tail = prev;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&resolver_lock);
+	libwsclient_resolve_free(r);
+}
@@ -0,0 +1,144 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "./include/libwsclient.h"
+#include "wsclient.h"
+
+#include "utils.h"
+
+/*
+ * 多核运行时
+ *
+ * nworkers 个 I/O 线程，各运行一个事件循环，依次绑定到进程可用的 CPU 上。
+ * 新连接在 libwsclient_start_run 时分给当前连接数最少的事件循环，之后它的读写和回调一直在这个线程中，
+ * 连接之间不共享状态，不同线程的连接互不加锁，数据也不会在 CPU 之间来回搬。
+ */
+
+typedef struct _wsclient_worker
+{
+	wsclient_loop *loop;
+	pthread_t thread;
+	bool started;
+} wsclient_worker;
+
+struct _wsclient_runtime
+{
+	int nworkers;
+	unsigned int next;			// 下一次挑选的起点，连接数相同时轮流分配
+	wsclient_worker workers[];
+};
+
+static void *libwsclient_worker_thread(void *ptr)
+{
+	wsclient_worker *w = ptr;
+	libwsclient_loop_run(w->loop);
+	return NULL;
+}
+
+// 进程可用 (sched_getaffinity) 的第 i 个 CPU，按可用 CPU 数取模。取不到时返回 -1。
+static int libwsclient_worker_cpu(int i)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) < 0 || CPU_COUNT(&set) == 0)
+		return -1;
+	i %= CPU_COUNT(&set);
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+	{
+		if (CPU_ISSET(cpu, &set) && i-- == 0)
+			return cpu;
+	}
+	return -1;
+}
+
+wsclient_runtime *libwsclient_runtime_new(int nworkers)
+{
+	if (nworkers <= 0)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		nworkers = sched_getaffinity(0, sizeof(set), &set) == 0 ? CPU_COUNT(&set) : 1;
+		if (nworkers <= 0)
+			nworkers = 1;
+	}
+	wsclient_runtime *rt = calloc(1, sizeof(wsclient_runtime) + nworkers * sizeof(wsclient_worker));
+	if (!rt)
+		return NULL;
+	rt->nworkers = nworkers;
+	for (int i = 0; i < nworkers; i++)
+	{
+		wsclient_worker *w = &rt->workers[i];
+		w->loop = libwsclient_loop_new();
+		if (!w->loop)
+		{
+			libwsclient_runtime_free(rt);
+			return NULL;
+		}
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		int cpu = libwsclient_worker_cpu(i);
+		if (cpu >= 0)
+		{
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpu, &set);
+			pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+		}
+		int ret = pthread_create(&w->thread, &attr, libwsclient_worker_thread, w);
+		pthread_attr_destroy(&attr);
+		if (ret != 0)
+		{
+			libwsclient_runtime_free(rt);
+			return NULL;
+		}
+		w->started = true;
+	}
+	return rt;
+}
+
+int libwsclient_runtime_workers(wsclient_runtime *rt)
+{
+	return rt->nworkers;
+}
+
+// 当前连接数最少的事件循环。从轮流的起点开始找，同时创建的连接不会都挤到同一个线程。
+wsclient_loop *libwsclient_runtime_pick(wsclient_runtime *rt)
+{
+	unsigned int start = __atomic_fetch_add(&rt->next, 1, __ATOMIC_RELAXED) % rt->nworkers;
+	wsclient_loop *best = rt->workers[start].loop;
+	size_t best_load = libwsclient_loop_clients(best);
+	for (int k = 1; k < rt->nworkers && best_load > 0; k++)
+	{
+		wsclient_loop *loop = rt->workers[(start + k) % rt->nworkers].loop;
+		size_t load = libwsclient_loop_clients(loop);
+		if (load < best_load)
+		{
+			best = loop;
+			best_load = load;
+		}
+	}
+	return best;
+}
+
+void libwsclient_runtime_free(wsclient_runtime *rt)
+{
+	if (!rt)
+		return;
+	for (int i = 0; i < rt->nworkers; i++)
+	{
+		wsclient_worker *w = &rt->workers[i];
+		if (w->started)
+		{
+			libwsclient_loop_stop(w->loop);
+			pthread_join(w->thread, NULL);
+		}
+		libwsclient_loop_free(w->loop);
+	}
+	free(rt);
+}
@@ -4,6 +4,9 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "libwsclient.h"
 
 int onclose(wsclient *c) {
@@ -56,15 +59,25 @@ int onopen(wsclient *c) {
 		char* fname = namelist[n]->d_name;		
 		int isText = fname[strlen(fname)-1] == 's';
 		
-		char buff[1024*10] = {0};
-		FILE* finput = open(fname, 'r');
-		size_t flen = read(finput, buff, 1024*10);
-		close(finput);
-		
-		if (isText)
+		int finput = open(fname, O_RDONLY);
+		if (finput < 0) {
+			free(namelist[n]);
+			continue;
+		}
+		size_t flen = 0;
+		if (isText) {
+			char buff[1024*10] = {0};
+			flen = read(finput, buff, 1024*10 - 1);
 			libwsclient_send_string(c, buff);
-		else
-			libwsclient_send_data(c, OP_CODE_TYPE_BINARY, (unsigned char*)buff, flen);
+		}
+		else {
+			// 整个文件作为一条二进制消息发送，不需要先读进缓冲区。
+			struct stat st;
+			fstat(finput, &st);
+			flen = st.st_size;
+			libwsclient_send_file(c, finput, 0, 0);
+		}
+		close(finput);
 
 		fprintf(stderr, "sending %ld byte %s from: %s\n", flen, isText ? "Text" : "Data",  fname);
 		free(namelist[n]);
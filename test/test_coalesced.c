@@ -0,0 +1,171 @@
+// 握手响应与之后的帧: 服务端在写 101 响应的同一次写入中紧跟着发出一批帧，或者把响应拆成小块、间隔着写出，
+// 客户端都要在握手完成后按顺序收到这批帧 (包括分片的消息和 ping)，之后一次写入的一批帧也全部收到。
+// run 线程和事件循环各测一遍，ws 和 wss 各测一遍。
+#include "wstest.h"
+
+#define BATCH_MESSAGES 4			// 每批帧中的消息数，另有一个 ping
+#define SMALL_SIZE 300
+#define LARGE_SIZE 70000			// 超过接收缓冲区，跨多次读取
+
+typedef struct
+{
+	const char *name;
+	bool tls;
+	bool use_loop;
+	size_t response_chunk;			// 握手响应每次写出的字节数，0 表示一次写出
+	int pongs;						// 服务端收到的 pong 数
+} coalesced_case;
+
+static unsigned char batch[4 * LARGE_SIZE];
+static size_t batch_len;
+static unsigned char data[LARGE_SIZE];
+static int messages;
+static volatile bool opened;
+static volatile bool closing;
+
+static void add_frame(bool fin, int opcode, const void *payload, size_t len)
+{
+	batch_len += wstest_frame_header(batch + batch_len, fin, opcode, len);
+	memcpy(batch + batch_len, payload, len);
+	batch_len += len;
+}
+
+// 一批帧: 文本、二进制、分成 3 片的文本、ping、较大的二进制。
+static void build_batch(void)
+{
+	add_frame(true, OP_CODE_TYPE_TEXT, "hello", 5);
+	add_frame(true, OP_CODE_TYPE_BINARY, data, SMALL_SIZE);
+	add_frame(false, OP_CODE_TYPE_TEXT, "frag", 4);
+	add_frame(false, OP_CODE_CONTINUE, "ment", 4);
+	add_frame(true, OP_CODE_CONTINUE, "ed", 2);
+	add_frame(true, OP_CODE_CONTROL_PING, "p", 1);
+	add_frame(true, OP_CODE_TYPE_BINARY, data, LARGE_SIZE);
+}
+
+// 握手时已随响应发出一批，再一次写出一批，然后数 pong 直到 close 帧。
+static void burst_and_count(wstest_conn *conn, void *arg)
+{
+	coalesced_case *cc = arg;
+	pthread_mutex_lock(&conn->write_lock);
+	WSTEST_CHECK(wstest_write_all(conn, batch, batch_len) == 0, "server write failed");
+	pthread_mutex_unlock(&conn->write_lock);
+	wstest_frame f = {0};
+	while (wstest_read_frame(conn, &f) == 0 && f.opcode != OP_CODE_CONTROL_CLOSE)
+	{
+		WSTEST_CHECK(f.opcode == OP_CODE_CONTROL_PONG && f.len == 1 && f.payload[0] == 'p', "%s: unexpected frame: opcode %d, %llu bytes", cc->name,
+					 f.opcode, f.len);
+		__atomic_add_fetch(&cc->pongs, 1, __ATOMIC_SEQ_CST);
+	}
+	free(f.payload);
+}
+
+static void *loop_thread(void *arg)
+{
+	libwsclient_loop_run(arg);
+	return NULL;
+}
+
+static int onopen(wsclient *c)
+{
+	(void)c;
+	opened = true;
+	return 0;
+}
+
+static int onmessage(wsclient *c, bool isText, unsigned long long len, unsigned char *payload)
+{
+	(void)c;
+	int n = messages;
+	switch (n % BATCH_MESSAGES)
+	{
+	case 0:
+		WSTEST_CHECK(isText && len == 5 && memcmp(payload, "hello", 5) == 0, "message %d differs", n);
+		break;
+	case 1:
+		WSTEST_CHECK(!isText && len == SMALL_SIZE && memcmp(payload, data, len) == 0, "message %d differs", n);
+		break;
+	case 2:
+		WSTEST_CHECK(isText && len == 10 && memcmp(payload, "fragmented", 10) == 0, "message %d differs", n);
+		break;
+	default:
+		WSTEST_CHECK(!isText && len == LARGE_SIZE && memcmp(payload, data, len) == 0, "message %d differs", n);
+		break;
+	}
+	__atomic_store_n(&messages, n + 1, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+static int onerror(wsclient *c, int code, char *msg)
+{
+	(void)c;
+	WSTEST_CHECK(!code || closing, "onerror (%d): %s", code, msg);
+	return 0;
+}
+
+static void run(coalesced_case *cc)
+{
+	wstest_server srv = {0};
+	srv.greeting = batch;
+	srv.greeting_len = batch_len;
+	srv.response_chunk = cc->response_chunk;
+	wstest_server_start(&srv, cc->tls, burst_and_count, cc);
+	messages = 0;
+	opened = false;
+	closing = false;
+	wsclient_loop *loop = NULL;
+	pthread_t th;
+	if (cc->use_loop)
+	{
+		loop = libwsclient_loop_new();
+		WSTEST_CHECK(loop, "libwsclient_loop_new failed");
+		WSTEST_CHECK(pthread_create(&th, NULL, loop_thread, loop) == 0, "pthread_create failed");
+	}
+
+	wsclient_options opts;
+	libwsclient_options_init(&opts);
+	opts.loop = loop;
+	wsclient *c = libwsclient_new_with_options(srv.uri, &opts);
+	WSTEST_CHECK(c, "libwsclient_new_with_options failed");
+	c->onopen = onopen;
+	c->onmessage = onmessage;
+	c->onerror = onerror;
+	libwsclient_start_run(c);
+	WSTEST_WAIT(opened, 5);
+	WSTEST_CHECK(opened, "%s: not connected", srv.uri);
+
+	WSTEST_WAIT(__atomic_load_n(&messages, __ATOMIC_SEQ_CST) == 2 * BATCH_MESSAGES && __atomic_load_n(&cc->pongs, __ATOMIC_SEQ_CST) == 2, 5);
+	WSTEST_CHECK(__atomic_load_n(&messages, __ATOMIC_SEQ_CST) == 2 * BATCH_MESSAGES, "%s: received %d of %d messages", cc->name, messages,
+				 2 * BATCH_MESSAGES);
+	WSTEST_CHECK(__atomic_load_n(&cc->pongs, __ATOMIC_SEQ_CST) == 2, "%s: server received %d of 2 pongs", cc->name, cc->pongs);
+	printf("%s %s: %d messages, %d pongs\n", srv.uri, cc->name, messages, cc->pongs);
+	closing = true;
+	libwsclient_close(c);
+	wstest_server_stop(&srv);
+	if (cc->use_loop)
+	{
+		libwsclient_loop_stop(loop);
+		pthread_join(th, NULL);
+		libwsclient_loop_free(loop);
+	}
+}
+
+int main(void)
+{
+	for (size_t i = 0; i < sizeof(data); i++)
+		data[i] = (unsigned char)(i * 13 + 5);
+	build_batch();
+	coalesced_case cases[] = {
+		{"coalesced", false, false, 0, 0},
+		{"coalesced loop", false, true, 0, 0},
+		{"coalesced tls", true, false, 0, 0},
+		{"split", false, false, 7, 0},
+		{"split loop", false, true, 7, 0},
+		{"byte by byte", false, false, 1, 0},
+		{"byte by byte loop", false, true, 1, 0},
+		{"byte by byte tls", true, false, 1, 0},
+	};
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+		run(&cases[i]);
+	printf("test_coalesced: ok\n");
+	return 0;
+}
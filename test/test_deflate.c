@@ -0,0 +1,235 @@
+// permessage-deflate: 客户端在握手请求中提出压缩扩展，服务端同意后两个方向的消息都可以压缩 (RSV1)，
+// 压缩流跨消息复用；服务端不同意时都不压缩。解压超出 max_message_size 的消息 (压缩炸弹) 时客户端发出 1009 close 帧。
+#include <zlib.h>
+#include "wstest.h"
+
+#define MESSAGES 40
+#define MAX_SIZE 100000
+#define BOMB_LIMIT (64 << 10)
+#define BOMB_SIZE (16 << 20)			// 解压后的大小，压缩后只有十几 KB
+
+typedef struct
+{
+	const char *name;
+	const char *response_headers;		// NULL 表示服务端不同意压缩
+	bool bomb;
+	int close_code;						// 服务端收到的 close 帧的状态码
+	int server_received;				// 服务端收到的客户端消息数
+	int server_compressed;				// 其中压缩的消息数
+} deflate_case;
+
+static const size_t sizes[] = {20, 200, 5000, MAX_SIZE};
+static unsigned char *zbuf;				// 服务端压缩 / 解压用
+static int messages;
+static volatile bool opened;
+static volatile bool closing;
+static volatile bool limit_error;
+
+// 第 i 条消息的长度和内容，内容重复度高，容易压缩。
+static size_t message(int i, unsigned char *buf)
+{
+	size_t len = sizes[i % 4] + i;
+	for (size_t k = 0; k < len; k++)
+		buf[k] = "{\"seq\":0,\"value\":[]}"[(k / 3 + i) % 20];
+	return len;
+}
+
+// 按 rfc7692 压缩一条消息: Z_SYNC_FLUSH 后去掉结尾的 00 00 ff ff。
+static size_t compress_message(z_stream *zs, const unsigned char *in, size_t len, unsigned char *out, size_t cap)
+{
+	zs->next_in = (Bytef *)in;
+	zs->avail_in = len;
+	zs->next_out = out;
+	zs->avail_out = cap;
+	WSTEST_CHECK(deflate(zs, Z_SYNC_FLUSH) == Z_OK && zs->avail_in == 0 && zs->avail_out > 0, "deflate failed");
+	size_t n = cap - zs->avail_out;
+	WSTEST_CHECK(n >= 4 && memcmp(out + n - 4, "\x00\x00\xff\xff", 4) == 0, "no sync flush trailer");
+	return n - 4;
+}
+
+// 解压一条消息 (补回结尾的 00 00 ff ff)，返回解压后的长度。
+static size_t inflate_message(z_stream *zs, const unsigned char *in, size_t len, unsigned char *out, size_t cap)
+{
+	zs->next_out = out;
+	zs->avail_out = cap;
+	zs->next_in = (Bytef *)in;
+	zs->avail_in = len;
+	WSTEST_CHECK(inflate(zs, Z_SYNC_FLUSH) == Z_OK && zs->avail_in == 0, "inflate failed");
+	zs->next_in = (Bytef *)"\x00\x00\xff\xff";
+	zs->avail_in = 4;
+	int r = inflate(zs, Z_SYNC_FLUSH);
+	WSTEST_CHECK((r == Z_OK || r == Z_BUF_ERROR) && zs->avail_in == 0 && zs->avail_out > 0, "inflate trailer failed");
+	return cap - zs->avail_out;
+}
+
+static void send_messages(wstest_conn *conn, deflate_case *dc, z_stream *zs)
+{
+	unsigned char *buf = malloc(MAX_SIZE + MESSAGES);
+	for (int i = 0; i < MESSAGES; i++)
+	{
+		size_t len = message(i, buf);
+		// 协商了压缩时也穿插不压缩的消息，压缩流不受影响。
+		if (dc->response_headers && i % 5 != 4)
+			wstest_write_frame(conn, 0x40 | OP_CODE_TYPE_BINARY, zbuf, compress_message(zs, buf, len, zbuf, 2 * MAX_SIZE));
+		else
+			wstest_write_frame(conn, OP_CODE_TYPE_BINARY, buf, len);
+	}
+	free(buf);
+}
+
+static void send_bomb(wstest_conn *conn, z_stream *zs)
+{
+	unsigned char *buf = calloc(1, BOMB_SIZE);
+	size_t n = compress_message(zs, buf, BOMB_SIZE, zbuf, 2 * MAX_SIZE);
+	WSTEST_CHECK(n < BOMB_LIMIT, "bomb compressed to %zu bytes", n);
+	wstest_write_frame(conn, 0x40 | OP_CODE_TYPE_BINARY, zbuf, n);
+	free(buf);
+}
+
+// 发完消息后读客户端的消息，压缩的先解压再比较，直到 close 帧。
+static void run_server(wstest_conn *conn, void *arg)
+{
+	deflate_case *dc = arg;
+	WSTEST_CHECK(strstr(conn->request, "Sec-WebSocket-Extensions: permessage-deflate"), "%s: no extension offer in request:\n%s", dc->name,
+				 conn->request);
+	z_stream tx = {0}, rx = {0};
+	WSTEST_CHECK(deflateInit2(&tx, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK && inflateInit2(&rx, -15) == Z_OK,
+				 "zlib init failed");
+	if (dc->bomb)
+		send_bomb(conn, &tx);
+	else
+		send_messages(conn, dc, &tx);
+
+	wstest_frame f = {0};
+	unsigned char *expected = malloc(MAX_SIZE + MESSAGES);
+	while (wstest_read_frame(conn, &f) == 0)
+	{
+		if (f.opcode == OP_CODE_CONTROL_CLOSE)
+		{
+			WSTEST_CHECK(f.len >= 2, "close frame without status code");
+			__atomic_store_n(&dc->close_code, f.payload[0] << 8 | f.payload[1], __ATOMIC_SEQ_CST);
+			break;
+		}
+		int i = dc->server_received;
+		WSTEST_CHECK(f.opcode == OP_CODE_TYPE_BINARY && f.fin, "%s: unexpected frame: opcode %d", dc->name, f.opcode);
+		WSTEST_CHECK(f.rsv1 == (dc->response_headers && sizes[i % 4] >= DEFLATE_THRESHOLD), "%s: message %d rsv1 %d", dc->name, i, f.rsv1);
+		size_t len = message(i, expected);
+		unsigned char *data = f.payload;
+		unsigned long long n = f.len;
+		if (f.rsv1)
+		{
+			WSTEST_CHECK(f.len < len, "%s: message %d compressed to %llu of %zu bytes", dc->name, i, f.len, len);
+			n = inflate_message(&rx, f.payload, f.len, zbuf, 2 * MAX_SIZE);
+			data = zbuf;
+			dc->server_compressed++;
+		}
+		WSTEST_CHECK(n == len && memcmp(data, expected, len) == 0, "%s: message %d differs", dc->name, i);
+		__atomic_store_n(&dc->server_received, i + 1, __ATOMIC_SEQ_CST);
+	}
+	free(f.payload);
+	free(expected);
+	deflateEnd(&tx);
+	inflateEnd(&rx);
+}
+
+static int onopen(wsclient *c)
+{
+	(void)c;
+	opened = true;
+	return 0;
+}
+
+static int onmessage(wsclient *c, bool isText, unsigned long long len, unsigned char *data)
+{
+	(void)c;
+	(void)isText;
+	unsigned char *expected = malloc(MAX_SIZE + MESSAGES);
+	size_t n = message(messages, expected);
+	WSTEST_CHECK(len == n && memcmp(data, expected, n) == 0, "message %d differs", messages);
+	free(expected);
+	__atomic_add_fetch(&messages, 1, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+static int onerror(wsclient *c, int code, char *msg)
+{
+	(void)c;
+	if (strstr(msg, "exceeds size limit"))
+	{
+		limit_error = true;
+		return 0;
+	}
+	WSTEST_CHECK(!code || closing || limit_error, "onerror (%d): %s", code, msg);
+	return 0;
+}
+
+static void run(deflate_case *dc)
+{
+	wstest_server srv = {0};
+	srv.response_headers = dc->response_headers;
+	wstest_server_start(&srv, false, run_server, dc);
+	messages = 0;
+	opened = false;
+	closing = false;
+	limit_error = false;
+
+	wsclient_options opts;
+	libwsclient_options_init(&opts);
+	opts.permessage_deflate = true;
+	opts.fragment_size = 0;
+	if (dc->bomb)
+		opts.max_message_size = BOMB_LIMIT;
+	wsclient *c = libwsclient_new_with_options(srv.uri, &opts);
+	WSTEST_CHECK(c, "libwsclient_new_with_options failed");
+	c->onopen = onopen;
+	c->onmessage = onmessage;
+	c->onerror = onerror;
+	libwsclient_start_run(c);
+	WSTEST_WAIT(opened, 5);
+	WSTEST_CHECK(opened, "%s: not connected", srv.uri);
+
+	if (dc->bomb)
+	{
+		WSTEST_WAIT(__atomic_load_n(&dc->close_code, __ATOMIC_SEQ_CST), 5);
+		WSTEST_CHECK(dc->close_code == 1009, "%s: close code %d, expected 1009", dc->name, dc->close_code);
+		WSTEST_CHECK(limit_error, "%s: no size limit error", dc->name);
+		WSTEST_CHECK(messages == 0, "%s: %d messages delivered", dc->name, messages);
+	}
+	else
+	{
+		WSTEST_CHECK(c->deflate == (dc->response_headers != NULL), "%s: deflate %d after handshake", dc->name, c->deflate);
+		unsigned char *buf = malloc(MAX_SIZE + MESSAGES);
+		for (int i = 0; i < MESSAGES; i++)
+		{
+			size_t len = message(i, buf);
+			WSTEST_CHECK(libwsclient_send_data(c, OP_CODE_TYPE_BINARY, buf, len) == 0, "%s: send %d failed", dc->name, i);
+		}
+		free(buf);
+		WSTEST_WAIT(__atomic_load_n(&dc->server_received, __ATOMIC_SEQ_CST) == MESSAGES && __atomic_load_n(&messages, __ATOMIC_SEQ_CST) == MESSAGES, 10);
+		WSTEST_CHECK(__atomic_load_n(&messages, __ATOMIC_SEQ_CST) == MESSAGES, "%s: received %d of %d messages", dc->name, messages, MESSAGES);
+		WSTEST_CHECK(__atomic_load_n(&dc->server_received, __ATOMIC_SEQ_CST) == MESSAGES, "%s: server received %d of %d messages", dc->name,
+					 dc->server_received, MESSAGES);
+	}
+	closing = true;
+	libwsclient_close(c);
+	wstest_server_stop(&srv);
+	if (dc->bomb)
+		printf("%s: closed with %d\n", dc->name, dc->close_code);
+	else
+		printf("%s: %d messages each way, %d sent compressed by the client\n", dc->name, MESSAGES, dc->server_compressed);
+}
+
+int main(void)
+{
+	zbuf = malloc(2 * MAX_SIZE);
+	deflate_case cases[] = {
+		{"accepted", "Sec-WebSocket-Extensions: permessage-deflate\r\n", false, 0, 0, 0},
+		{"declined", NULL, false, 0, 0, 0},
+		{"bomb", "Sec-WebSocket-Extensions: permessage-deflate\r\n", true, 0, 0, 0},
+	};
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+		run(&cases[i]);
+	free(zbuf);
+	printf("test_deflate: ok\n");
+	return 0;
+}
@@ -0,0 +1,171 @@
+// 接收大小限制 (max_frame_size / max_message_size): 不超过限制的消息照常收到；
+// 超过时客户端发出 1009 close 帧并回调 onerror。onfragment 流式接收的消息不受 max_message_size 限制。
+#include "wstest.h"
+
+#define LIMIT 1000
+
+typedef struct
+{
+	const char *name;
+	unsigned long long max_frame_size;
+	unsigned long long max_message_size;
+	bool stream;					// 设置 onfragment
+	void (*script)(wstest_conn *conn);
+	int expected_messages;			// 客户端应收到的完整消息数
+	bool expect_1009;
+	int close_code;					// 服务端收到的 close 帧的状态码
+} limit_case;
+
+static unsigned char payload[6 * LIMIT];
+static int messages;
+static unsigned long long streamed;
+static bool stream_done;
+static volatile bool opened;
+static volatile bool closing;
+static volatile bool limit_error;
+
+static void send_fragments(wstest_conn *conn, int count, size_t size)
+{
+	for (int i = 0; i < count; i++)
+		wstest_write_fragment(conn, i == count - 1, i == 0 ? OP_CODE_TYPE_BINARY : OP_CODE_CONTINUE, payload + i * size, size);
+}
+
+// 单帧正好 LIMIT 字节可以收，LIMIT + 1 字节的帧超出。
+static void frame_script(wstest_conn *conn)
+{
+	wstest_write_frame(conn, OP_CODE_TYPE_BINARY, payload, LIMIT);
+	wstest_write_frame(conn, OP_CODE_TYPE_BINARY, payload, LIMIT + 1);
+}
+
+// 3 片共 3 * LIMIT 字节正好不超出，之后 4 片的消息在第 4 片超出。
+static void message_script(wstest_conn *conn)
+{
+	send_fragments(conn, 3, LIMIT);
+	send_fragments(conn, 4, LIMIT);
+}
+
+// 流式接收 6 * LIMIT 字节的消息，不受限制。
+static void stream_script(wstest_conn *conn)
+{
+	send_fragments(conn, 6, LIMIT);
+}
+
+static void run_script(wstest_conn *conn, void *arg)
+{
+	limit_case *lc = arg;
+	lc->script(conn);
+	wstest_frame f = {0};
+	while (wstest_read_frame(conn, &f) == 0)
+	{
+		if (f.opcode == OP_CODE_CONTROL_CLOSE)
+		{
+			WSTEST_CHECK(f.len >= 2, "close frame without status code");
+			__atomic_store_n(&lc->close_code, f.payload[0] << 8 | f.payload[1], __ATOMIC_SEQ_CST);
+			break;
+		}
+	}
+	free(f.payload);
+}
+
+static int onopen(wsclient *c)
+{
+	(void)c;
+	opened = true;
+	return 0;
+}
+
+static int onmessage(wsclient *c, bool isText, unsigned long long len, unsigned char *data)
+{
+	(void)c;
+	(void)isText;
+	WSTEST_CHECK(len <= sizeof(payload) && memcmp(data, payload, len) == 0, "message %d differs", messages);
+	__atomic_add_fetch(&messages, 1, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+static int onfragment(wsclient *c, int opcode, bool is_first, bool is_final, unsigned char *data, unsigned long long len)
+{
+	(void)c;
+	(void)opcode;
+	(void)is_first;
+	WSTEST_CHECK(streamed + len <= sizeof(payload) && memcmp(data, payload + streamed, len) == 0, "fragment at %llu differs", streamed);
+	streamed += len;
+	if (is_final)
+		__atomic_store_n(&stream_done, true, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+static int onerror(wsclient *c, int code, char *msg)
+{
+	(void)c;
+	if (strstr(msg, "exceeds size limit"))
+	{
+		limit_error = true;
+		return 0;
+	}
+	WSTEST_CHECK(!code || closing || limit_error, "onerror (%d): %s", code, msg);
+	return 0;
+}
+
+static void run(limit_case *lc)
+{
+	wstest_server srv = {0};
+	wstest_server_start(&srv, false, run_script, lc);
+	messages = 0;
+	streamed = 0;
+	stream_done = false;
+	opened = false;
+	closing = false;
+	limit_error = false;
+
+	wsclient_options opts;
+	libwsclient_options_init(&opts);
+	opts.max_frame_size = lc->max_frame_size;
+	opts.max_message_size = lc->max_message_size;
+	wsclient *c = libwsclient_new_with_options(srv.uri, &opts);
+	WSTEST_CHECK(c, "libwsclient_new_with_options failed");
+	c->onopen = onopen;
+	c->onmessage = onmessage;
+	if (lc->stream)
+		c->onfragment = onfragment;
+	c->onerror = onerror;
+	libwsclient_start_run(c);
+	WSTEST_WAIT(opened, 5);
+	WSTEST_CHECK(opened, "%s: not connected", srv.uri);
+
+	if (lc->expect_1009)
+	{
+		WSTEST_WAIT(__atomic_load_n(&lc->close_code, __ATOMIC_SEQ_CST), 5);
+		WSTEST_CHECK(lc->close_code == 1009, "%s: close code %d, expected 1009", lc->name, lc->close_code);
+		WSTEST_CHECK(limit_error, "%s: no size limit error", lc->name);
+	}
+	else
+	{
+		WSTEST_WAIT(__atomic_load_n(&stream_done, __ATOMIC_SEQ_CST), 5);
+		WSTEST_CHECK(stream_done && streamed == 6 * LIMIT, "%s: streamed %llu bytes", lc->name, streamed);
+		WSTEST_CHECK(!limit_error, "%s: unexpected size limit error", lc->name);
+	}
+	WSTEST_CHECK(__atomic_load_n(&messages, __ATOMIC_SEQ_CST) == lc->expected_messages, "%s: %d messages, expected %d", lc->name, messages,
+				 lc->expected_messages);
+	closing = true;
+	libwsclient_close(c);
+	wstest_server_stop(&srv);
+	if (!lc->expect_1009)
+		WSTEST_CHECK(lc->close_code && lc->close_code != 1009, "%s: close code %d", lc->name, lc->close_code);
+	printf("%s: ok\n", lc->name);
+}
+
+int main(void)
+{
+	for (size_t i = 0; i < sizeof(payload); i++)
+		payload[i] = (unsigned char)(i * 11 + 3);
+	limit_case cases[] = {
+		{"max_frame_size", LIMIT, 0, false, frame_script, 1, true, 0},
+		{"max_message_size", 0, 3 * LIMIT, false, message_script, 1, true, 0},
+		{"onfragment", LIMIT, 3 * LIMIT, true, stream_script, 0, false, 0},
+	};
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+		run(&cases[i]);
+	printf("test_limits: ok\n");
+	return 0;
+}
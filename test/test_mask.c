@@ -0,0 +1,110 @@
+// payload mask 的各个实现 (64 位标量、SSE2、AVX2 和按 CPU 选择的 libwsclient_mask) 与逐字节的参考实现比较:
+// src / dst 各种不对齐的起始地址、奇数长度、不同的起始 offset、原地 mask、分段连续 mask，并检查没有写出 dst 的范围。
+// 直接包含 mask.c 以便测试其中的 static 函数。
+#include "wstest.h"
+#include "../mask.c"
+
+#define MAX_MISALIGN 34			// 覆盖 AVX2 的 32 字节对齐的所有情况
+#define MAX_LEN 300
+#define GUARD 64
+
+typedef size_t (*mask_fn)(unsigned char *dst, const unsigned char *src, size_t len, const unsigned char key[4], size_t offset);
+
+static const unsigned char key[4] = {0x3c, 0xa5, 0x0f, 0x96};
+
+static size_t reference_mask(unsigned char *dst, const unsigned char *src, size_t len, size_t offset)
+{
+	for (size_t i = 0; i < len; i++)
+		dst[i] = src[i] ^ key[(offset + i) % 4];
+	return offset + len;
+}
+
+static void check_unaligned(const char *name, mask_fn fn)
+{
+	static unsigned char src[MAX_MISALIGN + MAX_LEN], buf[GUARD + MAX_MISALIGN + MAX_LEN + GUARD], ref[MAX_LEN];
+	size_t lengths[MAX_LEN / 2 + 6], nlengths = 0;
+	for (size_t len = 0; len <= 130; len++)
+		lengths[nlengths++] = len;
+	size_t more[] = {191, 255, 256, 257, 299};
+	for (size_t i = 0; i < sizeof(more) / sizeof(more[0]); i++)
+		lengths[nlengths++] = more[i];
+	for (size_t i = 0; i < sizeof(src); i++)
+		src[i] = (unsigned char)(i * 7 + 1);
+
+	for (size_t so = 0; so < MAX_MISALIGN; so++)
+	{
+		for (size_t dof = 0; dof < MAX_MISALIGN; dof++)
+		{
+			for (size_t k = 0; k < nlengths; k++)
+			{
+				size_t len = lengths[k], offset = (so + dof + len) % 8; // offset 大于 3 时只用低两位
+				unsigned char *dst = buf + GUARD + dof;
+				memset(buf, 0xee, sizeof(buf));
+				reference_mask(ref, src + so, len, offset);
+				size_t next = fn(dst, src + so, len, key, offset);
+				WSTEST_CHECK(next == offset + len, "%s: returned offset %zu, expected %zu", name, next, offset + len);
+				WSTEST_CHECK(memcmp(dst, ref, len) == 0, "%s: src +%zu dst +%zu len %zu offset %zu differs", name, so, dof, len, offset);
+				for (size_t i = 0; i < GUARD + dof; i++)
+					WSTEST_CHECK(buf[i] == 0xee, "%s: wrote before dst (dst +%zu len %zu)", name, dof, len);
+				for (size_t i = GUARD + dof + len; i < sizeof(buf); i++)
+					WSTEST_CHECK(buf[i] == 0xee, "%s: wrote past dst (dst +%zu len %zu)", name, dof, len);
+
+				// 原地 mask
+				memcpy(dst, src + so, len);
+				fn(dst, dst, len, key, offset);
+				WSTEST_CHECK(memcmp(dst, ref, len) == 0, "%s: in place dst +%zu len %zu offset %zu differs", name, dof, len, offset);
+			}
+		}
+	}
+}
+
+// 一帧的 payload 分成任意长度的几段 mask，offset 接着上一段的返回值。
+static void check_chunked(const char *name, mask_fn fn)
+{
+	enum { LEN = 10007 };
+	static unsigned char src[LEN], dst[LEN + 1], ref[LEN];
+	for (size_t i = 0; i < LEN; i++)
+		src[i] = (unsigned char)(i * 13 + (i >> 8));
+	reference_mask(ref, src, LEN, 0);
+	unsigned int seed = 1;
+	for (int round = 0; round < 200; round++)
+	{
+		unsigned char *out = dst + (round & 1); // dst 与 src 的对齐方式不同
+		size_t pos = 0, offset = 0;
+		while (pos < LEN)
+		{
+			size_t n = rand_r(&seed) % (round < 100 ? 70 : 2000) + 1;
+			if (n > LEN - pos)
+				n = LEN - pos;
+			offset = fn(out + pos, src + pos, n, key, offset);
+			pos += n;
+		}
+		WSTEST_CHECK(offset == LEN, "%s: chunked offset %zu", name, offset);
+		WSTEST_CHECK(memcmp(out, ref, LEN) == 0, "%s: chunked round %d differs", name, round);
+	}
+}
+
+static void check(const char *name, mask_fn fn)
+{
+	check_unaligned(name, fn);
+	check_chunked(name, fn);
+	printf("%s: ok\n", name);
+}
+
+int main(void)
+{
+	check("scalar", _mask_scalar);
+#ifdef LIBWSCLIENT_MASK_X86
+	if (__builtin_cpu_supports("sse2"))
+		check("sse2", _mask_sse2);
+	else
+		printf("sse2: not supported by this cpu, skipped\n");
+	if (__builtin_cpu_supports("avx2"))
+		check("avx2", _mask_avx2);
+	else
+		printf("avx2: not supported by this cpu, skipped\n");
+#endif
+	check("libwsclient_mask", libwsclient_mask);
+	printf("test_mask: ok\n");
+	return 0;
+}
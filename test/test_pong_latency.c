@@ -0,0 +1,143 @@
+// 大消息上传时 ping / pong 不被堵在后面: 本地服务端限速读取一条分片的大消息，同时定时发 ping，
+// 检查上传过程中 pong 陆续到达，而且每个 pong 的延迟都低于 LATENCY_LIMIT。
+// 同步发送、异步发送和 wss:// 各测一遍。
+#include "wstest.h"
+
+#define UPLOAD_SIZE (48 << 20)
+#define FRAGMENT_SIZE (16 << 10)
+#define READ_RATE 32e6			// 服务端读取速度 (字节/秒)，上传约需 1.5 秒
+#define PING_INTERVAL 25000		// 微秒
+#define LATENCY_LIMIT 0.5		// 秒，主要是限速下内核 socket 缓冲区里排在 pong 前面的数据
+#define MIN_PONGS_DURING 10		// 上传过程中至少收到的 pong 数
+
+typedef struct
+{
+	wstest_conn *conn;
+	volatile bool upload_done;
+	int pings;
+	int pongs;
+	int pongs_during;			// 上传结束前收到的 pong
+	double max_latency;
+	unsigned long long received;
+} upload_stat;
+
+static volatile bool opened;
+static volatile bool closing;
+
+static void *pinger(void *arg)
+{
+	upload_stat *st = arg;
+	while (!st->upload_done)
+	{
+		double t = wstest_now();
+		if (wstest_write_frame(st->conn, OP_CODE_CONTROL_PING, &t, sizeof(t)) < 0)
+			break;
+		st->pings++;
+		usleep(PING_INTERVAL);
+	}
+	return NULL;
+}
+
+// 按 READ_RATE 读取上传的消息，记录 pong 的延迟。
+static void throttled_reader(wstest_conn *conn, void *arg)
+{
+	upload_stat *st = arg;
+	st->conn = conn;
+	pthread_t th;
+	WSTEST_CHECK(pthread_create(&th, NULL, pinger, st) == 0, "pthread_create failed");
+	wstest_frame f = {0};
+	double t0 = wstest_now();
+	while (wstest_read_frame(conn, &f) == 0 && f.opcode != OP_CODE_CONTROL_CLOSE)
+	{
+		if (f.opcode == OP_CODE_CONTROL_PONG)
+		{
+			double sent;
+			WSTEST_CHECK(f.len == sizeof(sent), "pong payload of %llu bytes", f.len);
+			memcpy(&sent, f.payload, sizeof(sent));
+			double latency = wstest_now() - sent;
+			if (latency > st->max_latency)
+				st->max_latency = latency;
+			st->pongs++;
+			if (!st->upload_done)
+				st->pongs_during++;
+			continue;
+		}
+		WSTEST_CHECK(f.opcode == (st->received ? OP_CODE_CONTINUE : OP_CODE_TYPE_BINARY), "unexpected opcode %d", f.opcode);
+		st->received += f.len;
+		if (f.fin)
+		{
+			WSTEST_CHECK(st->received == UPLOAD_SIZE, "received %llu bytes", st->received);
+			st->upload_done = true;
+		}
+		double wait = t0 + st->received / READ_RATE - wstest_now();
+		if (wait > 0)
+			usleep(wait * 1e6);
+	}
+	st->upload_done = true;
+	pthread_join(th, NULL);
+	free(f.payload);
+}
+
+static int onopen(wsclient *c)
+{
+	(void)c;
+	opened = true;
+	return 0;
+}
+
+static int onerror(wsclient *c, int code, char *msg)
+{
+	(void)c;
+	WSTEST_CHECK(!code || closing, "onerror (%d): %s", code, msg);
+	return 0;
+}
+
+static void run(bool tls, bool async_send, unsigned char *payload)
+{
+	upload_stat st = {0};
+	wstest_server srv = {0};
+	wstest_server_start(&srv, tls, throttled_reader, &st);
+	opened = false;
+	closing = false;
+
+	wsclient_options opts;
+	libwsclient_options_init(&opts);
+	opts.fragment_size = FRAGMENT_SIZE;
+	opts.async_send = async_send;
+	opts.send_queue_high_water = 0;
+	wsclient *c = libwsclient_new_with_options(srv.uri, &opts);
+	WSTEST_CHECK(c, "libwsclient_new_with_options failed");
+	c->onopen = onopen;
+	c->onerror = onerror;
+	libwsclient_start_run(c);
+	WSTEST_WAIT(opened, 5);
+	WSTEST_CHECK(opened, "%s: not connected", srv.uri);
+
+	double t0 = wstest_now();
+	WSTEST_CHECK(libwsclient_send_data(c, OP_CODE_TYPE_BINARY, payload, UPLOAD_SIZE) == 0, "send failed");
+	WSTEST_WAIT(st.upload_done, 30);
+	WSTEST_CHECK(st.upload_done, "upload did not finish");
+	double elapsed = wstest_now() - t0;
+	// 让最后几个 ping 的 pong 到达。
+	usleep(100000);
+	closing = true;
+	libwsclient_close(c);
+	wstest_server_stop(&srv);
+
+	printf("%s %s: %.2f s upload, %d pings, %d pongs (%d during upload), max latency %.1f ms\n", srv.uri, async_send ? "async" : "sync",
+		   elapsed, st.pings, st.pongs, st.pongs_during, st.max_latency * 1000);
+	WSTEST_CHECK(st.pongs_during >= MIN_PONGS_DURING, "only %d pongs arrived during the upload", st.pongs_during);
+	WSTEST_CHECK(st.max_latency < LATENCY_LIMIT, "pong latency %.1f ms", st.max_latency * 1000);
+}
+
+int main(void)
+{
+	unsigned char *payload = malloc(UPLOAD_SIZE);
+	memset(payload, 'x', UPLOAD_SIZE);
+	run(false, false, payload);
+	run(false, true, payload);
+	run(true, false, payload);
+	free(payload);
+	printf("test_pong_latency: ok\n");
+	return 0;
+}
@@ -0,0 +1,149 @@
+// libwsclient_send_file 按 send_buf 大小一块一块分片发送，不把文件整块编码进内存:
+// 比 send_buf 大得多的文件在异步发送 (队列上限很小，要等 ondrain) 和同步发送模式下发给本地服务端，
+// 检查服务端收到的内容与文件一致、每个分片不超过 send_buf_size。普通文件 (mmap) 和管道各测一遍。
+#include <fcntl.h>
+#include <sys/wait.h>
+#include "wstest.h"
+
+#define FILE_SIZE (3 * 1000 * 1000 + 1)
+#define SEND_BUF (64 * 1024)
+#define MAX_MESSAGES 8
+
+typedef struct
+{
+	unsigned char *data;
+	unsigned long long len;
+} message;
+
+static message messages[MAX_MESSAGES];
+static int received;				// 服务端收到的完整消息数
+static unsigned long long max_frame;	// 服务端收到的最大分片
+static volatile bool opened;
+static volatile bool closing;
+
+static void collect_messages(wstest_conn *conn, void *arg)
+{
+	(void)arg;
+	wstest_frame f = {0};
+	message m = {0};
+	while (wstest_read_frame(conn, &f) == 0 && f.opcode != OP_CODE_CONTROL_CLOSE)
+	{
+		WSTEST_CHECK(f.opcode == (m.data ? OP_CODE_CONTINUE : OP_CODE_TYPE_BINARY), "unexpected opcode %d", f.opcode);
+		if (f.len > max_frame)
+			max_frame = f.len;
+		m.data = realloc(m.data, m.len + f.len + 1);
+		memcpy(m.data + m.len, f.payload, f.len);
+		m.len += f.len;
+		if (!f.fin)
+			continue;
+		int n = __atomic_load_n(&received, __ATOMIC_SEQ_CST);
+		WSTEST_CHECK(n < MAX_MESSAGES, "too many messages");
+		messages[n] = m;
+		m = (message){0};
+		__atomic_store_n(&received, n + 1, __ATOMIC_SEQ_CST);
+	}
+	free(m.data);
+	free(f.payload);
+}
+
+static int onopen(wsclient *c)
+{
+	(void)c;
+	opened = true;
+	return 0;
+}
+
+static int onerror(wsclient *c, int code, char *msg)
+{
+	(void)c;
+	WSTEST_CHECK(!code || closing, "onerror (%d): %s", code, msg);
+	return 0;
+}
+
+static void expect_message(int n, const unsigned char *data, unsigned long long len)
+{
+	WSTEST_WAIT(__atomic_load_n(&received, __ATOMIC_SEQ_CST) > n, 10);
+	WSTEST_CHECK(__atomic_load_n(&received, __ATOMIC_SEQ_CST) > n, "message %d not received", n);
+	WSTEST_CHECK(messages[n].len == len, "message %d: %llu bytes, expected %llu", n, messages[n].len, len);
+	WSTEST_CHECK(memcmp(messages[n].data, data, len) == 0, "message %d differs", n);
+	free(messages[n].data);
+}
+
+static void run(bool async_send, int fd, const unsigned char *content)
+{
+	wstest_server srv = {0};
+	wstest_server_start(&srv, false, collect_messages, NULL);
+	received = 0;
+	max_frame = 0;
+	opened = false;
+	closing = false;
+
+	wsclient_options opts;
+	libwsclient_options_init(&opts);
+	opts.fragment_size = 0; // 每次 append 一帧
+	opts.send_buf_size = SEND_BUF;
+	opts.async_send = async_send;
+	opts.send_queue_high_water = 2 * SEND_BUF;
+	wsclient *c = libwsclient_new_with_options(srv.uri, &opts);
+	WSTEST_CHECK(c, "libwsclient_new_with_options failed");
+	c->onopen = onopen;
+	c->onerror = onerror;
+	libwsclient_start_run(c);
+	WSTEST_WAIT(opened, 5);
+	WSTEST_CHECK(opened, "%s: not connected", srv.uri);
+
+	int n = 0;
+	WSTEST_CHECK(libwsclient_send_file(c, fd, 0, 0) == 0, "send whole file failed");
+	expect_message(n++, content, FILE_SIZE);
+	WSTEST_CHECK(libwsclient_send_file(c, fd, 12345, 1000000) == 0, "send file range failed");
+	expect_message(n++, content + 12345, 1000000);
+	WSTEST_CHECK(libwsclient_send_file(c, fd, FILE_SIZE, 0) == 0, "send empty range failed");
+	expect_message(n++, content, 0);
+
+	// 管道: 子进程写入整个文件内容
+	int p[2];
+	WSTEST_CHECK(pipe(p) == 0, "pipe failed");
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		close(p[0]);
+		for (size_t off = 0; off < FILE_SIZE;)
+		{
+			ssize_t w = write(p[1], content + off, FILE_SIZE - off);
+			if (w <= 0)
+				_exit(1);
+			off += w;
+		}
+		_exit(0);
+	}
+	close(p[1]);
+	WSTEST_CHECK(libwsclient_send_file(c, p[0], 0, 0) == 0, "send pipe failed");
+	close(p[0]);
+	waitpid(pid, NULL, 0);
+	expect_message(n++, content, FILE_SIZE);
+
+	printf("%s %s: %d files, largest frame %llu bytes\n", srv.uri, async_send ? "async" : "sync", n, max_frame);
+	WSTEST_CHECK(max_frame <= SEND_BUF, "frame of %llu bytes, larger than send_buf_size", max_frame);
+	closing = true;
+	libwsclient_close(c);
+	wstest_server_stop(&srv);
+}
+
+int main(void)
+{
+	unsigned char *content = malloc(FILE_SIZE);
+	for (size_t i = 0; i < FILE_SIZE; i++)
+		content[i] = (unsigned char)(i * 13 ^ i >> 9);
+	char path[] = "/tmp/test_send_file.XXXXXX";
+	int fd = mkstemp(path);
+	WSTEST_CHECK(fd >= 0, "mkstemp failed");
+	unlink(path);
+	WSTEST_CHECK(write(fd, content, FILE_SIZE) == FILE_SIZE, "write failed");
+
+	run(true, fd, content);
+	run(false, fd, content);
+	close(fd);
+	free(content);
+	printf("test_send_file: ok\n");
+	return 0;
+}
@@ -0,0 +1,133 @@
+// 流式发送 (libwsclient_send_begin / append / end) 期间其他线程不断发送完整消息:
+// 完整消息要么在流式消息之前写出，要么被拒绝，服务端不能在流式消息的分片之间收到别的数据帧。同步和异步发送模式各测一遍。
+#include "wstest.h"
+
+#define SENDERS 3
+#define STREAMS 300
+#define PARTS 4
+#define PART_SIZE 1000
+
+static wsclient *client;
+static int streams_received;		// 服务端收到的流式消息数
+static int messages_received;		// 服务端收到的完整消息数
+static volatile bool opened;
+static volatile bool closing;
+static volatile bool stop;
+
+static void fill(unsigned char *buf, size_t len, int a)
+{
+	for (size_t i = 0; i < len; i++)
+		buf[i] = (unsigned char)(a * 31 + i);
+}
+
+// 流式消息的第一片是 BINARY，完整消息是 TEXT，中间出现 TEXT 帧即为交错。
+static void check_frames(wstest_conn *conn, void *arg)
+{
+	(void)arg;
+	wstest_frame f = {0};
+	unsigned char expected[PART_SIZE];
+	int part = -1;						// 流式消息中收到的分片序号，-1 表示不在流式消息中
+	while (wstest_read_frame(conn, &f) == 0 && f.opcode != OP_CODE_CONTROL_CLOSE)
+	{
+		if (f.opcode == OP_CODE_TYPE_TEXT)
+		{
+			WSTEST_CHECK(part < 0, "text message inside stream %d (after part %d)", streams_received, part);
+			WSTEST_CHECK(f.fin, "fragmented text message");
+			messages_received++;
+			continue;
+		}
+		WSTEST_CHECK(f.opcode == (part < 0 ? OP_CODE_TYPE_BINARY : OP_CODE_CONTINUE), "unexpected opcode %d at part %d", f.opcode, part);
+		part++;
+		if (part < PARTS)
+		{
+			fill(expected, sizeof(expected), streams_received * PARTS + part);
+			WSTEST_CHECK(!f.fin && f.len == PART_SIZE && memcmp(f.payload, expected, PART_SIZE) == 0, "stream %d part %d differs", streams_received, part);
+			continue;
+		}
+		WSTEST_CHECK(f.fin && f.len == 0, "stream %d not ended", streams_received);
+		part = -1;
+		__atomic_store_n(&streams_received, streams_received + 1, __ATOMIC_SEQ_CST);
+	}
+	free(f.payload);
+}
+
+static void *sender(void *arg)
+{
+	(void)arg;
+	while (!stop)
+		libwsclient_send_string(client, "hello"); // 流式消息进行中时被拒绝
+	return NULL;
+}
+
+static int onopen(wsclient *c)
+{
+	(void)c;
+	opened = true;
+	return 0;
+}
+
+static int onerror(wsclient *c, int code, char *msg)
+{
+	(void)c;
+	WSTEST_CHECK(!code || closing || strstr(msg, "message stream is active"), "onerror (%d): %s", code, msg);
+	return 0;
+}
+
+static void run(bool async_send)
+{
+	wstest_server srv = {0};
+	wstest_server_start(&srv, false, check_frames, NULL);
+	streams_received = 0;
+	messages_received = 0;
+	opened = false;
+	closing = false;
+	stop = false;
+
+	wsclient_options opts;
+	libwsclient_options_init(&opts);
+	opts.async_send = async_send;
+	opts.send_queue_high_water = 0;
+	client = libwsclient_new_with_options(srv.uri, &opts);
+	WSTEST_CHECK(client, "libwsclient_new_with_options failed");
+	client->onopen = onopen;
+	client->onerror = onerror;
+	libwsclient_start_run(client);
+	WSTEST_WAIT(opened, 5);
+	WSTEST_CHECK(opened, "%s: not connected", srv.uri);
+
+	pthread_t th[SENDERS];
+	for (int t = 0; t < SENDERS; t++)
+		WSTEST_CHECK(pthread_create(&th[t], NULL, sender, NULL) == 0, "pthread_create failed");
+	unsigned char part[PART_SIZE];
+	for (int s = 0; s < STREAMS; s++)
+	{
+		WSTEST_CHECK(libwsclient_send_begin(client, OP_CODE_TYPE_BINARY) == 0, "send_begin %d failed", s);
+		for (int i = 0; i < PARTS; i++)
+		{
+			fill(part, sizeof(part), s * PARTS + i);
+			WSTEST_CHECK(libwsclient_send_append(client, part, sizeof(part)) == 0, "send_append %d failed", s);
+		}
+		WSTEST_CHECK(libwsclient_send_end(client) == 0, "send_end %d failed", s);
+		usleep(200); // 让其他线程发出一些完整消息，下一个 begin 与它们竞争
+	}
+	stop = true;
+	for (int t = 0; t < SENDERS; t++)
+		pthread_join(th[t], NULL);
+	WSTEST_WAIT(__atomic_load_n(&streams_received, __ATOMIC_SEQ_CST) == STREAMS, 10);
+	WSTEST_CHECK(__atomic_load_n(&streams_received, __ATOMIC_SEQ_CST) == STREAMS, "server received %d of %d streams", streams_received, STREAMS);
+	printf("%s %s: %d streams, %d messages in between\n", srv.uri, async_send ? "async" : "sync", STREAMS, messages_received);
+	closing = true;
+	libwsclient_close(client);
+	wstest_server_stop(&srv);
+}
+
+int main(void)
+{
+	for (int i = 0; i < 3; i++)
+	{
+		run(false);
+		run(true);
+	}
+	printf("test_send_stream: ok\n");
+	return 0;
+}
@@ -0,0 +1,141 @@
+// wss:// 上多个线程同时发送，同时服务端不断发来数据 (中间几次要求 KeyUpdate):
+// run 线程的 SSL_read 与发送线程的 SSL_write 用的是同一个 SSL 对象，检查连接不会因此出错断开，两个方向的消息都完整无误。
+#include "wstest.h"
+
+#define SENDERS 4
+#define SEND_COUNT 2000				// 每个发送线程的消息数
+#define SEND_SIZE 200
+#define STREAM_COUNT 4000			// 服务端发来的消息数
+#define STREAM_SIZE 4096
+#define KEY_UPDATE_EVERY 500
+
+static wsclient *client;
+static int streamed;				// 客户端收到的服务端消息数，只由 run 线程写
+static int client_received[SENDERS];	// 服务端收到的各发送线程的消息数
+static volatile bool opened;
+static volatile bool closing;
+
+static void fill(unsigned char *buf, size_t len, int a, int b)
+{
+	for (size_t i = 0; i < len; i++)
+		buf[i] = (unsigned char)(a * 7 + b * 13 + i);
+}
+
+// 先发完 STREAM_COUNT 条消息 (期间客户端各线程也在发)，再读客户端的消息。
+static void stream_and_check(wstest_conn *conn, void *arg)
+{
+	(void)arg;
+	unsigned char buf[STREAM_SIZE];
+	for (int i = 0; i < STREAM_COUNT; i++)
+	{
+		if (i % KEY_UPDATE_EVERY == KEY_UPDATE_EVERY - 1)
+			WSTEST_CHECK(SSL_key_update(conn->ssl, SSL_KEY_UPDATE_REQUESTED) == 1, "SSL_key_update failed");
+		fill(buf, sizeof(buf), i, 0);
+		WSTEST_CHECK(wstest_write_frame(conn, OP_CODE_TYPE_BINARY, buf, sizeof(buf)) == 0, "server write failed at message %d", i);
+	}
+	wstest_frame f = {0};
+	unsigned char expected[SEND_SIZE];
+	while (wstest_read_frame(conn, &f) == 0 && f.opcode != OP_CODE_CONTROL_CLOSE)
+	{
+		WSTEST_CHECK(f.opcode == OP_CODE_TYPE_BINARY && f.fin && f.len == SEND_SIZE, "unexpected frame: opcode %d, %llu bytes", f.opcode, f.len);
+		int t = f.payload[0];
+		WSTEST_CHECK(t < SENDERS, "bad sender %d", t);
+		int seq = client_received[t];
+		fill(expected, sizeof(expected), t, seq);
+		expected[0] = t;
+		WSTEST_CHECK(memcmp(f.payload, expected, SEND_SIZE) == 0, "sender %d message %d differs", t, seq);
+		__atomic_store_n(&client_received[t], seq + 1, __ATOMIC_SEQ_CST);
+	}
+	free(f.payload);
+}
+
+static void *sender(void *arg)
+{
+	int t = (int)(intptr_t)arg;
+	unsigned char buf[SEND_SIZE];
+	for (int i = 0; i < SEND_COUNT; i++)
+	{
+		fill(buf, sizeof(buf), t, i);
+		buf[0] = t;
+		WSTEST_CHECK(libwsclient_send_data(client, OP_CODE_TYPE_BINARY, buf, sizeof(buf)) == 0, "sender %d: send %d failed", t, i);
+	}
+	return NULL;
+}
+
+static int onopen(wsclient *c)
+{
+	(void)c;
+	opened = true;
+	return 0;
+}
+
+static int onmessage(wsclient *c, bool isText, unsigned long long len, unsigned char *data)
+{
+	(void)c;
+	(void)isText;
+	unsigned char expected[STREAM_SIZE];
+	int n = streamed;
+	fill(expected, sizeof(expected), n, 0);
+	WSTEST_CHECK(len == STREAM_SIZE && memcmp(data, expected, len) == 0, "server message %d differs", n);
+	__atomic_store_n(&streamed, n + 1, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+static int onerror(wsclient *c, int code, char *msg)
+{
+	(void)c;
+	WSTEST_CHECK(!code || closing, "onerror (%d): %s", code, msg);
+	return 0;
+}
+
+static void run(bool async_send)
+{
+	wstest_server srv = {0};
+	wstest_server_start(&srv, true, stream_and_check, NULL);
+	streamed = 0;
+	memset(client_received, 0, sizeof(client_received));
+	opened = false;
+	closing = false;
+
+	wsclient_options opts;
+	libwsclient_options_init(&opts);
+	opts.async_send = async_send;
+	opts.send_queue_high_water = 0;
+	client = libwsclient_new_with_options(srv.uri, &opts);
+	WSTEST_CHECK(client, "libwsclient_new_with_options failed");
+	client->onopen = onopen;
+	client->onmessage = onmessage;
+	client->onerror = onerror;
+	libwsclient_start_run(client);
+	WSTEST_WAIT(opened, 5);
+	WSTEST_CHECK(opened, "%s: not connected", srv.uri);
+
+	pthread_t th[SENDERS];
+	for (int t = 0; t < SENDERS; t++)
+		WSTEST_CHECK(pthread_create(&th[t], NULL, sender, (void *)(intptr_t)t) == 0, "pthread_create failed");
+	for (int t = 0; t < SENDERS; t++)
+		pthread_join(th[t], NULL);
+	WSTEST_WAIT(__atomic_load_n(&streamed, __ATOMIC_SEQ_CST) == STREAM_COUNT, 20);
+	WSTEST_CHECK(__atomic_load_n(&streamed, __ATOMIC_SEQ_CST) == STREAM_COUNT, "client received %d of %d messages", streamed, STREAM_COUNT);
+	for (int t = 0; t < SENDERS; t++)
+	{
+		WSTEST_WAIT(__atomic_load_n(&client_received[t], __ATOMIC_SEQ_CST) == SEND_COUNT, 20);
+		WSTEST_CHECK(__atomic_load_n(&client_received[t], __ATOMIC_SEQ_CST) == SEND_COUNT, "server received %d of %d messages from sender %d",
+					 client_received[t], SEND_COUNT, t);
+	}
+	printf("%s %s: %d messages sent from %d threads, %d received\n", srv.uri, async_send ? "async" : "sync", SENDERS * SEND_COUNT, SENDERS, STREAM_COUNT);
+	closing = true;
+	libwsclient_close(client);
+	wstest_server_stop(&srv);
+}
+
+int main(void)
+{
+	for (int i = 0; i < 3; i++)
+	{
+		run(false);
+		run(true);
+	}
+	printf("test_tls_threads: ok\n");
+	return 0;
+}
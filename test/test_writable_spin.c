@@ -0,0 +1,138 @@
+// 非阻塞模式下 out_buf 有数据、socket 可写，而其他线程正持有写权限 (这里是在 onhighwater 回调中停留) 时，
+// loop 线程 (或 run 线程) 不能空转: 它应暂停等待可写，由持有写权限的线程解锁时交还。
+// 比较回调停留期间 loop / run 线程的 CPU 时间，并检查之后 out_buf 照常写出、服务端收到的数据完整。事件循环和 run 线程各测一遍。
+#include "wstest.h"
+
+#define MESSAGE_SIZE (16 << 20)
+#define STALL 0.5					// onhighwater 中停留的秒数
+
+static pthread_t writer_th;			// 发现 socket 可写时写出 out_buf 的线程
+static unsigned long long bytes_received;
+static volatile bool opened;
+static volatile bool closing;
+static volatile bool reading;
+static double stall_cpu;
+
+static void slow_reader(wstest_conn *conn, void *arg)
+{
+	(void)arg;
+	usleep(100 * 1000); // 先不读，客户端写满 socket 后积压到 out_buf
+	reading = true;
+	wstest_frame f = {0};
+	while (wstest_read_frame(conn, &f) == 0 && f.opcode != OP_CODE_CONTROL_CLOSE)
+	{
+		WSTEST_CHECK(f.opcode == OP_CODE_TYPE_BINARY && f.fin && f.len == MESSAGE_SIZE, "unexpected frame: opcode %d, %llu bytes", f.opcode, f.len);
+		for (unsigned long long i = 0; i < f.len; i++)
+			WSTEST_CHECK(f.payload[i] == (unsigned char)(i * 7), "byte %llu differs", i);
+		__atomic_add_fetch(&bytes_received, f.len, __ATOMIC_SEQ_CST);
+	}
+	free(f.payload);
+}
+
+static void *loop_thread(void *arg)
+{
+	libwsclient_loop_run(arg);
+	return NULL;
+}
+
+static double thread_cpu(pthread_t th)
+{
+	clockid_t id;
+	struct timespec ts;
+	WSTEST_CHECK(pthread_getcpuclockid(th, &id) == 0 && clock_gettime(id, &ts) == 0, "unable to read thread cpu time");
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int onopen(wsclient *c)
+{
+	(void)c;
+	opened = true;
+	return 0;
+}
+
+// 在发送线程中持有写权限时回调。服务端开始读之后 socket 可写，loop / run 线程拿不到写权限。
+static int onhighwater(wsclient *c, size_t buffered)
+{
+	(void)c;
+	(void)buffered;
+	if (stall_cpu >= 0 || pthread_equal(pthread_self(), writer_th))
+		return 0;
+	WSTEST_WAIT(reading, 5);
+	double cpu0 = thread_cpu(writer_th);
+	usleep(STALL * 1e6);
+	stall_cpu = thread_cpu(writer_th) - cpu0;
+	return 0;
+}
+
+static int onerror(wsclient *c, int code, char *msg)
+{
+	(void)c;
+	WSTEST_CHECK(!code || closing, "onerror (%d): %s", code, msg);
+	return 0;
+}
+
+static void run(bool use_loop)
+{
+	wstest_server srv = {0};
+	wstest_server_start(&srv, false, slow_reader, NULL);
+	bytes_received = 0;
+	opened = false;
+	closing = false;
+	reading = false;
+	stall_cpu = -1;
+	wsclient_loop *loop = NULL;
+	if (use_loop)
+	{
+		loop = libwsclient_loop_new();
+		WSTEST_CHECK(loop, "libwsclient_loop_new failed");
+		WSTEST_CHECK(pthread_create(&writer_th, NULL, loop_thread, loop) == 0, "pthread_create failed");
+	}
+
+	wsclient_options opts;
+	libwsclient_options_init(&opts);
+	opts.loop = loop;
+	opts.nonblocking = true;
+	opts.fragment_size = 0;
+	opts.write_high_water = 1 << 20;
+	opts.write_low_water = 0;
+	wsclient *c = libwsclient_new_with_options(srv.uri, &opts);
+	WSTEST_CHECK(c, "libwsclient_new_with_options failed");
+	c->onopen = onopen;
+	c->onhighwater = onhighwater;
+	c->onerror = onerror;
+	libwsclient_start_run(c);
+	WSTEST_WAIT(opened, 5);
+	WSTEST_CHECK(opened, "%s: not connected", srv.uri);
+	if (!use_loop)
+		writer_th = c->run_thread;
+
+	unsigned char *buf = malloc(MESSAGE_SIZE);
+	for (size_t i = 0; i < MESSAGE_SIZE; i++)
+		buf[i] = (unsigned char)(i * 7);
+	WSTEST_CHECK(libwsclient_send_data(c, OP_CODE_TYPE_BINARY, buf, MESSAGE_SIZE) == 0, "send failed");
+	WSTEST_CHECK(stall_cpu >= 0, "onhighwater not called");
+	WSTEST_WAIT(__atomic_load_n(&bytes_received, __ATOMIC_SEQ_CST) == MESSAGE_SIZE, 10);
+	WSTEST_CHECK(__atomic_load_n(&bytes_received, __ATOMIC_SEQ_CST) == MESSAGE_SIZE, "server received %llu bytes", bytes_received);
+	printf("%s %s: %s thread cpu %.3f s while the sender held the socket for %.1f s\n", srv.uri, use_loop ? "loop" : "run thread",
+		   use_loop ? "loop" : "run", stall_cpu, STALL);
+	WSTEST_CHECK(stall_cpu < STALL / 5, "%s thread spinning", use_loop ? "loop" : "run");
+
+	closing = true;
+	libwsclient_close(c);
+	wstest_server_stop(&srv);
+	if (use_loop)
+	{
+		libwsclient_loop_stop(loop);
+		pthread_join(writer_th, NULL);
+		libwsclient_loop_free(loop);
+	}
+	free(buf);
+}
+
+int main(void)
+{
+	run(true);
+	run(false);
+	printf("test_writable_spin: ok\n");
+	return 0;
+}
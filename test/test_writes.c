@@ -0,0 +1,115 @@
+// 每条消息 (包括分成多帧的消息) 只用一次 send 写出，TLS 时帧头和 payload 拼好后一次 SSL_write、一次 send:
+// 向本地服务端发送各种长度的消息，检查 stats.writes 每条只加 1，服务端收到的内容不变。ws:// 和 wss:// 各测一遍。
+#include "wstest.h"
+
+static const size_t lengths[] = {1, 125, 126, 1000, 1024, 1025, 4000, 16000};
+#define NLENGTHS (sizeof(lengths) / sizeof(lengths[0]))
+#define REPEAT 10
+#define FRAGMENT_SIZE 1024
+
+static int received;	// 服务端收到的完整消息数
+static volatile bool opened;
+static volatile bool closing;
+
+static unsigned char message_byte(int msg, size_t i)
+{
+	return (unsigned char)(msg * 31 + i);
+}
+
+// 逐条重组消息并检查内容。
+static void check_messages(wstest_conn *conn, void *arg)
+{
+	(void)arg;
+	wstest_frame f = {0};
+	unsigned char *msg = malloc(lengths[NLENGTHS - 1]);
+	size_t len = 0;
+	int n = 0;
+	while (wstest_read_frame(conn, &f) == 0 && f.opcode != OP_CODE_CONTROL_CLOSE)
+	{
+		WSTEST_CHECK(f.opcode == (len ? OP_CODE_CONTINUE : OP_CODE_TYPE_BINARY), "message %d: unexpected opcode %d", n, f.opcode);
+		WSTEST_CHECK(len + f.len <= lengths[NLENGTHS - 1], "message %d too long", n);
+		memcpy(msg + len, f.payload, f.len);
+		len += f.len;
+		if (!f.fin)
+			continue;
+		size_t expected = lengths[n / REPEAT];
+		WSTEST_CHECK(len == expected, "message %d: %zu bytes, expected %zu", n, len, expected);
+		for (size_t i = 0; i < len; i++)
+			WSTEST_CHECK(msg[i] == message_byte(n, i), "message %d: byte %zu differs", n, i);
+		len = 0;
+		__atomic_store_n(&received, ++n, __ATOMIC_SEQ_CST);
+	}
+	free(msg);
+	free(f.payload);
+}
+
+static int onopen(wsclient *c)
+{
+	(void)c;
+	opened = true;
+	return 0;
+}
+
+static int onerror(wsclient *c, int code, char *msg)
+{
+	(void)c;
+	WSTEST_CHECK(!code || closing, "onerror (%d): %s", code, msg);
+	return 0;
+}
+
+static void run(bool tls)
+{
+	wstest_server srv = {0};
+	wstest_server_start(&srv, tls, check_messages, NULL);
+	received = 0;
+	opened = false;
+	closing = false;
+
+	wsclient_options opts;
+	libwsclient_options_init(&opts);
+	opts.fragment_size = FRAGMENT_SIZE;
+	wsclient *c = libwsclient_new_with_options(srv.uri, &opts);
+	WSTEST_CHECK(c, "libwsclient_new_with_options failed");
+	c->onopen = onopen;
+	c->onerror = onerror;
+	libwsclient_start_run(c);
+	WSTEST_WAIT(opened, 5);
+	WSTEST_CHECK(opened, "%s: not connected", srv.uri);
+
+	unsigned char *payload = malloc(lengths[NLENGTHS - 1]);
+	int n = 0;
+	for (size_t k = 0; k < NLENGTHS; k++)
+	{
+		for (int r = 0; r < REPEAT; r++, n++)
+		{
+			for (size_t i = 0; i < lengths[k]; i++)
+				payload[i] = message_byte(n, i);
+			wsclient_stats before, after;
+			libwsclient_get_stats(c, &before);
+			WSTEST_CHECK(libwsclient_send_data(c, OP_CODE_TYPE_BINARY, payload, lengths[k]) == 0, "send failed");
+			libwsclient_get_stats(c, &after);
+			unsigned long long frames = (lengths[k] + FRAGMENT_SIZE - 1) / FRAGMENT_SIZE;
+			WSTEST_CHECK(after.writes - before.writes == 1, "%s: %zu byte message took %llu writes", srv.uri, lengths[k], after.writes - before.writes);
+			WSTEST_CHECK(after.frames_out - before.frames_out == frames, "%s: %zu byte message sent %llu frames, expected %llu",
+						 srv.uri, lengths[k], after.frames_out - before.frames_out, frames);
+		}
+	}
+	WSTEST_WAIT(__atomic_load_n(&received, __ATOMIC_SEQ_CST) == n, 5);
+	WSTEST_CHECK(__atomic_load_n(&received, __ATOMIC_SEQ_CST) == n, "server received %d of %d messages", received, n);
+
+	wsclient_stats st;
+	libwsclient_get_stats(c, &st);
+	printf("%s: %d messages, %llu frames, %llu writes\n", srv.uri, n, st.frames_out, st.writes);
+	closing = true;
+	libwsclient_close(c);
+	wstest_server_stop(&srv);
+	free(payload);
+}
+
+int main(void)
+{
+	run(false);
+	run(true);
+	printf("test_writes: ok\n");
+	return 0;
+}
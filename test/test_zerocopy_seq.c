@@ -0,0 +1,92 @@
+// MSG_ZEROCOPY 完成通知的序号区间与消息的序号区间求交 (libwsclient_zc_overlap):
+// 序号是 32 位、会回绕，消息或通知的区间跨过 0 时也要算对。
+// 再模拟一串跨过回绕点的消息，按任意合并、乱序的通知扣减，检查每条消息恰好在它的 sendmsg 全部完成时完成。
+#include "wstest.h"
+#include "../wsclient.h"
+
+#define MESSAGES 64
+#define MAX_SENDS 5
+
+static void check_overlap(unsigned int lo, unsigned int hi, unsigned int first, unsigned int last, unsigned int expected)
+{
+	unsigned int n = libwsclient_zc_overlap(lo, hi, first, last);
+	WSTEST_CHECK(n == expected, "[%#x, %#x] and [%#x, %#x]: %u, expected %u", lo, hi, first, last, n, expected);
+}
+
+// 一串消息的 sendmsg 序号从 start 开始连续编号，完成通知把 [0, total) 随机切成若干区间、打乱顺序后逐个扣减。
+static void check_sequence(unsigned int start, unsigned int *seed)
+{
+	unsigned int first[MESSAGES], last[MESSAGES], remaining[MESSAGES];
+	unsigned int seq = start;
+	for (int i = 0; i < MESSAGES; i++)
+	{
+		unsigned int sends = rand_r(seed) % MAX_SENDS + 1;
+		first[i] = seq;
+		last[i] = seq + sends - 1;
+		remaining[i] = sends;
+		seq += sends;
+	}
+	unsigned int total = seq - start;
+	unsigned int lo[MESSAGES * MAX_SENDS], hi[MESSAGES * MAX_SENDS];
+	int nnotes = 0;
+	for (unsigned int off = 0; off < total;)
+	{
+		unsigned int n = rand_r(seed) % 8 + 1;
+		if (n > total - off)
+			n = total - off;
+		lo[nnotes] = start + off;
+		hi[nnotes++] = start + off + n - 1;
+		off += n;
+	}
+	for (int i = nnotes - 1; i > 0; i--)
+	{
+		int j = rand_r(seed) % (i + 1);
+		unsigned int l = lo[i], h = hi[i];
+		lo[i] = lo[j];
+		hi[i] = hi[j];
+		lo[j] = l;
+		hi[j] = h;
+	}
+	for (int k = 0; k < nnotes; k++)
+	{
+		for (int i = 0; i < MESSAGES; i++)
+		{
+			unsigned int n = libwsclient_zc_overlap(lo[k], hi[k], first[i], last[i]);
+			WSTEST_CHECK(n <= remaining[i], "start %#x: message %d [%#x, %#x] over-completed by [%#x, %#x]", start, i, first[i], last[i], lo[k], hi[k]);
+			remaining[i] -= n;
+		}
+	}
+	for (int i = 0; i < MESSAGES; i++)
+		WSTEST_CHECK(remaining[i] == 0, "start %#x: message %d [%#x, %#x] has %u sends left", start, i, first[i], last[i], remaining[i]);
+}
+
+int main(void)
+{
+	// 不回绕
+	check_overlap(0, 9, 3, 5, 3);
+	check_overlap(4, 9, 3, 5, 2);
+	check_overlap(0, 3, 3, 5, 1);
+	check_overlap(6, 9, 3, 5, 0);
+	check_overlap(0, 2, 3, 5, 0);
+	// 消息跨过回绕点
+	check_overlap(0xfffffffe, 0xffffffff, 0xfffffffe, 1, 2);
+	check_overlap(0, 1, 0xfffffffe, 1, 2);
+	check_overlap(0xfffffff0, 5, 0xfffffffe, 1, 4);
+	check_overlap(2, 9, 0xfffffffe, 1, 0);
+	// 通知跨过回绕点
+	check_overlap(0xfffffffd, 2, 0xfffffffe, 0xffffffff, 2);
+	check_overlap(0xfffffffd, 2, 1, 4, 2);
+	check_overlap(0xfffffffd, 2, 3, 4, 0);
+	// 回绕后的序号在回绕前的之后
+	check_overlap(0, 5, 0xfffffff0, 0xfffffff5, 0);
+	check_overlap(0xfffffff0, 0xfffffff5, 0, 5, 0);
+	check_overlap(0x7ffffffe, 0x80000001, 0x7fffffff, 0x80000000, 2);
+
+	unsigned int seed = 1;
+	unsigned int starts[] = {0, 1000, 0xffffff00, 0xffffffff - 100, 0x7fffff80};
+	for (size_t s = 0; s < sizeof(starts) / sizeof(starts[0]); s++)
+		for (int round = 0; round < 200; round++)
+			check_sequence(starts[s], &seed);
+	printf("test_zerocopy_seq: ok\n");
+	return 0;
+}
@@ -0,0 +1,330 @@
+// 测试程序 (test_*.c) 共用: 本地 websocket 服务端、帧读写和断言。
+// 服务端在 127.0.0.1 的随机端口上只接受一个连接，在自己的线程中运行，测试不依赖外部服务。
+#ifndef WSTEST_H
+#define WSTEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+#include "libwsclient.h"
+
+// 条件不成立时打印位置和原因，测试失败退出。任何线程中都可以用。
+#define WSTEST_CHECK(cond, ...)                                      \
+	do                                                               \
+	{                                                                \
+		if (!(cond))                                                 \
+		{                                                            \
+			fprintf(stderr, "%s:%d: check failed: %s: ", __FILE__, __LINE__, #cond); \
+			fprintf(stderr, __VA_ARGS__);                            \
+			fprintf(stderr, "\n");                                   \
+			exit(1);                                                 \
+		}                                                            \
+	} while (0)
+
+// 服务端的一个连接，tls 时 ssl 非 NULL。各线程写帧用 write_lock 互斥。
+typedef struct _wstest_conn
+{
+	int fd;
+	SSL *ssl;
+	pthread_mutex_t write_lock;
+	char request[4096];		// 客户端的握手请求
+} wstest_conn;
+
+// 读到的一帧，payload 已去掉 mask，按需扩大，用完 free。
+typedef struct _wstest_frame
+{
+	int opcode;
+	bool fin;
+	bool rsv1;				// 压缩的消息 (permessage-deflate)
+	unsigned char *payload;
+	unsigned long long len;
+	size_t cap;
+} wstest_frame;
+
+// 握手完成后在服务端线程中调用，读到客户端的 close 帧 (或连接断开) 后返回。
+typedef void (*wstest_handler)(wstest_conn *conn, void *arg);
+
+// 声明时清零，需要时在 wstest_server_start 之前设置握手响应的各项。
+typedef struct _wstest_server
+{
+	const char *response_headers;	// 握手响应中附加的头，每行以 \r\n 结尾
+	const void *greeting;			// 与握手响应 (的最后一块) 在同一次写入中发出的数据，比如紧跟着的帧
+	size_t greeting_len;
+	size_t response_chunk;			// 握手响应每次只写这么多字节，之间停 1 ms；0 表示一次写出
+	char uri[64];			// 客户端连接用的地址
+	int lfd;
+	SSL_CTX *ctx;
+	wstest_handler handler;
+	void *arg;
+	pthread_t thread;
+} wstest_server;
+
+static inline double wstest_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 最多等 seconds 秒直到 cond 成立。
+#define WSTEST_WAIT(cond, seconds)                                        \
+	do                                                                    \
+	{                                                                     \
+		double _deadline = wstest_now() + (seconds);                      \
+		while (!(cond) && wstest_now() < _deadline)                       \
+			usleep(1000);                                                 \
+	} while (0)
+
+static inline ssize_t wstest_recv(wstest_conn *conn, void *buf, size_t len)
+{
+	if (conn->ssl)
+		return SSL_read(conn->ssl, buf, len);
+	return recv(conn->fd, buf, len, 0);
+}
+
+// 读满 len 字节，连接断开返回 -1。
+static inline int wstest_read_all(wstest_conn *conn, void *buf, size_t len)
+{
+	unsigned char *p = buf;
+	while (len > 0)
+	{
+		ssize_t n = wstest_recv(conn, p, len);
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static inline int wstest_write_all(wstest_conn *conn, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	while (len > 0)
+	{
+		ssize_t n = conn->ssl ? SSL_write(conn->ssl, p, len) : send(conn->fd, p, len, MSG_NOSIGNAL);
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// 读一帧，客户端发来的帧必须带 mask。
+static inline int wstest_read_frame(wstest_conn *conn, wstest_frame *f)
+{
+	unsigned char hdr[14];
+	if (wstest_read_all(conn, hdr, 2) < 0)
+		return -1;
+	WSTEST_CHECK(hdr[1] & 0x80, "client frame without mask");
+	unsigned long long len = hdr[1] & 0x7f;
+	size_t ext = len == 126 ? 2 : len == 127 ? 8 : 0;
+	if (wstest_read_all(conn, hdr + 2, ext + 4) < 0)
+		return -1;
+	if (ext)
+	{
+		len = 0;
+		for (size_t i = 0; i < ext; i++)
+			len = len << 8 | hdr[2 + i];
+	}
+	if (len > f->cap)
+	{
+		f->payload = realloc(f->payload, len);
+		WSTEST_CHECK(f->payload, "out of memory");
+		f->cap = len;
+	}
+	if (wstest_read_all(conn, f->payload, len) < 0)
+		return -1;
+	const unsigned char *mask = hdr + 2 + ext;
+	for (unsigned long long i = 0; i < len; i++)
+		f->payload[i] ^= mask[i % 4];
+	f->opcode = hdr[0] & 0x0f;
+	f->fin = hdr[0] & 0x80;
+	f->rsv1 = hdr[0] & 0x40;
+	f->len = len;
+	return 0;
+}
+
+// 生成帧头 (不带 mask)，hdr 至少 10 字节，返回帧头长度。opcode 可以带 RSV1 (0x40) 表示压缩的消息。
+static inline size_t wstest_frame_header(unsigned char *hdr, bool fin, int opcode, size_t len)
+{
+	size_t hlen = 2;
+	hdr[0] = (fin ? 0x80 : 0) | opcode;
+	if (len < 126)
+		hdr[1] = len;
+	else if (len <= 0xffff)
+	{
+		hdr[1] = 126;
+		hdr[2] = len >> 8;
+		hdr[3] = len;
+		hlen = 4;
+	}
+	else
+	{
+		hdr[1] = 127;
+		for (int i = 0; i < 8; i++)
+			hdr[2 + i] = (unsigned long long)len >> (56 - 8 * i);
+		hlen = 10;
+	}
+	return hlen;
+}
+
+// 写一帧 (不带 mask)。
+static inline int wstest_write_fragment(wstest_conn *conn, bool fin, int opcode, const void *payload, size_t len)
+{
+	unsigned char hdr[10];
+	size_t hlen = wstest_frame_header(hdr, fin, opcode, len);
+	pthread_mutex_lock(&conn->write_lock);
+	int ret = wstest_write_all(conn, hdr, hlen) < 0 || wstest_write_all(conn, payload, len) < 0 ? -1 : 0;
+	pthread_mutex_unlock(&conn->write_lock);
+	return ret;
+}
+
+// 写一帧完整的消息 (不分片)。
+static inline int wstest_write_frame(wstest_conn *conn, int opcode, const void *payload, size_t len)
+{
+	return wstest_write_fragment(conn, true, opcode, payload, len);
+}
+
+// 读握手请求 (保存在 conn->request)，按 srv 的设置回 101。
+static inline int wstest_accept_handshake(wstest_conn *conn, const wstest_server *srv)
+{
+	char *req = conn->request;
+	size_t len = 0;
+	while (len < sizeof(conn->request) - 1)
+	{
+		ssize_t n = wstest_recv(conn, req + len, 1); // 逐字节读，不多读握手之后的帧
+		if (n <= 0)
+			return -1;
+		req[++len] = '\0';
+		if (len >= 4 && memcmp(req + len - 4, "\r\n\r\n", 4) == 0)
+			break;
+	}
+	const char *key = NULL;
+	for (char *line = req; line && *line; line = strstr(line, "\r\n") ? strstr(line, "\r\n") + 2 : NULL)
+	{
+		if (strncasecmp(line, "Sec-WebSocket-Key:", 18) == 0)
+		{
+			key = line + 18 + strspn(line + 18, " ");
+			break;
+		}
+	}
+	if (!key)
+		return -1;
+	char src[128];
+	unsigned char sha[SHA_DIGEST_LENGTH], accept_key[64];
+	snprintf(src, sizeof(src), "%.*s258EAFA5-E914-47DA-95CA-C5AB0DC85B11", (int)strcspn(key, "\r\n "), key);
+	SHA1((unsigned char *)src, strlen(src), sha);
+	EVP_EncodeBlock(accept_key, sha, SHA_DIGEST_LENGTH);
+	char resp[1024];
+	int rlen = snprintf(resp, sizeof(resp), "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+											"Sec-WebSocket-Accept: %s\r\n%s\r\n",
+						accept_key, srv->response_headers ? srv->response_headers : "");
+	WSTEST_CHECK(rlen < (int)sizeof(resp), "handshake response too long");
+	size_t off = 0;
+	while (srv->response_chunk && rlen - off > srv->response_chunk)
+	{
+		if (wstest_write_all(conn, resp + off, srv->response_chunk) < 0)
+			return -1;
+		off += srv->response_chunk;
+		usleep(1000);
+	}
+	unsigned char *out = malloc(rlen - off + srv->greeting_len);
+	WSTEST_CHECK(out, "out of memory");
+	memcpy(out, resp + off, rlen - off);
+	if (srv->greeting_len)
+		memcpy(out + rlen - off, srv->greeting, srv->greeting_len);
+	int ret = wstest_write_all(conn, out, rlen - off + srv->greeting_len);
+	free(out);
+	return ret;
+}
+
+static inline void *wstest_server_thread(void *ptr)
+{
+	wstest_server *srv = ptr;
+	wstest_conn conn = {.fd = accept(srv->lfd, NULL, NULL)};
+	WSTEST_CHECK(conn.fd >= 0, "accept failed");
+	pthread_mutex_init(&conn.write_lock, NULL);
+	if (srv->ctx)
+	{
+		conn.ssl = SSL_new(srv->ctx);
+		SSL_set_fd(conn.ssl, conn.fd);
+		WSTEST_CHECK(SSL_accept(conn.ssl) == 1, "TLS handshake failed");
+	}
+	WSTEST_CHECK(wstest_accept_handshake(&conn, srv) == 0, "websocket handshake failed");
+	srv->handler(&conn, srv->arg);
+	// 回 close 帧，读到客户端关闭连接为止 (提前 close 未读完的数据会让客户端收到 RST)。
+	wstest_write_frame(&conn, OP_CODE_CONTROL_CLOSE, "\x03\xe8", 2);
+	if (conn.ssl)
+		SSL_shutdown(conn.ssl);
+	shutdown(conn.fd, SHUT_WR);
+	char buf[4096];
+	while (wstest_recv(&conn, buf, sizeof(buf)) > 0)
+		;
+	if (conn.ssl)
+		SSL_free(conn.ssl);
+	close(conn.fd);
+	pthread_mutex_destroy(&conn.write_lock);
+	return NULL;
+}
+
+// 临时生成自签名证书，客户端不校验证书。
+static inline SSL_CTX *wstest_tls_ctx(void)
+{
+	SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+	EVP_PKEY *pkey = EVP_EC_gen("P-256");
+	X509 *cert = X509_new();
+	WSTEST_CHECK(ctx && pkey && cert, "unable to create TLS context");
+	ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+	X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+	X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+	X509_set_pubkey(cert, pkey);
+	X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC, (const unsigned char *)"127.0.0.1", -1, -1, 0);
+	X509_set_issuer_name(cert, X509_get_subject_name(cert));
+	WSTEST_CHECK(X509_sign(cert, pkey, EVP_sha256()) > 0, "unable to sign certificate");
+	WSTEST_CHECK(SSL_CTX_use_certificate(ctx, cert) == 1 && SSL_CTX_use_PrivateKey(ctx, pkey) == 1, "unable to use certificate");
+	X509_free(cert);
+	EVP_PKEY_free(pkey);
+	return ctx;
+}
+
+// 开始监听并启动服务端线程，tls 为 true 时是 wss://。客户端连接 srv->uri。
+static inline void wstest_server_start(wstest_server *srv, bool tls, wstest_handler handler, void *arg)
+{
+	struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+	socklen_t alen = sizeof(addr);
+	// 客户端可能先关闭连接，服务端的 SSL_shutdown 等写入不能让测试进程被 SIGPIPE 杀掉。
+	signal(SIGPIPE, SIG_IGN);
+	srv->lfd = socket(AF_INET, SOCK_STREAM, 0);
+	WSTEST_CHECK(srv->lfd >= 0 && bind(srv->lfd, (struct sockaddr *)&addr, sizeof(addr)) == 0 && listen(srv->lfd, 1) == 0 &&
+					 getsockname(srv->lfd, (struct sockaddr *)&addr, &alen) == 0,
+				 "unable to listen on 127.0.0.1");
+	snprintf(srv->uri, sizeof(srv->uri), "%s://127.0.0.1:%d/", tls ? "wss" : "ws", ntohs(addr.sin_port));
+	srv->ctx = tls ? wstest_tls_ctx() : NULL;
+	srv->handler = handler;
+	srv->arg = arg;
+	WSTEST_CHECK(pthread_create(&srv->thread, NULL, wstest_server_thread, srv) == 0, "pthread_create failed");
+}
+
+// 等服务端线程结束 (客户端已关闭连接)。
+static inline void wstest_server_stop(wstest_server *srv)
+{
+	pthread_join(srv->thread, NULL);
+	close(srv->lfd);
+	if (srv->ctx)
+		SSL_CTX_free(srv->ctx);
+}
+
+#endif
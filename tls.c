@@ -0,0 +1,403 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "./include/libwsclient.h"
+#include "wsclient.h"
+
+#include "utils.h"
+
+/*
+ * 进程内共享的 SSL_CTX 和客户端 TLS session 缓存
+ *
+ * 所有 wss:// 连接共用一个 SSL_CTX，按引用计数释放，不必每个连接重新创建。
+ * 服务端发来的 session (TLS 1.2 的 session id / ticket，TLS 1.3 握手后的 NewSessionTicket) 按 host:port 缓存，
+ * 重连同一个服务端时带上，服务端接受就走简化握手，省掉证书交换和签名验证，TLS 1.2 还能少一个 RTT。
+ */
+
+#define SSL_SESSION_CACHE_SIZE 64	// 最多缓存的服务端数，满了淘汰最久没用的
+
+typedef struct _wsclient_ssl_session
+{
+	char *peer;		// host:port
+	SSL_SESSION *session;
+	unsigned long long used;
+} wsclient_ssl_session;
+
+static pthread_mutex_t libwsclient_ssl_lock = PTHREAD_MUTEX_INITIALIZER;
+static SSL_CTX *libwsclient_ssl_ctx = NULL;
+static int libwsclient_ssl_ctx_refs = 0;
+static wsclient_ssl_session libwsclient_ssl_sessions[SSL_SESSION_CACHE_SIZE];
+static unsigned long long libwsclient_ssl_clock = 0;
+
+static void libwsclient_ssl_session_clear(wsclient_ssl_session *s)
+{
+	free(s->peer);
+	SSL_SESSION_free(s->session);
+	memset(s, 0, sizeof(*s));
+}
+
+// 调用方持有 libwsclient_ssl_lock。
+static bool libwsclient_ssl_cache_empty(void)
+{
+	for (int i = 0; i < SSL_SESSION_CACHE_SIZE; i++)
+		if (libwsclient_ssl_sessions[i].session)
+			return false;
+	return true;
+}
+
+// 握手完成、或 TLS 1.3 收到 NewSessionTicket 时由 OpenSSL 回调 (run 线程的 SSL_read 中)。返回 1 表示接管 session 的引用。
+static int libwsclient_ssl_new_session(SSL *ssl, SSL_SESSION *session)
+{
+	wsclient *c = SSL_get_app_data(ssl);
+	if (!c || !c->ssl_peer || !SSL_SESSION_is_resumable(session))
+		return 0;
+	pthread_mutex_lock(&libwsclient_ssl_lock);
+	wsclient_ssl_session *slot = NULL, *oldest = NULL;
+	for (int i = 0; i < SSL_SESSION_CACHE_SIZE; i++)
+	{
+		wsclient_ssl_session *s = &libwsclient_ssl_sessions[i];
+		if (s->peer && strcmp(s->peer, c->ssl_peer) == 0)
+		{
+			slot = s;
+			break;
+		}
+		if (!oldest || (oldest->peer && (!s->peer || s->used < oldest->used)))
+			oldest = s;
+	}
+	if (slot)
+		SSL_SESSION_free(slot->session);
+	else
+	{
+		char *peer = strdup(c->ssl_peer);
+		if (!peer)
+		{
+			pthread_mutex_unlock(&libwsclient_ssl_lock);
+			return 0;
+		}
+		slot = oldest;
+		libwsclient_ssl_session_clear(slot);
+		slot->peer = peer;
+	}
+	slot->session = session;
+	slot->used = ++libwsclient_ssl_clock;
+	pthread_mutex_unlock(&libwsclient_ssl_lock);
+	return 1;
+}
+
+// 取得共享的 SSL_CTX，第一次调用时创建。失败返回 NULL。
+SSL_CTX *libwsclient_ssl_ctx_acquire(void)
+{
+	pthread_mutex_lock(&libwsclient_ssl_lock);
+	if (!libwsclient_ssl_ctx)
+	{
+		// openssl 版本号小于等于 1.0.2 时，需要加入这个初始化；大于 1.1.0 则无需调用，自动完成。
+		SSL_library_init();
+		SSL_load_error_strings();
+		libwsclient_ssl_ctx = SSL_CTX_new(SSLv23_method());
+		if (libwsclient_ssl_ctx)
+		{
+			// 只用外部缓存: session 在 new_session_cb 中按 host:port 保存，连接前由 libwsclient_ssl_resume 设置。
+			SSL_CTX_set_session_cache_mode(libwsclient_ssl_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+			SSL_CTX_sess_set_new_cb(libwsclient_ssl_ctx, libwsclient_ssl_new_session);
+		}
+	}
+	SSL_CTX *ctx = libwsclient_ssl_ctx;
+	if (ctx)
+		libwsclient_ssl_ctx_refs++;
+	pthread_mutex_unlock(&libwsclient_ssl_lock);
+	return ctx;
+}
+
+// 释放一个引用。缓存中还有 session 时保留 SSL_CTX，之后的重连还能恢复，见 libwsclient_ssl_cleanup。
+void libwsclient_ssl_ctx_release(SSL_CTX *ctx)
+{
+	if (!ctx)
+		return;
+	pthread_mutex_lock(&libwsclient_ssl_lock);
+	if (--libwsclient_ssl_ctx_refs == 0 && libwsclient_ssl_cache_empty())
+	{
+		SSL_CTX_free(libwsclient_ssl_ctx);
+		libwsclient_ssl_ctx = NULL;
+	}
+	pthread_mutex_unlock(&libwsclient_ssl_lock);
+}
+
+// SSL_connect 之前调用: 设置 SNI (不能是 IP 地址)，有同一 host:port 未过期的 session 时带上。
+void libwsclient_ssl_resume(wsclient *c, const char *host)
+{
+	struct in_addr addr;
+	SSL_set_app_data(c->ssl, c);
+	if (inet_pton(AF_INET, host, &addr) != 1)
+		SSL_set_tlsext_host_name(c->ssl, host);
+	if (!c->ssl_peer)
+		return;
+	pthread_mutex_lock(&libwsclient_ssl_lock);
+	for (int i = 0; i < SSL_SESSION_CACHE_SIZE; i++)
+	{
+		wsclient_ssl_session *s = &libwsclient_ssl_sessions[i];
+		if (!s->peer || strcmp(s->peer, c->ssl_peer) != 0)
+			continue;
+		if (!s->session || (time_t)(SSL_SESSION_get_time(s->session) + SSL_SESSION_get_timeout(s->session)) < time(NULL))
+			libwsclient_ssl_session_clear(s);
+		else
+		{
+			SSL_set_session(c->ssl, s->session);
+			s->used = ++libwsclient_ssl_clock;
+		}
+		break;
+	}
+	pthread_mutex_unlock(&libwsclient_ssl_lock);
+}
+
+// 清空 session 缓存，没有连接在用时释放 SSL_CTX。
+void libwsclient_ssl_cleanup(void)
+{
+	pthread_mutex_lock(&libwsclient_ssl_lock);
+	for (int i = 0; i < SSL_SESSION_CACHE_SIZE; i++)
+		libwsclient_ssl_session_clear(&libwsclient_ssl_sessions[i]);
+	if (libwsclient_ssl_ctx && libwsclient_ssl_ctx_refs == 0)
+	{
+		SSL_CTX_free(libwsclient_ssl_ctx);
+		libwsclient_ssl_ctx = NULL;
+	}
+	pthread_mutex_unlock(&libwsclient_ssl_lock);
+}
+
+/*
+ * 内存 BIO pair 上的 TLS
+ *
+ * SSL 不直接读写 fd，而是读写 BIO pair 的一端 (内部端)；库自己在另一端 (tls_bio) 和 socket 之间搬运密文:
+ * 需要密文时一次 recv 尽量多的数据 (TLS_BIO_BUF_SIZE) 直接读进 BIO 的缓冲区，SSL 产生的密文攒够一批再写出。
+ * SSL 的 WANT_READ / WANT_WRITE 只表示 BIO 空了或满了，由这里处理，不会在 SSL 内部阻塞在 socket 上，
+ * 非阻塞模式下写不出的密文与 plain socket 一样追加到 out_buf。
+ * 同一个 SSL 对象不能被多个线程同时使用 (run 线程 SSL_read，发送线程 SSL_write)，SSL_* 调用和 BIO 缓冲区操作都持有 ssl_lock，
+ * socket 读写在锁外，锁的持有时间只是加解密。
+ */
+
+// TCP 连接建立后准备 TLS: 取得共享的 SSL_CTX、创建 SSL 和 BIO pair，重连同一 host:port 时恢复上次的 TLS session。
+// 出错时回调 onerror 并返回 -1。
+int libwsclient_tls_setup(wsclient *c, const char *host, const char *port)
+{
+	c->ssl_ctx = libwsclient_ssl_ctx_acquire();
+	c->ssl = c->ssl_ctx ? SSL_new(c->ssl_ctx) : NULL;
+	if (!c->ssl)
+	{
+		LIBWSCLIENT_ON_ERROR(c, "Unable to create SSL context.\n");
+		return -1;
+	}
+	c->ssl_peer = malloc(strlen(host) + strlen(port) + 2);
+	if (c->ssl_peer)
+		sprintf(c->ssl_peer, "%s:%s", host, port);
+	libwsclient_ssl_resume(c, host);
+	return libwsclient_tls_attach(c);
+}
+
+// 建立 BIO pair，握手之前调用。发送方向能放下一整个 send_buf 加密后的数据，一次写出。
+int libwsclient_tls_attach(wsclient *c)
+{
+	BIO *internal = NULL;
+	size_t out_size = c->send_buf_size + (c->send_buf_size / 16384 + 1) * 64;
+	if (out_size < TLS_BIO_BUF_SIZE)
+		out_size = TLS_BIO_BUF_SIZE;
+	if (!BIO_new_bio_pair(&internal, out_size, &c->tls_bio, TLS_BIO_BUF_SIZE))
+		return -1;
+	SSL_set_bio(c->ssl, internal, internal);
+	// BIO 满时 SSL_write 只写入一部分，剩下的从同一位置 (或 out_buf) 继续。
+	SSL_set_mode(c->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	return 0;
+}
+
+// 阻塞写出全部数据。
+static int libwsclient_send_all(wsclient *c, const char *buf, size_t length)
+{
+	while (length > 0)
+	{
+		ssize_t n = send(c->sockfd, buf, length, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		c->stats.writes++;
+		if (n <= 0)
+			return -1;
+		c->stats.bytes_out += n;
+		buf += n;
+		length -= n;
+	}
+	return 0;
+}
+
+// 把 BIO 中 SSL 产生的密文写到 socket。非阻塞模式下写不下的 (以及 out_buf 中已有数据时的全部) 追加到 out_buf。
+// 握手之后调用方持有 send_busy，只有它从 BIO 取密文；BIO_nread0 返回的数据在 BIO_nread 之前不会被覆盖，send 时不持有 ssl_lock。
+int libwsclient_tls_flush(wsclient *c)
+{
+	char *p = NULL;
+	for (;;)
+	{
+		pthread_mutex_lock(&c->ssl_lock);
+		int n = BIO_nread0(c->tls_bio, &p);
+		pthread_mutex_unlock(&c->ssl_lock);
+		if (n <= 0)
+			break;
+		if (TEST_FLAG(c, FLAG_CLIENT_NONBLOCK))
+		{
+			ssize_t w = c->out_len == 0 ? libwsclient_write_some(c, p, n) : 0;
+			if (w < 0 || (w < n && libwsclient_out_append(c, p + w, n - w) < 0))
+				return -1;
+		}
+		else if (libwsclient_send_all(c, p, n) < 0)
+			return -1;
+		pthread_mutex_lock(&c->ssl_lock);
+		BIO_nread(c->tls_bio, &p, n);
+		pthread_mutex_unlock(&c->ssl_lock);
+	}
+	return 0;
+}
+
+// SSL_read 之后是否有要发出的数据: BIO 中的密文，或者对方要求回应、还没发出的 KeyUpdate (OpenSSL 等到下一次写才发)。
+bool libwsclient_tls_output_pending(wsclient *c)
+{
+	if (!c->tls_bio)
+		return false;
+	pthread_mutex_lock(&c->ssl_lock);
+	bool pending = BIO_ctrl_pending(c->tls_bio) > 0 || SSL_get_key_update_type(c->ssl) != SSL_KEY_UPDATE_NONE;
+	pthread_mutex_unlock(&c->ssl_lock);
+	return pending;
+}
+
+// 写出上面的数据。调用方持有 send_busy。
+int libwsclient_tls_flush_pending(wsclient *c)
+{
+	int err = SSL_ERROR_NONE;
+	pthread_mutex_lock(&c->ssl_lock);
+	int type = SSL_get_key_update_type(c->ssl);
+	if (type != SSL_KEY_UPDATE_NONE)
+	{
+		// 待发的 KeyUpdate 只是一个标记，SSL_key_update 转入握手状态，SSL_do_handshake 才会立即生成。
+		// BIO 满 (WANT_WRITE) 时由下一次 SSL_write 接着发。
+		int r = SSL_key_update(c->ssl, type) ? SSL_do_handshake(c->ssl) : -1;
+		if (r != 1)
+			err = SSL_get_error(c->ssl, r);
+	}
+	pthread_mutex_unlock(&c->ssl_lock);
+	if (err != SSL_ERROR_NONE && err != SSL_ERROR_WANT_WRITE)
+		return -1;
+	return libwsclient_tls_flush(c);
+}
+
+// 从 socket 读一次密文，直接读进 BIO 的缓冲区。返回值同 recv。
+static ssize_t libwsclient_tls_fill(wsclient *c)
+{
+	char *p = NULL;
+	pthread_mutex_lock(&c->ssl_lock);
+	int room = BIO_nwrite0(c->tls_bio, &p);
+	pthread_mutex_unlock(&c->ssl_lock);
+	if (room <= 0)
+	{
+		errno = ENOBUFS;
+		return -1;
+	}
+	ssize_t n;
+	do
+		n = recv(c->sockfd, p, room, 0);
+	while (n < 0 && errno == EINTR);
+	if (n > 0)
+	{
+		pthread_mutex_lock(&c->ssl_lock);
+		BIO_nwrite(c->tls_bio, &p, n);
+		pthread_mutex_unlock(&c->ssl_lock);
+	}
+	return n;
+}
+
+// 推进 TLS 握手。返回 1 表示完成；0 表示非阻塞模式下等待 socket 可读 (握手消息写不下的部分已在 out_buf 中)；出错返回 -1。
+// 阻塞模式下一直做到完成或出错。
+int libwsclient_tls_connect(wsclient *c)
+{
+	for (;;)
+	{
+		pthread_mutex_lock(&c->ssl_lock);
+		int r = SSL_connect(c->ssl);
+		int err = r == 1 ? SSL_ERROR_NONE : SSL_get_error(c->ssl, r);
+		pthread_mutex_unlock(&c->ssl_lock);
+		if (libwsclient_tls_flush(c) < 0)
+			return -1;
+		if (r == 1)
+			return 1;
+		if (err != SSL_ERROR_WANT_READ)
+			return -1;
+		ssize_t n = libwsclient_tls_fill(c);
+		if (n < 0 && TEST_FLAG(c, FLAG_CLIENT_NONBLOCK) && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (n <= 0)
+			return -1;
+	}
+}
+
+// 读取并解密，BIO 中的密文不够一个 record 时从 socket 读。
+// 返回值同 recv: 连接关闭返回 0，出错返回 -1；非阻塞模式下暂时没有数据时返回 -1 且 errno 为 EAGAIN。
+ssize_t libwsclient_tls_read(wsclient *c, void *buf, size_t length)
+{
+	for (;;)
+	{
+		// SSL_get_error 看的是这次调用留下的状态，要和 SSL_read 在同一次加锁内，否则其他线程的 SSL_write 会改掉它。
+		pthread_mutex_lock(&c->ssl_lock);
+		int n = SSL_read(c->ssl, buf, length > INT_MAX ? INT_MAX : (int)length);
+		int err = n > 0 ? SSL_ERROR_NONE : SSL_get_error(c->ssl, n);
+		pthread_mutex_unlock(&c->ssl_lock);
+		// SSL_read 也可能留下要发出的数据 (比如回应 TLS 1.3 的 KeyUpdate)。有线程正在写时由它在释放写权限时写出。
+		if (libwsclient_tls_output_pending(c) && libwsclient_try_lock_send(c))
+		{
+			int ret = libwsclient_tls_flush_pending(c);
+			libwsclient_unlock_send(c);
+			if (ret < 0)
+				return -1;
+		}
+		if (n > 0)
+			return n;
+		if (err == SSL_ERROR_ZERO_RETURN)
+			return 0;
+		if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
+		{
+			errno = EPROTO;
+			return -1;
+		}
+		if (err == SSL_ERROR_WANT_READ)
+		{
+			ssize_t r = libwsclient_tls_fill(c);
+			if (r <= 0)
+				return r;
+		}
+	}
+}
+
+// 加密并写出整块数据。BIO 满了就先把密文写出去，SSL_write 总能写完。
+// 非阻塞模式下 socket 写不下的密文留在 out_buf，由 run 线程在可写时写出。返回 length，出错返回 -1。
+ssize_t libwsclient_tls_write(wsclient *c, const void *buf, size_t length)
+{
+	size_t z = 0;
+	if (TEST_FLAG(c, FLAG_CLIENT_NONBLOCK) && libwsclient_flush_out_buf(c) < 0)
+		return -1;
+	while (z < length)
+	{
+		size_t n = length - z > INT_MAX ? INT_MAX : length - z;
+		pthread_mutex_lock(&c->ssl_lock);
+		int w = SSL_write(c->ssl, (const char *)buf + z, (int)n);
+		int err = w > 0 ? SSL_ERROR_NONE : SSL_get_error(c->ssl, w);
+		pthread_mutex_unlock(&c->ssl_lock);
+		if (w > 0)
+		{
+			z += w;
+			continue;
+		}
+		if (err != SSL_ERROR_WANT_WRITE || libwsclient_tls_flush(c) < 0)
+			return -1;
+	}
+	return libwsclient_tls_flush(c) < 0 ? -1 : (ssize_t)length;
+}
@@ -24,4 +24,6 @@ uint64_t ntoh64(uint64_t val);
 
 int base64_encode(unsigned char *source, size_t sourcelen, char *target, size_t targetlen);
 
+size_t libwsclient_mask(unsigned char *dst, const unsigned char *src, size_t len, const unsigned char key[4], size_t offset);
+
 #endif
@@ -7,11 +7,22 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
 #include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <limits.h>
+#include <strings.h>
 
 #include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
 
 #include "./include/libwsclient.h"
 #include "wsclient.h"
@@ -24,75 +35,551 @@
 void *libwsclient_run_thread(void *ptr)
 {
 	wsclient *c = (wsclient *)ptr;
-	size_t n;
-	do
+	ssize_t n = 0;
+
+	// 握手时已分配，里面可能有服务端紧跟在响应之后发来的帧。
+	if (libwsclient_alloc_recv_buf(c) < 0)
+		n = -1;
+	else if (c->recv_end > c->recv_start && libwsclient_process_recv(c) < 0)
+		n = -1;
+	while (n >= 0)
 	{
 		if (TEST_FLAG(c, FLAG_CLIENT_QUIT))
 			break;
-		unsigned char head[2] = {0};
-		n = _libwsclient_read(c, head, 2);
-		if (n < 2)
+		n = libwsclient_fill_recv(c);
+		if (n <= 0)
+			break;
+		if (libwsclient_process_recv(c) < 0)
+			break;
+	}
+
+	if (!TEST_FLAG(c, FLAG_CLIENT_QUIT))
+	{	//不是主动退出的。
+		LIBWSCLIENT_ON_ERROR(c, "Error receiving data in client run thread");
+	}
+
+	if (c->onclose)
+	{
+		c->onclose(c);
+	}
+	close(c->sockfd);
+	return NULL;
+}
+
+// 发送队列: Vyukov 的无锁多生产者单消费者队列。生产者只做一次原子交换和一次原子写，不会互相阻塞。
+void libwsclient_queue_init(wsclient_send_queue *q)
+{
+	q->stub.next = NULL;
+	q->head = q->tail = &q->stub;
+}
+
+// 入队，任意线程可调用。
+void libwsclient_queue_push(wsclient_send_queue *q, wsclient_send_node *node)
+{
+	node->next = NULL;
+	wsclient_send_node *prev = __atomic_exchange_n(&q->tail, node, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&prev->next, node, __ATOMIC_SEQ_CST);
+}
+
+// 出队，同一时刻只能有一个消费者。队列为空，或下一个节点的生产者还没完成入队时返回 NULL。
+wsclient_send_node *libwsclient_queue_pop(wsclient_send_queue *q)
+{
+	wsclient_send_node *head = q->head;
+	wsclient_send_node *next = __atomic_load_n(&head->next, __ATOMIC_SEQ_CST);
+	if (head == &q->stub)
+	{
+		if (!next)
+			return NULL;
+		q->head = next;
+		head = next;
+		next = __atomic_load_n(&head->next, __ATOMIC_SEQ_CST);
+	}
+	if (next)
+	{
+		q->head = next;
+		return head;
+	}
+	if (head != __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST))
+		return NULL;
+	libwsclient_queue_push(q, &q->stub);
+	next = __atomic_load_n(&head->next, __ATOMIC_SEQ_CST);
+	if (next)
+	{
+		q->head = next;
+		return head;
+	}
+	return NULL;
+}
+
+// send_busy 标记当前负责写 socket 的线程(持有 send_buf)，只尝试不等待。
+bool libwsclient_try_lock_send(wsclient *c)
+{
+	return !__atomic_exchange_n(&c->send_busy, true, __ATOMIC_SEQ_CST);
+}
+
+// 释放写权限。SSL_read 留下的要发出的数据 (见 libwsclient_tls_output_pending) 在写权限被占用时没人写，
+// 读线程取不到写权限就不再管它，所以释放之后再看一次，有就重新取得写权限写出。
+// 用 exchange 而不是 store，才能看到读线程在取写权限失败之前留下的数据。
+void libwsclient_unlock_send(wsclient *c)
+{
+	(void)__atomic_exchange_n(&c->send_busy, false, __ATOMIC_SEQ_CST);
+	while (libwsclient_tls_output_pending(c) && libwsclient_try_lock_send(c))
+	{
+		int ret = libwsclient_tls_flush_pending(c);
+		(void)__atomic_exchange_n(&c->send_busy, false, __ATOMIC_SEQ_CST);
+		if (ret < 0)
+			break;
+	}
+	// 写的期间 run 线程 (或 loop) 发现可写而暂停了等待，out_buf 还有数据时交还给它接着写。
+	if (__atomic_load_n(&c->write_deferred, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&c->write_deferred, false, __ATOMIC_SEQ_CST) &&
+		__atomic_load_n(&c->out_len, __ATOMIC_SEQ_CST) > 0)
+	{
+		if (c->loop)
+			libwsclient_loop_resume_write(c);
+		else if (!c->external_loop)
+		{
+			// 管道满 (EAGAIN) 时 run 线程必然会醒来。
+			ssize_t n = write(c->wake_fd[1], "w", 1);
+			(void)n;
+		}
+	}
+}
+
+// out_buf 中有数据、需要等待 socket 可写 (暂停期间不等，见 libwsclient_on_socket_writable)。
+bool libwsclient_out_pending(wsclient *c)
+{
+	return __atomic_load_n(&c->out_len, __ATOMIC_SEQ_CST) > 0 && !__atomic_load_n(&c->write_deferred, __ATOMIC_SEQ_CST);
+}
+
+// 同步模式: 尝试取得写权限并写出队列中的消息。其他线程正在写时立即返回，由它写出。
+// 释放写权限后若又有完成入队的消息，再试一次，保证不会有消息被留在队列里。
+static bool libwsclient_send_pending(wsclient *c)
+{
+	return __atomic_load_n(&c->send_pushed, __ATOMIC_SEQ_CST) != __atomic_load_n(&c->send_popped, __ATOMIC_SEQ_CST) || libwsclient_ctrl_pending(c);
+}
+
+int libwsclient_flush_send_queue(wsclient *c)
+{
+	int ret = 0;
+	while (libwsclient_send_pending(c))
+	{
+		if (!libwsclient_try_lock_send(c))
 			break;
+		unsigned long long popped = c->send_popped + c->send_ctrl_popped;
+		if (libwsclient_write_send_queue(c) < 0)
+			ret = -1;
+		libwsclient_unlock_send(c);
+		if (c->send_popped + c->send_ctrl_popped == popped)
+			sched_yield(); // 队首的生产者还没完成入队
+	}
+	if (ret < 0)
+	{
+		LIBWSCLIENT_ON_ERROR(c, "Error sending data");
+	}
+	return ret;
+}
+
+bool libwsclient_ctrl_pending(wsclient *c)
+{
+	return __atomic_load_n(&c->send_ctrl_pushed, __ATOMIC_SEQ_CST) != __atomic_load_n(&c->send_ctrl_popped, __ATOMIC_SEQ_CST);
+}
+
+// 写出优先队列中的 ping / pong，接在 send_buf 中已编码的数据之后一起写出。调用方是唯一的消费者，且 send_buf 中只有完整的帧。
+int libwsclient_write_ctrl_queue(wsclient *c)
+{
+	int ret = 0;
+	wsclient_send_node *node;
+	while ((node = libwsclient_queue_pop(&c->send_ctrl_queue)) != NULL)
+	{
+		if (ret == 0 && node->len > c->send_buf_size - c->send_len)
+			ret = libwsclient_flush_send_buf(c);
+		if (ret == 0)
+		{
+			memcpy(c->send_buf + c->send_len, node->data, node->len);
+			c->send_len += node->len;
+			c->stats.frames_out += node->frames;
+		}
+		free(node);
+		__atomic_fetch_add(&c->send_ctrl_popped, 1, __ATOMIC_SEQ_CST);
+	}
+	if (ret == 0)
+		ret = libwsclient_flush_send_buf(c);
+	return ret;
+}
+
+// 取出队列中所有已完成入队的消息，按批写出后释放，优先队列先写。调用方是唯一的消费者 (持有 send_busy 或为发送线程)。
+// 写出失败时仍会取出并释放节点，返回 -1。
+int libwsclient_write_send_queue(wsclient *c)
+{
+	int ret = 0;
+	for (;;)
+	{
+		if (libwsclient_ctrl_pending(c) && libwsclient_write_ctrl_queue(c) < 0)
+			ret = -1;
+		wsclient_send_node *batch[SEND_BATCH_IOV_MAX];
+		int cnt = 0;
+		while (cnt < SEND_BATCH_IOV_MAX && (batch[cnt] = libwsclient_queue_pop(&c->send_queue)) != NULL)
+			cnt++;
+		if (cnt == 0)
+			break;
+		if (ret == 0 && libwsclient_write_batch(c, batch, cnt) < 0)
+			ret = -1;
+		size_t z = 0;
+		for (int i = 0; i < cnt; i++)
+		{
+			z += batch[i]->len;
+			if (ret == 0)
+				c->stats.frames_out += batch[i]->frames;
+			free(batch[i]);
+		}
+		__atomic_fetch_add(&c->send_popped, cnt, __ATOMIC_SEQ_CST);
+		if (c->async_send)
+			__atomic_fetch_sub(&c->send_queued, z, __ATOMIC_SEQ_CST);
+	}
+	return ret;
+}
+
+// 异步发送线程: 每次取走队列中的全部消息，plain socket 用 writev 一次写出多条，ssl 拷到 send_buf 凑成大块再写。
+// 退出标志置位且队列已空时结束。
+void *libwsclient_send_thread(void *ptr)
+{
+	wsclient *c = (wsclient *)ptr;
+	bool failed = false;
+	for (;;)
+	{
+		sem_wait(&c->send_sem);
+		// 非阻塞模式下 run 线程也会短暂持有 send_busy 写出 out_buf。
+		while (!libwsclient_try_lock_send(c))
+			sched_yield();
+		int ret = libwsclient_write_send_queue(c);
+		if (TEST_FLAG(c, FLAG_CLIENT_NONBLOCK))
+			libwsclient_check_water(c);	// 队列中的字节也计入未写出字节数
+		libwsclient_unlock_send(c);
+		if (ret < 0 && !failed)
+		{
+			failed = true;
+			LIBWSCLIENT_ON_ERROR(c, "Error sending data in client send thread");
+		}
+		if (__atomic_load_n(&c->send_queued, __ATOMIC_SEQ_CST) == 0)
+		{
+			if (__atomic_exchange_n(&c->drain_wait, false, __ATOMIC_SEQ_CST))
+				sem_post(&c->drain_sem);
+			if (__atomic_exchange_n(&c->send_queue_full, false, __ATOMIC_SEQ_CST) && c->ondrain)
+				c->ondrain(c);
+		}
+		if (TEST_FLAG(c, FLAG_CLIENT_QUIT) && !libwsclient_send_pending(c))
+			break;
+	}
+	return NULL;
+}
+
+// 已编码帧 (帧头带 mask) 的总长度
+static size_t libwsclient_encoded_frame_len(const unsigned char *p)
+{
+	unsigned long long len = p[1] & 0x7f;
+	size_t z = 2 + 4;
+	if (len == 126)
+	{
+		len = (p[2] << 8) | p[3];
+		z += 2;
+	}
+	else if (len == 127)
+	{
+		len = 0;
+		for (int i = 0; i < 8; i++)
+			len = (len << 8) | p[2 + i];
+		z += 8;
+	}
+	return z + len;
+}
+
+// 写出一条大消息: 按分片边界分成约 send_buf_size 大小的块写出，块之间插入优先队列中的 ping / pong。
+static int libwsclient_write_large_node(wsclient *c, wsclient_send_node *node)
+{
+	size_t off = 0;
+	while (off < node->len)
+	{
+		size_t end = off;
+		do
+			end += libwsclient_encoded_frame_len(node->data + end);
+		while (end < node->len && end - off < c->send_buf_size);
+		if (_libwsclient_write(c, node->data + off, end - off) != (ssize_t)(end - off))
+			return -1;
+		off = end;
+		if (off < node->len && libwsclient_ctrl_pending(c) && libwsclient_write_ctrl_queue(c) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+// 写出一批队列节点。调用方是唯一的消费者。
+int libwsclient_write_batch(wsclient *c, wsclient_send_node **nodes, int cnt)
+{
+	if (TEST_FLAG(c, FLAG_CLIENT_IS_SSL))
+	{
+		// SSL 没有 writev: 小节点拷到 send_buf 里合并，大节点分块直接写。
+		for (int i = 0; i < cnt; i++)
+		{
+			wsclient_send_node *node = nodes[i];
+			if (node->len > c->send_buf_size - c->send_len)
+			{
+				if (libwsclient_flush_send_buf(c) < 0)
+					return -1;
+				if (node->len >= c->send_buf_size)
+				{
+					if (libwsclient_write_large_node(c, node) < 0)
+						return -1;
+					continue;
+				}
+			}
+			memcpy(c->send_buf + c->send_len, node->data, node->len);
+			c->send_len += node->len;
+		}
+		return libwsclient_flush_send_buf(c);
+	}
+
+	struct iovec iov[SEND_BATCH_IOV_MAX];
+	int n = 0;
+	for (int i = 0; i < cnt; i++)
+	{
+		if (nodes[i]->len >= c->send_buf_size)
+		{
+			if ((n > 0 && _libwsclient_writev(c, iov, n) < 0) || libwsclient_write_large_node(c, nodes[i]) < 0)
+				return -1;
+			n = 0;
+			continue;
+		}
+		iov[n].iov_base = nodes[i]->data;
+		iov[n].iov_len = nodes[i]->len;
+		n++;
+	}
+	return n > 0 && _libwsclient_writev(c, iov, n) < 0 ? -1 : 0;
+}
+
+// 读取数据到接收缓冲区，一次读尽量多的字节。
+// 正在接收的大帧若剩余部分比整个缓冲区还大，且缓冲区已空，则直接读入其 payload，省去一次拷贝。
+ssize_t libwsclient_fill_recv(wsclient *c)
+{
+	ssize_t n;
+	wsclient_frame_in *pframe = &c->recv_frame;
+	if (c->recv_frame_pending && !c->msg_stream && c->recv_start == c->recv_end && pframe->payload_len - c->recv_frame_got >= c->recv_buf_size)
+	{
+		n = _libwsclient_read(c, pframe->payload + c->recv_frame_got, pframe->payload_len - c->recv_frame_got);
+		if (n > 0)
+			c->recv_frame_got += n;
+	}
+	else
+	{
+		// 把未解析完的半帧移到缓冲区头部。能放入缓冲区的帧在移动后一定放得下。
+		if (c->recv_start > 0)
+		{
+			memmove(c->recv_buf, c->recv_buf + c->recv_start, c->recv_end - c->recv_start);
+			c->recv_end -= c->recv_start;
+			c->recv_start = 0;
+		}
+		n = _libwsclient_read(c, c->recv_buf + c->recv_end, c->recv_buf_size - c->recv_end);
+		if (n > 0)
+			c->recv_end += n;
+	}
+	c->stats.reads++;
+	if (n > 0)
+		c->stats.bytes_in += n;
+	return n;
+}
+
+// 解析接收缓冲区中所有完整的帧。数据帧的 payload 拷到(或直接读入) msg_buf 末尾，消息收全后由 handle_on_data_frame_in 交给 onmessage。
+// 设置了 onfragment 时，数据帧的 payload 不缓存，读到多少就交给 onfragment 多少。
+// 返回 0 表示数据已处理完、需要继续读；-1 表示出错，应断开连接。
+int libwsclient_process_recv(wsclient *c)
+{
+	for (;;)
+	{
+		unsigned char *p = c->recv_buf + c->recv_start;
+		size_t avail = c->recv_end - c->recv_start;
+		wsclient_frame_in *pframe = &c->recv_frame;
+		if (c->recv_frame_pending && c->msg_stream)
+		{
+			// 流式接收: 缓冲区里有多少就交给 onfragment 多少，不缓存整条消息。
+			unsigned long long need = pframe->payload_len - c->recv_frame_got;
+			size_t z = need < avail ? need : avail;
+			bool done = z == need;
+			bool is_final = done && pframe->fin;
+			c->recv_frame_got += z;
+			c->recv_start += z;
+			if (c->msg_compressed)
+			{
+				if ((z > 0 || is_final) && libwsclient_inflate_fragment(c, p, z, is_final) < 0)
+				{
+					libwsclient_fail(c, 1007, "wsclient unable to inflate compressed message.");
+					return -1;
+				}
+			}
+			else if ((z > 0 || is_final) && c->onfragment)
+			{
+				c->onfragment(c, c->msg_opcode, !c->msg_streamed, is_final, p, z);
+				c->msg_streamed = true;
+			}
+			if (!done)
+				break;
+			c->recv_frame_pending = false;
+			if (is_final)
+			{
+				c->msg_opcode = 0;
+				c->msg_stream = false;
+				c->msg_streamed = false;
+			}
+			continue;
+		}
+		if (c->recv_frame_pending)
+		{
+			// 帧头已解析，把缓冲区里属于该帧的 payload 拷过去。
+			unsigned long long need = pframe->payload_len - c->recv_frame_got;
+			size_t z = need < avail ? need : avail;
+			memcpy(pframe->payload + c->recv_frame_got, p, z);
+			c->recv_frame_got += z;
+			c->recv_start += z;
+			if (c->recv_frame_got < pframe->payload_len)
+				break;
+			c->recv_frame_pending = false;
+			if (handle_on_data_frame_in(c, pframe) < 0)
+				return -1;
+			continue;
+		}
 
 		// frame header
-		bool fin = head[0] & 0x80;
-		int op = head[0] & 0x0f;
-		bool mask = head[1] & 0x80; // always false as it come from server.
-		(void)mask;
-		unsigned long long len = head[1] & 0x7f;
+		if (avail < 2)
+			break;
+		size_t hlen = 2;
+		unsigned long long len = p[1] & 0x7f;
+		if (len == 126)
+			hlen += 2;
+		else if (len == 127)
+			hlen += 8;
+		if (p[1] & 0x80) // always false as it come from server.
+			hlen += 4;
+		if (avail < hlen)
+			break;
 		if (len == 126)
 		{
 			uint16_t ulen = 0;
-			n = _libwsclient_read(c, &ulen, 2);
-			if (n < 2)
-				break;
+			memcpy(&ulen, p + 2, 2);
 			len = ntohs(ulen);
 		}
 		else if (len == 127)
 		{
 			uint64_t ulen = 0;
-			n = _libwsclient_read(c, &ulen, 8);
-			if (n < 8)
-				break;
+			memcpy(&ulen, p + 2, 8);
 			len = ntoh64(ulen);
 		}
 
-		// 注，作为client来说，收到的frame来自server，按照 rfc6455 规范，总是没有mask的。此处忽略mask处理。
-		wsclient_frame_in *pframe = calloc(sizeof(wsclient_frame_in), 1);
+		int op = p[0] & 0x0f;
+		bool fin = p[0] & 0x80;
+		bool is_control = (op & OP_CODE_CONTROL_CLOSE) == OP_CODE_CONTROL_CLOSE;
+		bool compressed = p[0] & FRAME_RSV1;
+		if (is_control && (len > 125 || !fin))
+		{
+			libwsclient_fail(c, 1002, "Invalid control frame received.");
+			return -1;
+		}
+		// RSV 位只有协商了 permessage-deflate 时可以用 RSV1，而且只能在数据消息的第一帧。
+		if ((p[0] & 0x70 & ~FRAME_RSV1) || (compressed && (!c->deflate || is_control || op == OP_CODE_CONTINUE)))
+		{
+			libwsclient_fail(c, 1002, "Invalid RSV bits received.");
+			return -1;
+		}
+		// 需要缓存的数据消息，在等待和分配 payload 之前先检查大小限制。流式接收的消息不占内存，不受限制。
+		if (!is_control && !(op == OP_CODE_CONTINUE ? c->msg_stream : c->onfragment != NULL))
+		{
+			unsigned long long msg_len = op == OP_CODE_CONTINUE ? c->msg_len : 0;
+			if ((c->max_frame_size && len > c->max_frame_size) || (c->max_message_size && len > c->max_message_size - msg_len))
+			{
+				char buff[128] = {0};
+				sprintf(buff, "wsclient received frame of %llu bytes exceeds size limit.", len);
+				libwsclient_fail(c, 1009, buff);
+				return -1;
+			}
+		}
+		// 整帧放得进缓冲区但还没收全，等下次读。
+		if (len > avail - hlen && hlen + len <= c->recv_buf_size)
+			break;
+
+		// 整帧已在缓冲区中: 控制帧，以及 zero_copy_recv 模式下的单帧消息，直接把缓冲区指针交给回调，不分配也不拷贝。
+		if (len <= avail - hlen && (is_control || (c->zero_copy_recv && !c->onfragment && fin && !compressed && op != OP_CODE_CONTINUE && !c->msg_opcode)))
+		{
+			wsclient_frame_in frame = {0};
+			frame.fin = fin;
+			frame.opcode = op;
+			frame.payload_len = len;
+			frame.payload = p + hlen;
+			c->stats.frames_in++;
+			c->recv_start += hlen + len;
+			// 临时补一个 '\0'，与 msg_buf 中的消息一样可当字符串用。缓冲区多分配了一个字节，不会越界。
+			unsigned char saved = frame.payload[len];
+			frame.payload[len] = '\0';
+			if (is_control)
+				libwsclient_handle_control_frame(c, &frame);
+			else if (c->onmessage)
+				c->onmessage(c, op & OP_CODE_TYPE_TEXT, len, frame.payload);
+			frame.payload[len] = saved;
+			continue;
+		}
+
+		// 按照rfc6455, 分片消息以非 continue 帧开始，后续全是 continue 帧，中间只可能插入控制帧。
+		if ((op == OP_CODE_CONTINUE) != (c->msg_opcode != 0))
+		{
+			libwsclient_fail(c, 1002, "Unexpected continuation or data frame received.");
+			return -1;
+		}
+		if (op != OP_CODE_CONTINUE)
+		{
+			c->msg_opcode = op;
+			c->msg_len = 0;
+			c->msg_stream = c->onfragment != NULL;
+			c->msg_compressed = compressed;
+		}
 		pframe->fin = fin;
 		pframe->opcode = op;
 		pframe->payload_len = len;
-		pframe->payload = calloc(len, 1);
+		pframe->payload = NULL;
+		c->stats.frames_in++;
+		c->recv_start += hlen;
+		c->recv_frame_pending = true;
+		c->recv_frame_got = 0;
+		if (c->msg_stream)
+			continue;
 
-		size_t z = 0;
-		do
+		// 注，作为client来说，收到的frame来自server，按照 rfc6455 规范，总是没有mask的。此处忽略mask处理。
+		if (libwsclient_reserve_msg_buf(c, len) < 0)
 		{
-			n = _libwsclient_read(c, pframe->payload + z, len - z);
-			z += n;
-		} while ((z < len) && (n > 0));
-
-		if (z < len){
 			char buff[128] = {0};
-			sprintf(buff, "wsclient try to read %lld bytes, but get %ld bytes.", len, n);
+			sprintf(buff, "wsclient unable to allocate %llu bytes for message payload.", c->msg_len + len);
 			LIBWSCLIENT_ON_ERROR(c, buff);
-			break;
+			return -1;
 		}
-
-		handle_on_data_frame_in(c, pframe);
-
-	} while (n > 0);
-
-	if (!TEST_FLAG(c, FLAG_CLIENT_QUIT))
-	{	//不是主动退出的。
-		LIBWSCLIENT_ON_ERROR(c, "Error receiving data in client run thread");
+		pframe->payload = c->msg_buf + c->msg_len;
 	}
+	if (c->recv_start == c->recv_end)
+		c->recv_start = c->recv_end = 0;
+	return 0;
+}
 
-	if (c->onclose)
-	{
-		c->onclose(c);
-	}
-	close(c->sockfd);
-	return NULL;
+// 保证 msg_buf 在已有消息之后还能放下 len 字节的 payload 和结尾的 '\0'。按倍数增长，跨消息复用。
+int libwsclient_reserve_msg_buf(wsclient *c, unsigned long long len)
+{
+	if (len >= SIZE_MAX - c->msg_len - 1)
+		return -1;
+	size_t need = c->msg_len + len + 1;
+	if (need <= c->msg_buf_size)
+		return 0;
+	size_t size = c->msg_buf_size ? c->msg_buf_size : MSG_BUF_INIT_SIZE;
+	while (size < need)
+		size = size > SIZE_MAX / 2 ? need : size * 2;
+	unsigned char *buf = realloc(c->msg_buf, size);
+	if (!buf)
+		return -1;
+	c->msg_buf = buf;
+	c->msg_buf_size = size;
+	return 0;
 }
 
 
@@ -123,12 +610,8 @@ void libwsclient_handle_control_frame(wsclient *c, wsclient_frame_in *ctl_frame)
 		// 1.1 收到有playload的close frame，回复的close frame，需要原样带上payload。
 		// 2. 收到 close frame，必须回复一个 close frame，除非是自己主动发的(避免死循环).
 		// 3. close frame 必须是最后一个frame. 此后不允许再发任何包。
-		if (!(TEST_FLAG(c, FLAG_CLIENT_CLOSEING)))
-		{
-			// server request close.  Send close frame as acknowledgement.
-			libwsclient_send_data(c, OP_CODE_CONTROL_CLOSE, ctl_frame->payload, ctl_frame->payload_len);
-			update_wsclient_status(c, FLAG_CLIENT_CLOSEING, 0);
-		}
+		// server request close.  Send close frame as acknowledgement.
+		libwsclient_send_close(c, ctl_frame->payload, ctl_frame->payload_len);
 		break;
 	// ping, pong in rfc6455:
 	// 1. ping 可以携带payload，如果有携带， pong需要原样带上（除了mask）。
@@ -152,132 +635,70 @@ void libwsclient_handle_control_frame(wsclient *c, wsclient_frame_in *ctl_frame)
 	}
 }
 
-inline void handle_on_data_frame_in(wsclient *c, wsclient_frame_in *pframe)
+// 协议错误或超出限制: 发送带状态码的 close 帧后报告错误，调用方随后断开连接。
+void libwsclient_fail(wsclient *c, int code, char *msg)
 {
-#ifdef DEBUG
-	LIBWSCLIENT_ON_INFO(c, "websocket 收到数据.\n");
-#endif
-	if (pframe->fin)
-	{
-		if (pframe->opcode == OP_CODE_CONTINUE)
-		{ // 多幁，需合并。
-			pframe->prev_frame = c->current_frame;
-			c->current_frame->next_frame = pframe;
-			wsclient_frame_in *p = pframe;
-			unsigned long long payload_len = p->payload_len;
-			while (p->prev_frame)
-			{
-				p = p->prev_frame;
-				payload_len += p->payload_len;
-			}
-			int op = p->opcode;
-			unsigned char *payload = calloc(payload_len, 1);
-			int offset = 0;
-			memcpy(payload, p->payload, p->payload_len);
-			offset += p->payload_len;
-			while (p->next_frame)
-			{
-				free(p->payload);
-				free(p);
-				p = p->next_frame;
-				memcpy(payload + offset, p->payload, p->payload_len);
-				offset += p->payload_len;
-			}
-			free(p->payload);
-			free(p);
-			c->current_frame = NULL;
-
-			// 按照rfc6455, 多帧只可能是数据帧，控制帧只能是单帧，且payload在126以内。
-			if (c->onmessage)
-				c->onmessage(c, op & OP_CODE_TYPE_TEXT, payload_len, payload);
-			free(payload);
-		}
-		else
-		{
-			// 单独一帧
-			if ((pframe->opcode & OP_CODE_CONTROL_CLOSE) == OP_CODE_CONTROL_CLOSE)
-			{
-				// 控制帧。 
-				libwsclient_handle_control_frame(c, pframe);
-			}
-			else
-			{
-				// 单帧消息
-				if (c->onmessage)
-					c->onmessage(c, pframe->opcode & OP_CODE_TYPE_TEXT, pframe->payload_len, pframe->payload);
-			}
-			free(pframe->payload);
-			free(pframe);
-		}
-	}
-	else
-	{ // 多帧合并，尚未结束。
-		if (c->current_frame == NULL)
-			c->current_frame = pframe;
-		else
-		{
-			c->current_frame->next_frame = pframe;
-			pframe->prev_frame = c->current_frame;
-			c->current_frame = pframe;
-		}
-	}
+	unsigned char payload[125] = {0};
+	size_t len = strlen(msg);
+	if (len > sizeof(payload) - 2)
+		len = sizeof(payload) - 2;
+	payload[0] = (code >> 8) & 0xff;
+	payload[1] = code & 0xff;
+	memcpy(payload + 2, msg, len);
+	libwsclient_send_close(c, payload, len + 2);
+	LIBWSCLIENT_ON_ERROR(c, msg);
 }
 
-int libwsclient_open_connection(const char *host, const char *port)
+// 一个数据帧的 payload 已经收全，就在 msg_buf 的末尾。收到 fin 帧时整条消息交给 onmessage，压缩的消息先解压到 inflate_buf。
+// 返回 -1 表示解压失败，已发送 close 帧，应断开连接。
+inline int handle_on_data_frame_in(wsclient *c, wsclient_frame_in *pframe)
 {
-	struct addrinfo hints, *servinfo, *p;
-	int rv, sockfd;
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-	if ((rv = getaddrinfo(host, port, &hints, &servinfo)) != 0)
-	{
-		return 0;
-	}
+#ifdef DEBUG
+	LIBWSCLIENT_ON_INFO(c, "websocket 收到数据.\n");
+#endif
+	c->msg_len += pframe->payload_len;
+	if (!pframe->fin)
+		return 0; // 多帧合并，尚未结束。
 
-	for (p = servinfo; p != NULL; p = p->ai_next)
+	unsigned char *data = c->msg_buf;
+	unsigned long long len = c->msg_len;
+	if (c->msg_compressed)
 	{
-		if ((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+		ssize_t n = libwsclient_inflate_message(c, c->msg_buf, c->msg_len);
+		if (n == -2)
 		{
-			continue;
+			libwsclient_fail(c, 1009, "wsclient received compressed message exceeds size limit.");
+			return -1;
 		}
-		if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1)
+		if (n < 0)
 		{
-			close(sockfd);
-			continue;
+			libwsclient_fail(c, 1007, "wsclient unable to inflate compressed message.");
+			return -1;
 		}
-		break;
+		data = c->inflate_buf;
+		len = n;
 	}
-	freeaddrinfo(servinfo);
-	if (p == NULL)
-	{
-		return 0;
-	}
-	return sockfd;
+	else
+		c->msg_buf[c->msg_len] = '\0';
+	if (c->onmessage)
+		c->onmessage(c, c->msg_opcode & OP_CODE_TYPE_TEXT, len, data);
+	c->msg_opcode = 0;
+	c->msg_len = 0;
+	return 0;
 }
 
-void *libwsclient_handshake_thread(void *ptr)
+// 解析 URI 到 hs 的 host / port / path，wss 设置 FLAG_CLIENT_IS_SSL。出错时回调 onerror 并返回 -1。
+int libwsclient_parse_uri(wsclient *client, wsclient_handshake *hs)
 {
-	wsclient *client = (wsclient *)ptr;
 	const char *URI = client->URI;
-	SHA1Context shactx;
-	const char *UUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
-	unsigned char sha1bytes[20] = {0};
-	char websocket_key[256];
-	unsigned char key_nonce[16] = {0};
 	char scheme[10];
-	char host[200];
-	char request_host[256];
-	char port[10];
-	char path[255];
-	char recv_buf[1024];
-	char *URI_copy = NULL, *p = NULL, *rcv = NULL, *tok = NULL;
-	int i, sockfd, n, flags = 0;
+	char *URI_copy = NULL, *p = NULL;
+	int i;
 	URI_copy = (char *)malloc(strlen(URI) + 1);
 	if (!URI_copy)
 	{
 		LIBWSCLIENT_ON_ERROR(client, "Unable to allocate memory in libwsclient_new.\n");
-		return NULL;
+		return -1;
 	}
 	memset(URI_copy, 0, strlen(URI) + 1);
 	strncpy(URI_copy, URI, strlen(URI));
@@ -285,254 +706,779 @@ void *libwsclient_handshake_thread(void *ptr)
 	if (p == NULL)
 	{
 		LIBWSCLIENT_ON_ERROR(client, "Malformed or missing scheme for URI.\n");
-		return NULL;
+		free(URI_copy);
+		return -1;
 	}
 	strncpy(scheme, URI_copy, p - URI_copy);
 	scheme[p - URI_copy] = '\0';
 	if (strcmp(scheme, "ws") != 0 && strcmp(scheme, "wss") != 0)
 	{
 		LIBWSCLIENT_ON_ERROR(client, "Invalid scheme for URI");
-		return NULL;
+		free(URI_copy);
+		return -1;
 	}
 	if (strcmp(scheme, "ws") == 0)
 	{
-		strncpy(port, "80", 9);
+		strncpy(hs->port, "80", 9);
 	}
 	else
 	{
-		strncpy(port, "443", 9);
+		strncpy(hs->port, "443", 9);
 		update_wsclient_status(client, FLAG_CLIENT_IS_SSL, 0);
 	}
 	size_t z = 0;
 	for (i = p - URI_copy + 3, z = 0; *(URI_copy + i) != '/' && *(URI_copy + i) != ':' && *(URI_copy + i) != '\0'; i++, z++)
 	{
-		host[z] = *(URI_copy + i);
+		hs->host[z] = *(URI_copy + i);
 	}
-	host[z] = '\0';
+	hs->host[z] = '\0';
 	if (*(URI_copy + i) == ':')
 	{
 		i++;
 		p = strchr(URI_copy + i, '/');
 		if (!p)
 			p = strchr(URI_copy + i, '\0');
-		strncpy(port, URI_copy + i, (p - (URI_copy + i)));
-		port[p - (URI_copy + i)] = '\0';
+		strncpy(hs->port, URI_copy + i, (p - (URI_copy + i)));
+		hs->port[p - (URI_copy + i)] = '\0';
 		i += p - (URI_copy + i);
 	}
 	if (*(URI_copy + i) == '\0')
 	{
 		// end of URI request path will be /
-		strncpy(path, "/", 2);
+		strncpy(hs->path, "/", 2);
 	}
 	else
 	{
-		strncpy(path, URI_copy + i, 254);
+		strncpy(hs->path, URI_copy + i, 254);
 	}
 	free(URI_copy);
-	sockfd = libwsclient_open_connection(host, port);
-
-	if (sockfd <= 0)
-	{
-		LIBWSCLIENT_ON_ERROR(client, "Error while getting address info");
-
-		return NULL;
-	}
-
-	if (TEST_FLAG(client, FLAG_CLIENT_IS_SSL))
-	{
-		static bool b_ssl_need_inited = true;
-		if (b_ssl_need_inited)
-		{ // openssl 版本号小于等于 1.0.2 时，需要加入这个初始化；大于 1.1.0 则无需调用，自动完成。
-			SSL_library_init();
-			SSL_load_error_strings();
-			b_ssl_need_inited = false;
-		}
-		client->ssl_ctx = SSL_CTX_new(SSLv23_method());
-		client->ssl = SSL_new(client->ssl_ctx);
-		SSL_set_fd(client->ssl, sockfd);
-		SSL_connect(client->ssl);
-	}
+	return 0;
+}
 
-	pthread_mutex_lock(&client->lock);
-	client->sockfd = sockfd;
-	pthread_mutex_unlock(&client->lock);
-	// perform handshake
+// 生成握手请求写入 buf，Sec-WebSocket-Key 对应的 Sec-WebSocket-Accept 保存在 hs->accept 中供校验响应。返回请求长度。
+int libwsclient_handshake_request(wsclient *client, wsclient_handshake *hs, char *buf, size_t size)
+{
+	SHA1Context shactx;
+	const char *UUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+	unsigned char key_nonce[16] = {0};
+	unsigned char sha1bytes[20];
+	char key[32];
+	char request_host[256];
+	size_t z;
 	// generate nonce
 	srand(time(NULL));
 	for (z = 0; z < 16; z++)
 	{
 		key_nonce[z] = rand() & 0xff;
 	}
-	base64_encode(key_nonce, 16, websocket_key, 256);
+	base64_encode(key_nonce, 16, key, sizeof(key));
 
-	if (strcmp(port, "80") != 0)
+	char pre_encode[256] = {0};
+	snprintf(pre_encode, 256, "%s%s", key, UUID);
+	SHA1Reset(&shactx);
+	SHA1Input(&shactx, (unsigned char*)pre_encode, strlen(pre_encode));
+	SHA1Result(&shactx);
+	for (z = 0; z < 20; z++)
+		sha1bytes[z] = shactx.Message_Digest[z / 4] >> (24 - (z % 4) * 8);
+	base64_encode(sha1bytes, 20, hs->accept, sizeof(hs->accept));
+
+	if (strcmp(hs->port, "80") != 0)
 	{
-		snprintf(request_host, 256, "%s:%s", host, port);
+		snprintf(request_host, 256, "%s:%s", hs->host, hs->port);
 	}
 	else
 	{
-		snprintf(request_host, 256, "%s", host);
+		snprintf(request_host, 256, "%s", hs->host);
 	}
-	char request_headers[1024] = {0};
-	snprintf(request_headers, 1024, "GET %s HTTP/1.1\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nHost: %s\r\nSec-WebSocket-Key: %s\r\nSec-WebSocket-Version: 13\r\n\r\n", path, request_host, websocket_key);
-	n = _libwsclient_write(client, request_headers, strlen(request_headers));
-	z = 0;
-	memset(recv_buf, 0, 1024);
-	// TODO: actually handle data after \r\n\r\n in case server
-	//  sends post-handshake data that gets coalesced in this recv
-	do
-	{
-		n = _libwsclient_read(client, recv_buf + z, 1023 - z);
-		z += n;
-	} while ((z < 4 || strstr(recv_buf, "\r\n\r\n") == NULL) && n > 0);
+	char extensions[160];
+	libwsclient_deflate_offer(client, extensions, sizeof(extensions));
+	snprintf(buf, size, "GET %s HTTP/1.1\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nHost: %s\r\nSec-WebSocket-Key: %s\r\nSec-WebSocket-Version: 13\r\n%s\r\n", hs->path, request_host, key, extensions);
+	return strlen(buf);
+}
 
-	if (n <= 0)
+// 逗号分隔的头部值中是否有 token (不区分大小写)，如 Connection: keep-alive, Upgrade。
+static bool libwsclient_header_has_token(const char *value, const char *token)
+{
+	size_t len = strlen(token);
+	while (*value)
 	{
-		LIBWSCLIENT_ON_ERROR(client, "WS_HANDSHAKE_REMOTE_CLOSED_or_other_receive_ERR");
-		return NULL;
+		while (*value == ' ' || *value == '\t' || *value == ',')
+			value++;
+		const char *end = value;
+		while (*end && *end != ',')
+			end++;
+		const char *last = end;
+		while (last > value && (last[-1] == ' ' || last[-1] == '\t'))
+			last--;
+		if ((size_t)(last - value) == len && strncasecmp(value, token, len) == 0)
+			return true;
+		value = end;
 	}
+	return false;
+}
 
-	// parse recv_buf for response headers and assure Accept matches expected value
-	rcv = (char *)calloc(strlen(recv_buf) + 1, 1);
-	if (!rcv)
+// 处理响应中的一行 (已去掉行尾)。第一行是状态行，之后是头部。出错时回调 onerror 并返回 -1。
+static int libwsclient_handshake_line(wsclient *client, wsclient_handshake *hs, char *line)
+{
+	if (!(hs->flags & FLAG_REQUEST_VALID_STATUS))
 	{
-		LIBWSCLIENT_ON_ERROR(client, "Unable to allocate memory in libwsclient_new.\n");
-		return NULL;
+		// HTTP/1.1 101 Switching Protocols
+		if (strncmp(line, "HTTP/1.", 7) != 0 || (line[7] != '0' && line[7] != '1') || strncmp(line + 8, " 101", 4) != 0 || (line[12] != ' ' && line[12] != '\0'))
+		{
+			LIBWSCLIENT_ON_ERROR(client, "Remote web server responded with bad HTTP status during handshake");
+			LIBWSCLIENT_ON_INFO(client, "handshake resp: \n\t");
+			LIBWSCLIENT_ON_INFO(client, line);
+			return -1;
+		}
+		hs->flags |= FLAG_REQUEST_VALID_STATUS;
+		return 0;
 	}
-	strncpy(rcv, recv_buf, strlen(recv_buf));
-
-	char pre_encode[256] = {0};
-	snprintf(pre_encode, 256, "%s%s", websocket_key, UUID);
-	SHA1Reset(&shactx);
-	SHA1Input(&shactx, (unsigned char*)pre_encode, strlen(pre_encode));
-	SHA1Result(&shactx);
-	memset(pre_encode, 0, 256);
-	snprintf(pre_encode, 256, "%08x%08x%08x%08x%08x", shactx.Message_Digest[0], shactx.Message_Digest[1], shactx.Message_Digest[2], shactx.Message_Digest[3], shactx.Message_Digest[4]);
-	for (z = 0; z < (strlen(pre_encode) / 2); z++)
-		sscanf(pre_encode + (z * 2), "%02hhx", sha1bytes + z);
-	char expected_base64[512] = {0};
-	base64_encode(sha1bytes, 20, expected_base64, 512);
-	for (tok = strtok(rcv, "\r\n"); tok != NULL; tok = strtok(NULL, "\r\n"))
-	{
-		if (*tok == 'H' && *(tok + 1) == 'T' && *(tok + 2) == 'T' && *(tok + 3) == 'P')
-		{
-			p = strchr(tok, ' ');
-			p = strchr(p + 1, ' ');
-			*p = '\0';
-			if (strcmp(tok, "HTTP/1.1 101") != 0 && strcmp(tok, "HTTP/1.0 101") != 0)
-			{
-				LIBWSCLIENT_ON_ERROR(client, "Remote web server responded with bad HTTP status during handshake");
-				LIBWSCLIENT_ON_INFO(client, "handshake resp: \n\t");
-				LIBWSCLIENT_ON_INFO(client, rcv);
+	char *value = strchr(line, ':');
+	if (!value)
+		return 0;
+	*value++ = '\0';
+	while (*value == ' ' || *value == '\t')
+		value++;
+	for (char *end = value + strlen(value); end > value && (end[-1] == ' ' || end[-1] == '\t'); end--)
+		end[-1] = '\0';
+	if (strcasecmp(line, "Upgrade") == 0)
+	{
+		if (strcasecmp(value, "websocket") == 0)
+			hs->flags |= FLAG_REQUEST_HAS_UPGRADE;
+	}
+	else if (strcasecmp(line, "Connection") == 0)
+	{
+		if (libwsclient_header_has_token(value, "upgrade"))
+			hs->flags |= FLAG_REQUEST_HAS_CONNECTION;
+	}
+	else if (strcasecmp(line, "Sec-WebSocket-Accept") == 0)
+	{
+		if (strcmp(value, hs->accept) == 0)
+			hs->flags |= FLAG_REQUEST_VALID_ACCEPT;
+	}
+	else if (strcasecmp(line, "Sec-WebSocket-Extensions") == 0)
+	{
+		if (libwsclient_deflate_accept(client, value) < 0)
+		{
+			LIBWSCLIENT_ON_ERROR(client, "Remote web server responded with unexpected Sec-WebSocket-Extensions during handshake");
+			LIBWSCLIENT_ON_INFO(client, value);
+			return -1;
+		}
+	}
+	return 0;
+}
 
-				return NULL;
-			}
-			flags |= FLAG_REQUEST_VALID_STATUS;
+// 增量解析握手响应。data 为新读到的 len 字节，每个字节只扫描一次: 收全的行立即处理，不完整的行暂存在 hs->buf 中。
+// 在头部结束的空行处停止，*used 为到此为止用掉的字节数，之后的字节是服务端紧接着发来的帧，由调用方交给帧解析。
+// 返回 1 表示响应已收全并通过校验，0 表示还要更多数据 (data 已全部用掉)，-1 表示出错 (已回调 onerror)。
+int libwsclient_handshake_response(wsclient *client, wsclient_handshake *hs, const char *data, size_t len, size_t *used)
+{
+	const char *p = data, *end = data + len;
+	*used = len;
+	while (p < end)
+	{
+		const char *nl = memchr(p, '\n', end - p);
+		size_t n = (nl ? nl : end) - p;
+		if (hs->len + n >= sizeof(hs->buf))
+		{
+			LIBWSCLIENT_ON_ERROR(client, "Remote web server sent an overlong header line during handshake");
+			return -1;
 		}
-		else
+		memcpy(hs->buf + hs->len, p, n);
+		hs->len += n;
+		if (!nl)
+			return 0;
+		p = nl + 1;
+		if (hs->len > 0 && hs->buf[hs->len - 1] == '\r')
+			hs->len--;
+		hs->buf[hs->len] = '\0';
+		if (hs->len == 0)
 		{
-			p = strchr(tok, ' ');
-			*p = '\0';
-			if (strcmp(tok, "Upgrade:") == 0)
+			*used = p - data;
+			int need = FLAG_REQUEST_VALID_STATUS | FLAG_REQUEST_HAS_UPGRADE | FLAG_REQUEST_HAS_CONNECTION | FLAG_REQUEST_VALID_ACCEPT;
+			if ((hs->flags & need) != need)
 			{
-				if (stricmp(p + 1, "websocket") == 0)
-				{
-					flags |= FLAG_REQUEST_HAS_UPGRADE;
-				}
-			}
-			if (strcmp(tok, "Connection:") == 0)
-			{
-				if (stricmp(p + 1, "upgrade") == 0)
-				{
-					flags |= FLAG_REQUEST_HAS_CONNECTION;
-				}
-			}
-			if (strcmp(tok, "Sec-WebSocket-Accept:") == 0)
-			{
-				if (strcmp(p + 1, expected_base64) == 0)
-				{
-					flags |= FLAG_REQUEST_VALID_ACCEPT;
-				}
+				LIBWSCLIENT_ON_ERROR(client, "Remote web server did not respond with expcet ( update, accept, connection) header during handshake");
+				return -1;
 			}
+			return 1;
 		}
+		hs->len = 0;
+		if (libwsclient_handshake_line(client, hs, hs->buf) < 0)
+			return -1;
 	}
-	if (!(flags & (FLAG_REQUEST_HAS_UPGRADE | FLAG_REQUEST_HAS_CONNECTION | FLAG_REQUEST_VALID_ACCEPT)))
-	{
-		LIBWSCLIENT_ON_ERROR(client, "Remote web server did not respond with expcet ( update, accept, connection) header during handshake");
-		return NULL;
-	}
+	return 0;
+}
+
+// 握手完成: 准备压缩流和发送缓冲区，回调 onopen。
+int libwsclient_handshake_done(wsclient *client)
+{
 #ifdef DEBUG
 	// LIBWSCLIENT_ON_INFO(client, "websocket握手完成.\n");
 #endif
+	if (client->deflate && libwsclient_deflate_init(client) < 0)
+		return -1;
+	// onopen 中就可以发送。
+	if (libwsclient_alloc_send_buf(client) < 0)
+		return -1;
 	update_wsclient_status(client, 0, FLAG_CLIENT_CONNECTING);
 
 	if (client->onopen != NULL)
 	{
 		client->onopen(client);
 	}
-	return NULL;
+	return 0;
 }
 
-// somewhat hackish stricmp
-int stricmp(const char *s1, const char *s2)
+// 默认模式的握手线程: 用 poll 驱动握手状态机，完成后把 socket 改回阻塞，由 libwsclient_start_run 创建 run 线程。
+// 失败时关闭 socket，sockfd 为 0。
+void *libwsclient_handshake_thread(void *ptr)
 {
-	register unsigned char c1, c2;
-	register unsigned char flipbit = ~(1 << 5);
-	do
+	wsclient *client = (wsclient *)ptr;
+	const char *err = NULL;
+	wsclient_handshake *hs = libwsclient_handshake_new(client);
+	if (!hs)
+		return NULL;
+	client->hs = hs;
+	int r = libwsclient_handshake_start(client, hs, &err);
+	while (r == 0)
 	{
-		c1 = (unsigned char)*s1++ & flipbit;
-		c2 = (unsigned char)*s2++ & flipbit;
-		if (c1 == '\0')
-			return c1 - c2;
-	} while (c1 == c2);
-	return c1 - c2;
+		struct pollfd pfd;
+		pfd.fd = libwsclient_handshake_fd(client, hs);
+		pfd.events = POLLIN | (libwsclient_handshake_wants_write(client, hs) ? POLLOUT : 0);
+		int timeout = -1;
+		if (hs->deadline)
+		{
+			unsigned long long now = libwsclient_now_ms();
+			timeout = hs->deadline <= now ? 0 : hs->deadline - now > INT_MAX ? INT_MAX : (int)(hs->deadline - now);
+		}
+		int n = poll(&pfd, 1, timeout);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+		{
+			err = "Error while waiting for handshake";
+			r = -1;
+		}
+		else if (n == 0)
+			r = libwsclient_handshake_expire(client, hs, &err);
+		else
+		{
+			uint32_t events = (pfd.revents & POLLIN ? EPOLLIN : 0) | (pfd.revents & POLLOUT ? EPOLLOUT : 0) |
+							  (pfd.revents & POLLERR ? EPOLLERR : 0) | (pfd.revents & POLLHUP ? EPOLLHUP : 0);
+			r = libwsclient_handshake_step(client, hs, events, &err);
+		}
+	}
+	client->hs = NULL;
+	libwsclient_handshake_free(client, hs);
+	if (r > 0)
+	{
+		// run 线程阻塞读，非阻塞模式在 libwsclient_start_run 中重新设置。
+		int fl = fcntl(client->sockfd, F_GETFL, 0);
+		if (fl >= 0 && fcntl(client->sockfd, F_SETFL, fl & ~O_NONBLOCK) == 0)
+		{
+			update_wsclient_status(client, 0, FLAG_CLIENT_NONBLOCK);
+			libwsclient_handshake_done(client);
+			return NULL;
+		}
+		err = "Unable to switch socket to blocking mode";
+	}
+	if (err)
+	{
+		LIBWSCLIENT_ON_ERROR(client, (char *)err);
+	}
+	if (client->sockfd > 0)
+	{
+		close(client->sockfd);
+		pthread_mutex_lock(&client->lock);
+		client->sockfd = 0;
+		pthread_mutex_unlock(&client->lock);
+	}
+	return NULL;
 }
 
-size_t _libwsclient_read(wsclient *c, void *buf, size_t length)
+// 握手之后切换为非阻塞 socket，并创建唤醒 run 线程用的管道。
+int libwsclient_set_nonblocking(wsclient *c)
 {
-	size_t n = 0;
-	char* sp = "";
+	int fl = fcntl(c->sockfd, F_GETFL, 0);
+	if (fl < 0 || pipe(c->wake_fd) < 0)
+		return -1;
+	for (int i = 0; i < 2; i++)
+		fcntl(c->wake_fd[i], F_SETFL, fcntl(c->wake_fd[i], F_GETFL, 0) | O_NONBLOCK);
+	if (fcntl(c->sockfd, F_SETFL, fl | O_NONBLOCK) < 0)
+		return -1;
+	update_wsclient_status(c, FLAG_CLIENT_NONBLOCK, 0);
+	return 0;
+}
 
-	if (TEST_FLAG(c, FLAG_CLIENT_IS_SSL))
+// 非阻塞模式 (或开启了零拷贝): 等待 socket 可读。out_buf 中有数据时同时等待可写，可写时接着写出。
+static int libwsclient_wait_readable(wsclient *c, bool want_write)
+{
+	for (;;)
 	{
-		sp = "ssl";
-		n = (ssize_t)SSL_read(c->ssl, buf, length);
+		struct pollfd pfd[2];
+		pfd[0].fd = c->sockfd;
+		pfd[0].events = POLLIN;
+		if (want_write || libwsclient_out_pending(c))
+			pfd[0].events |= POLLOUT;
+		pfd[1].fd = c->wake_fd[0];
+		pfd[1].events = POLLIN;
+		int n = poll(pfd, 2, -1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		if (pfd[1].revents & POLLIN)
+		{
+			char tmp[64];
+			while (read(c->wake_fd[0], tmp, sizeof(tmp)) > 0)
+				;
+		}
+		if (pfd[0].revents & POLLOUT)
+			libwsclient_on_socket_writable(c);
+		if (pfd[0].revents & (POLLIN | POLLHUP))
+			return 0;
+		// 错误队列中的零拷贝完成通知也会报告 POLLERR；没有通知时是真正的错误，交给 recv 报告。
+		if ((pfd[0].revents & POLLERR) && !(TEST_FLAG(c, FLAG_CLIENT_ZEROCOPY) && libwsclient_on_socket_errqueue(c)))
+			return 0;
 	}
-	else
+}
+
+ssize_t _libwsclient_read(wsclient *c, void *buf, size_t length)
+{
+	ssize_t n = 0;
+	char* sp = "";
+
+	for (;;)
 	{
-		n = recv(c->sockfd, buf, length, 0);
+		if (TEST_FLAG(c, FLAG_CLIENT_IS_SSL))
+		{
+			sp = "ssl";
+			n = libwsclient_tls_read(c, buf, length);
+		}
+		else
+		{
+			// 阻塞 socket 上 recv 不会因零拷贝完成通知返回，先 poll。
+			if (TEST_FLAG(c, FLAG_CLIENT_ZEROCOPY) && !TEST_FLAG(c, FLAG_CLIENT_NONBLOCK) && libwsclient_wait_readable(c, false) < 0)
+				return -1;
+			n = recv(c->sockfd, buf, length, 0);
+			if (n < 0 && errno == EINTR)
+				continue;
+		}
+		if (n >= 0 || !TEST_FLAG(c, FLAG_CLIENT_NONBLOCK) || (errno != EAGAIN && errno != EWOULDBLOCK))
+			break;
+		// 事件循环模式下由 loop (或应用) 等待可读，握手中由握手状态机的驱动方等待。
+		if (c->loop || c->external_loop || c->hs)
+			break;
+		if (libwsclient_wait_readable(c, false) < 0)
+			return -1;
 	}
 #ifdef DEBUG
 	char buff[256] = {0};
 	sprintf(buff, "wsclient %s read %ld bytes.",sp, n);
 	LIBWSCLIENT_ON_INFO(c, buff);
 	c->onmessage(c, 0, n, buf);
+#else
+	(void)sp;
 #endif
 	return n;
 }
 
-size_t _libwsclient_write(wsclient *c, const void *buf, size_t length)
+// 分配 recv_buf (多一个字节给文本消息补 '\0')，握手发出请求之前调用。
+int libwsclient_alloc_recv_buf(wsclient *c)
+{
+	if (c->recv_buf)
+		return 0;
+	if (c->recv_buf_size < RECV_BUF_MIN_SIZE)
+		c->recv_buf_size = RECV_BUF_MIN_SIZE;
+	c->recv_buf = malloc(c->recv_buf_size + 1);
+	if (!c->recv_buf)
+	{
+		LIBWSCLIENT_ON_ERROR(c, "Unable to allocate receive buffer.\n");
+		return -1;
+	}
+	return 0;
+}
+
+// 分配 send_buf，握手完成时 (onopen 之前) 调用。
+int libwsclient_alloc_send_buf(wsclient *c)
+{
+	if (c->send_buf)
+		return 0;
+	if (c->send_buf_size < SEND_BUF_MIN_SIZE)
+		c->send_buf_size = SEND_BUF_MIN_SIZE;
+	c->send_buf = malloc(c->send_buf_size);
+	if (!c->send_buf)
+	{
+		LIBWSCLIENT_ON_ERROR(c, "Unable to allocate send buffer.\n");
+		return -1;
+	}
+	return 0;
+}
+
+// 非阻塞模式: 写一次，返回写出的字节数；socket 写满时返回 0，出错返回 -1。
+// TLS 连接写的是已加密的数据，out_buf 中缓存的也是密文。
+ssize_t libwsclient_write_some(wsclient *c, const void *buf, size_t length)
+{
+	ssize_t len;
+	do
+		len = send(c->sockfd, buf, length, 0);
+	while (len < 0 && errno == EINTR);
+	c->stats.writes++;
+	if (len < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+	c->stats.bytes_out += len;
+	return len;
+}
+
+// 检查未写出字节数，越过高低水位时回调。调用方持有 send_busy。
+void libwsclient_check_water(wsclient *c)
+{
+	size_t buffered = libwsclient_get_buffered_amount(c);
+	if (!c->write_high && c->write_high_water && buffered > c->write_high_water)
+	{
+		c->write_high = true;
+		if (c->onhighwater)
+			c->onhighwater(c, buffered);
+	}
+	else if (c->write_high && buffered <= c->write_low_water)
+	{
+		c->write_high = false;
+		if (c->onlowwater)
+			c->onlowwater(c, buffered);
+	}
+}
+
+// out_buf 由空变为非空 (writable 为 true) 或已经写完时调用: 让 run 线程 (或 loop) 开始或停止等待 socket 可写。
+static int libwsclient_watch_writable(wsclient *c, bool writable)
+{
+	if (c->loop || c->external_loop || c->hs)
+		return libwsclient_loop_watch(c, writable);
+	if (writable && write(c->wake_fd[1], "w", 1) < 0 && errno != EAGAIN)
+		return -1;
+	return 0;
+}
+
+// 把写不下的数据追加到 out_buf。out_buf 由空变为非空时唤醒 run 线程等待可写。
+int libwsclient_out_append(wsclient *c, const void *buf, size_t length)
+{
+	if (length == 0)
+		return 0;
+	if (c->out_start > 0 && c->out_start + c->out_len + length > c->out_buf_size)
+	{
+		memmove(c->out_buf, c->out_buf + c->out_start, c->out_len);
+		c->out_start = 0;
+	}
+	if (c->out_len + length > c->out_buf_size)
+	{
+		// 第一次按 send_buf_size，之后翻倍，不够时按需要的大小。握手期间 (alloc_send_buf 之前) send_buf_size 可能是 0。
+		size_t need = c->out_len + length;
+		size_t size = c->out_buf_size ? 2 * c->out_buf_size : c->send_buf_size;
+		if (size < need)
+			size = need;
+		unsigned char *p = realloc(c->out_buf, size);
+		if (!p)
+			return -1;
+		c->out_buf = p;
+		c->out_buf_size = size;
+	}
+	bool was_empty = c->out_len == 0;
+	memcpy(c->out_buf + c->out_start + c->out_len, buf, length);
+	__atomic_store_n(&c->out_len, c->out_len + length, __ATOMIC_SEQ_CST);
+	if (was_empty && libwsclient_watch_writable(c, true) < 0)
+		return -1;
+	libwsclient_check_water(c);
+	return 0;
+}
+
+// 写出 out_buf 中缓存的数据，直到写完或 socket 写满。调用方持有 send_busy。
+// 返回 0 表示没有出错 (out_len 为 0 时已写完)，-1 表示出错。
+int libwsclient_flush_out_buf(wsclient *c)
+{
+	if (c->out_len == 0)
+		return 0;
+	while (c->out_len > 0)
+	{
+		ssize_t n = libwsclient_write_some(c, c->out_buf + c->out_start, c->out_len);
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			break;
+		c->out_start += n;
+		__atomic_store_n(&c->out_len, c->out_len - n, __ATOMIC_SEQ_CST);
+	}
+	if (c->out_len == 0)
+	{
+		c->out_start = 0;
+		if (libwsclient_watch_writable(c, false) < 0)
+			return -1;
+	}
+	libwsclient_check_water(c);
+	if (c->out_len == 0 && c->onwritable)
+		c->onwritable(c);
+	return 0;
+}
+
+// 非阻塞模式下 run 线程发现 socket 可写时调用: 写出 out_buf，再写出写满期间排队的消息。
+// 其他线程正在写时由它负责，这里不等待: 暂停等待可写 (socket 水平触发，否则会一直报告可写而空转)，
+// 由它在 libwsclient_unlock_send 时恢复。先登记再试一次写权限，与解锁后检查登记配对，两边不会都错过。
+void libwsclient_on_socket_writable(wsclient *c)
+{
+	if (!libwsclient_try_lock_send(c))
+	{
+		libwsclient_loop_watch(c, false);
+		__atomic_store_n(&c->write_deferred, true, __ATOMIC_SEQ_CST);
+		if (!libwsclient_try_lock_send(c))
+			return;
+		__atomic_store_n(&c->write_deferred, false, __ATOMIC_SEQ_CST);
+	}
+	int ret = libwsclient_flush_out_buf(c);
+	// 可能是从暂停中恢复的，没写完时重新等待可写。
+	if (ret == 0 && c->out_len > 0)
+		ret = libwsclient_loop_watch(c, true);
+	libwsclient_unlock_send(c);
+	if (ret < 0)
+	{
+		LIBWSCLIENT_ON_ERROR(c, "Error sending data");
+		return;
+	}
+	if (!c->async_send)
+		libwsclient_flush_send_queue(c);
+}
+
+// 写出整块数据，部分写入时继续写，直到写完或出错。
+// 非阻塞模式下写到 socket 写满为止，剩下的追加到 out_buf 由 run 线程在可写时写出，不阻塞。
+// 握手之后只由持有 send_busy 的线程(或发送线程)调用，一条消息的写入不会与其他线程交错。
+// 返回写出(或缓存)的字节数；出错返回 -1。
+ssize_t _libwsclient_write(wsclient *c, const void *buf, size_t length)
 {
-	pthread_mutex_lock(&c->send_lock);
 	ssize_t len = 0;
+	size_t z = 0;
 	char* sp = "";
 	if (TEST_FLAG(c, FLAG_CLIENT_IS_SSL))
+		return libwsclient_tls_write(c, buf, length);
+	if (TEST_FLAG(c, FLAG_CLIENT_NONBLOCK))
 	{
-		sp = "ssl";
-		len = (ssize_t) SSL_write(c->ssl, buf, length);
+		// out_buf 中还有数据时，新数据只能排在后面。
+		if (libwsclient_flush_out_buf(c) < 0)
+			return -1;
+		while (c->out_len == 0 && z < length)
+		{
+			len = libwsclient_write_some(c, (const char *)buf + z, length - z);
+			if (len < 0)
+				return -1;
+			if (len == 0)
+				break;
+			z += len;
+		}
+		return libwsclient_out_append(c, (const char *)buf + z, length - z) < 0 ? -1 : (ssize_t)length;
 	}
-	else
+	while (z < length)
 	{
-		sp = "";
-		len =  send(c->sockfd, buf, length, 0);
+		len = send(c->sockfd, (const char *)buf + z, length - z, 0);
+		if (len < 0 && errno == EINTR)
+			continue;
+		c->stats.writes++;
+		if (len <= 0)
+			break;
+		z += len;
 	}
-	pthread_mutex_unlock(&c->send_lock);
+	c->stats.bytes_out += z;
 #ifdef DEBUG
 	char buff[256] = {0};
-	sprintf(buff, "wsclient %s send %ld of %ld bytes.",sp, len, length);
+	sprintf(buff, "wsclient %s send %ld of %ld bytes.",sp, z, length);
 	LIBWSCLIENT_ON_INFO(c, buff);
+#else
+	(void)sp;
 #endif
-	return len;
+	return z == length ? (ssize_t)z : -1;
+}
+
+// 跳过 iov 中已写出的 len 字节。
+static void libwsclient_iov_advance(struct iovec **piov, int *pcnt, size_t len)
+{
+	struct iovec *iov = *piov;
+	int cnt = *pcnt;
+	while (cnt > 0 && len >= iov->iov_len)
+	{
+		len -= iov->iov_len;
+		iov++;
+		cnt--;
+	}
+	if (cnt > 0)
+	{
+		iov->iov_base = (char *)iov->iov_base + len;
+		iov->iov_len -= len;
+	}
+	*piov = iov;
+	*pcnt = cnt;
+}
+
+// writev 写出多块数据，部分写入时调整 iov 继续写。iov 会被修改。plain socket 专用。
+// 非阻塞模式下 socket 写满时，剩下的各块追加到 out_buf。
+ssize_t _libwsclient_writev(wsclient *c, struct iovec *iov, int cnt)
+{
+	size_t z = 0;
+	bool nonblock = TEST_FLAG(c, FLAG_CLIENT_NONBLOCK);
+	if (nonblock && libwsclient_flush_out_buf(c) < 0)
+		return -1;
+	while (cnt > 0)
+	{
+		if (nonblock && c->out_len > 0)
+		{
+			for (; cnt > 0; iov++, cnt--)
+			{
+				if (libwsclient_out_append(c, iov->iov_base, iov->iov_len) < 0)
+					return -1;
+				z += iov->iov_len;
+			}
+			break;
+		}
+		ssize_t len = writev(c->sockfd, iov, cnt);
+		c->stats.writes++;
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && nonblock && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			// 第一块追加后 out_len 非空，其余各块在下一轮循环追加。
+			if (libwsclient_out_append(c, iov->iov_base, iov->iov_len) < 0)
+				return -1;
+			z += iov->iov_len;
+			iov++;
+			cnt--;
+			continue;
+		}
+		if (len <= 0)
+			return -1;
+		z += len;
+		c->stats.bytes_out += len;
+		libwsclient_iov_advance(&iov, &cnt, len);
+	}
+	return z;
+}
+
+// 开启 SO_ZEROCOPY，plain socket 专用。
+int libwsclient_enable_zerocopy(wsclient *c)
+{
+	int one = 1;
+	if (setsockopt(c->sockfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0)
+		return -1;
+	update_wsclient_status(c, FLAG_CLIENT_ZEROCOPY, 0);
+	return 0;
+}
+
+// 用 MSG_ZEROCOPY 写出 iov，iov 会被修改。内核不拷贝数据，在完成通知之前数据不能修改。
+// 内核拒绝 (ENOBUFS) 或非阻塞模式下写满时，剩下的部分改用普通写 (拷贝)。
+// 返回用掉的通知序号个数 (每次成功的 sendmsg 一个)，出错返回 -1。调用方持有 send_busy。
+int _libwsclient_write_zerocopy(wsclient *c, struct iovec *iov, int cnt)
+{
+	int ids = 0;
+	while (cnt > 0)
+	{
+		if (c->out_len > 0)
+			return _libwsclient_writev(c, iov, cnt) < 0 ? -1 : ids;
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = cnt;
+		ssize_t len = sendmsg(c->sockfd, &msg, MSG_ZEROCOPY);
+		c->stats.writes++;
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && (errno == ENOBUFS || errno == EAGAIN || errno == EWOULDBLOCK))
+			return _libwsclient_writev(c, iov, cnt) < 0 ? -1 : ids;
+		if (len <= 0)
+			return -1;
+		ids++;
+		c->zc_seq++;
+		c->stats.bytes_out += len;
+		libwsclient_iov_advance(&iov, &cnt, len);
+	}
+	return ids;
+}
+
+// 完成通知的序号区间 [lo, hi] 中属于消息 [first, last] 的 sendmsg 数。
+// 序号是 32 位的，长连接上会回绕 (区间可以跨过 0)，按差值的符号比较先后，不能直接比大小。
+unsigned int libwsclient_zc_overlap(unsigned int lo, unsigned int hi, unsigned int first, unsigned int last)
+{
+	unsigned int a = (int32_t)(lo - first) > 0 ? lo : first;
+	unsigned int b = (int32_t)(hi - last) < 0 ? hi : last;
+	return (int32_t)(b - a) >= 0 ? b - a + 1 : 0;
+}
+
+// 读取错误队列中的零拷贝完成通知 (序号区间)，扣减各消息的 remaining。
+// 返回所有 sendmsg 都已完成的消息，已从 zc_pending 中摘下，按发送顺序排列。nread 不为 NULL 时返回读到的通知数。
+// 调用方持有 send_busy。
+wsclient_zc_msg *libwsclient_reap_zerocopy(wsclient *c, int *nread)
+{
+	wsclient_zc_msg *done = NULL, **done_tail = &done;
+	if (nread)
+		*nread = 0;
+	for (;;)
+	{
+		char control[128];
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(c->sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			break;
+		if (nread)
+			(*nread)++;
+		for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+		{
+			if (!((cm->cmsg_level == IPPROTO_IP && cm->cmsg_type == IP_RECVERR) || (cm->cmsg_level == IPPROTO_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+				continue;
+			struct sock_extended_err *ee = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			// 通知可能合并、乱序，按区间与各消息的序号区间求交。
+			wsclient_zc_msg **pp = &c->zc_pending;
+			while (*pp)
+			{
+				wsclient_zc_msg *zm = *pp;
+				zm->remaining -= libwsclient_zc_overlap(ee->ee_info, ee->ee_data, zm->first, zm->last);
+				if (zm->remaining == 0)
+				{
+					*pp = zm->next;
+					zm->next = NULL;
+					*done_tail = zm;
+					done_tail = &zm->next;
+				}
+				else
+					pp = &zm->next;
+			}
+		}
+	}
+	return done;
+}
+
+// 按顺序回调 onzerocopy 并释放。
+void libwsclient_complete_zerocopy(wsclient *c, wsclient_zc_msg *list)
+{
+	while (list)
+	{
+		wsclient_zc_msg *next = list->next;
+		if (c->onzerocopy)
+			c->onzerocopy(c, list->payload, list->cookie);
+		free(list);
+		list = next;
+	}
+}
+
+// run 线程 (或 loop) 发现错误队列有数据时调用。返回 false 表示没有零拷贝通知 (是真正的 socket 错误)。
+bool libwsclient_on_socket_errqueue(wsclient *c)
+{
+	if (!libwsclient_try_lock_send(c))
+	{
+		sched_yield();
+		return true;
+	}
+	int n;
+	wsclient_zc_msg *done = libwsclient_reap_zerocopy(c, &n);
+	libwsclient_unlock_send(c);
+	libwsclient_complete_zerocopy(c, done);
+	return n > 0;
 }
 
 void update_wsclient_status(wsclient *c, int add, int del)
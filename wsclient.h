@@ -9,18 +9,140 @@
 #include <stddef.h>
 #include <stdbool.h>
 */
-#define MAX_PAYLOAD_SIZE 1024
+#define MAX_PAYLOAD_SIZE 1024	// 默认发送分片大小，见 wsclient_options.fragment_size
+#define SEND_BATCH_IOV_MAX 64	// 发送线程一次 writev 最多合并的消息数
+#define TLS_BIO_BUF_SIZE (64 * 1024)	// TLS BIO pair 每个方向的缓冲区大小，一次最多从 socket 读入这么多密文
+#define FRAME_RSV1 0x40			// 帧头第一字节的 RSV1 位，permessage-deflate 用来标记压缩的消息
+#define LOOP_MAX_EVENTS 256		// 事件循环一次 epoll_wait 最多取的事件数
+#define LOOP_READ_BUDGET 16		// 事件循环每轮每个连接最多读几次，读不完的下一轮接着读，避免一个连接占住线程
+#define RESOLVER_THREADS 4		// 所有连接共享的 DNS 解析线程数上限
 
-size_t _libwsclient_read(wsclient *c, void *buf, size_t length);
-size_t _libwsclient_write(wsclient *c, const void *buf, size_t length);
-int libwsclient_open_connection(const char *host, const char *port);
-int stricmp(const char *s1, const char *s2);
+// 待发送 payload 的读取位置，payload 可以分散在多个 iovec 中。
+typedef struct _wsclient_payload
+{
+	const struct iovec *iov;	// 当前块
+	int iovcnt;					// 剩余块数 (含当前块)
+	size_t off;					// 当前块中已读取的字节数
+} wsclient_payload;
+
+// 异步 DNS 解析请求，见 resolve.c。
+typedef struct _wsclient_resolve wsclient_resolve;
+
+// 握手过程中的状态，libwsclient_start_run (或握手线程) 中分配，握手完成后释放。
+typedef struct _wsclient_handshake
+{
+	int state;					// 握手阶段 HANDSHAKE_*
+	char host[200];
+	char port[10];
+	char path[255];
+	char accept[32];			// 期望的 Sec-WebSocket-Accept
+	int flags;					// 响应中已校验的部分 FLAG_REQUEST_*
+	wsclient_resolve *resolve;	// 进行中的 DNS 解析
+	struct addrinfo *addrs;		// 解析出的地址
+	struct addrinfo *addr;		// 正在连接的地址
+	unsigned long long deadline;	// 当前阶段的超时时刻 (libwsclient_now_ms)，不晚于 expires，0 表示没有
+	unsigned long long expires;		// 整个握手的超时时刻，0 表示不限
+	char buf[1024];				// 响应中还没收全的一行
+	size_t len;
+} wsclient_handshake;
+
+enum _HANDSHAKE_STATE_
+{
+	HANDSHAKE_RESOLVE = 1,	// DNS 解析中
+	HANDSHAKE_CONNECT,		// 等待 TCP 连接建立
+	HANDSHAKE_TLS,			// TLS 握手中
+	HANDSHAKE_RESPONSE,		// 已发出升级请求，等待响应
+};
+
+ssize_t _libwsclient_read(wsclient *c, void *buf, size_t length);
+ssize_t _libwsclient_write(wsclient *c, const void *buf, size_t length);
+ssize_t _libwsclient_writev(wsclient *c, struct iovec *iov, int cnt);
+int libwsclient_alloc_recv_buf(wsclient *c);
+int libwsclient_alloc_send_buf(wsclient *c);
+int libwsclient_set_nonblocking(wsclient *c);
+int libwsclient_flush_out_buf(wsclient *c);
+ssize_t libwsclient_write_some(wsclient *c, const void *buf, size_t length);
+int libwsclient_out_append(wsclient *c, const void *buf, size_t length);
+void libwsclient_check_water(wsclient *c);
+void libwsclient_on_socket_writable(wsclient *c);
+bool libwsclient_out_pending(wsclient *c);
+bool libwsclient_on_socket_errqueue(wsclient *c);
+int libwsclient_enable_zerocopy(wsclient *c);
+int _libwsclient_write_zerocopy(wsclient *c, struct iovec *iov, int cnt);
+unsigned int libwsclient_zc_overlap(unsigned int lo, unsigned int hi, unsigned int first, unsigned int last);
+wsclient_zc_msg *libwsclient_reap_zerocopy(wsclient *c, int *nread);
+void libwsclient_complete_zerocopy(wsclient *c, wsclient_zc_msg *list);
+int libwsclient_flush_send_buf(wsclient *client);
+size_t libwsclient_mask_payload(unsigned char *dst, wsclient_payload *src, size_t len, const unsigned char *mask, size_t offset);
+size_t libwsclient_encode_frame(unsigned char *dst, bool fin, int opcode, wsclient_payload *payload, unsigned long long len);
+int libwsclient_send_frame(wsclient *client, bool fin, int opcode, wsclient_payload *payload, unsigned long long len);
+size_t libwsclient_encode_header(unsigned char *header, bool fin, int opcode, unsigned long long len, const unsigned char *mask);
 void libwsclient_handle_control_frame(wsclient *c, wsclient_frame_in *ctl_frame);
 void *libwsclient_run_thread(void *ptr);
+void *libwsclient_send_thread(void *ptr);
+int libwsclient_write_batch(wsclient *c, wsclient_send_node **nodes, int cnt);
+void libwsclient_queue_init(wsclient_send_queue *q);
+void libwsclient_queue_push(wsclient_send_queue *q, wsclient_send_node *node);
+wsclient_send_node *libwsclient_queue_pop(wsclient_send_queue *q);
+bool libwsclient_try_lock_send(wsclient *c);
+void libwsclient_unlock_send(wsclient *c);
+int libwsclient_flush_send_queue(wsclient *c);
+int libwsclient_write_send_queue(wsclient *c);
+bool libwsclient_ctrl_pending(wsclient *c);
+int libwsclient_write_ctrl_queue(wsclient *c);
+ssize_t libwsclient_fill_recv(wsclient *c);
+int libwsclient_process_recv(wsclient *c);
+int libwsclient_reserve_msg_buf(wsclient *c, unsigned long long len);
+void libwsclient_fail(wsclient *c, int code, char *msg);
 void *libwsclient_handshake_thread(void *ptr);
-void handle_on_data_frame_in(wsclient *c, wsclient_frame_in *pframe);
-void libwsclient_send_data(wsclient *client, int opcode, unsigned char *payload, unsigned long long payload_len);
-void libwsclient_send_string(wsclient *client, char *payload);
+int libwsclient_parse_uri(wsclient *client, wsclient_handshake *hs);
+int libwsclient_handshake_request(wsclient *client, wsclient_handshake *hs, char *buf, size_t size);
+int libwsclient_handshake_response(wsclient *client, wsclient_handshake *hs, const char *data, size_t len, size_t *used);
+int libwsclient_handshake_done(wsclient *client);
+unsigned long long libwsclient_now_ms(void);
+wsclient_handshake *libwsclient_handshake_new(wsclient *c);
+void libwsclient_handshake_free(wsclient *c, wsclient_handshake *hs);
+int libwsclient_handshake_fd(wsclient *c, wsclient_handshake *hs);
+bool libwsclient_handshake_wants_write(wsclient *c, wsclient_handshake *hs);
+int libwsclient_handshake_start(wsclient *c, wsclient_handshake *hs, const char **err);
+int libwsclient_handshake_step(wsclient *c, wsclient_handshake *hs, uint32_t events, const char **err);
+int libwsclient_handshake_expire(wsclient *c, wsclient_handshake *hs, const char **err);
+wsclient_resolve *libwsclient_resolve_start(const char *host, const char *port);
+int libwsclient_resolve_fd(wsclient_resolve *r);
+bool libwsclient_resolve_result(wsclient_resolve *r, struct addrinfo **addrs, int *status);
+void libwsclient_resolve_cancel(wsclient_resolve *r);
+int handle_on_data_frame_in(wsclient *c, wsclient_frame_in *pframe);
+void libwsclient_deflate_offer(wsclient *c, char *buf, size_t size);
+int libwsclient_deflate_accept(wsclient *c, const char *value);
+int libwsclient_deflate_init(wsclient *c);
+void libwsclient_deflate_free(wsclient *c);
+ssize_t libwsclient_deflate_message(wsclient *c, const struct iovec *iov, int iovcnt);
+ssize_t libwsclient_inflate_message(wsclient *c, const unsigned char *in, size_t len);
+SSL_CTX *libwsclient_ssl_ctx_acquire(void);
+void libwsclient_ssl_ctx_release(SSL_CTX *ctx);
+void libwsclient_ssl_resume(wsclient *c, const char *host);
+int libwsclient_tls_setup(wsclient *c, const char *host, const char *port);
+int libwsclient_tls_attach(wsclient *c);
+int libwsclient_tls_connect(wsclient *c);
+int libwsclient_tls_flush(wsclient *c);
+bool libwsclient_tls_output_pending(wsclient *c);
+int libwsclient_tls_flush_pending(wsclient *c);
+ssize_t libwsclient_tls_read(wsclient *c, void *buf, size_t length);
+ssize_t libwsclient_tls_write(wsclient *c, const void *buf, size_t length);
+int libwsclient_inflate_fragment(wsclient *c, const unsigned char *in, size_t len, bool is_final);
+int libwsclient_send_data(wsclient *client, int opcode, const unsigned char *payload, unsigned long long payload_len);
+int libwsclient_send_close(wsclient *client, const unsigned char *payload, unsigned long long payload_len);
+int libwsclient_send_string(wsclient *client, const char *payload);
+void libwsclient_free(wsclient *client);
+int libwsclient_loop_add(wsclient_loop *loop, wsclient *c);
+bool libwsclient_loop_close(wsclient *c);
+void libwsclient_loop_wait(wsclient *c);
+int libwsclient_loop_watch(wsclient *c, bool writable);
+void libwsclient_loop_resume_write(wsclient *c);
+int libwsclient_loop_rewatch(wsclient *c, int old_fd, int new_fd);
+size_t libwsclient_loop_clients(wsclient_loop *loop);
+bool libwsclient_poll_close(wsclient *c);
+wsclient_loop *libwsclient_runtime_pick(wsclient_runtime *rt);
 void update_wsclient_status(wsclient *c, int add, int del);
 
 #endif /* WSCLIENT_H_ */